@@ -2,14 +2,54 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
 #include <limits.h>           // For UCHAR_MAX
+#include <unistd.h>           // For sysconf
+#include <sys/stat.h>         // For mkdir
+#include <sys/resource.h>     // CPU time for the run statistics database
+#include <stdatomic.h>        // Lock-free metrics counters
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>         // Memory-mapped elementary stream input
+#ifdef __GLIBC__
+#include <execinfo.h>         // Thread backtraces in watchdog dumps
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>        // SSE/AVX kernels, compiled per function with target attributes
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/buffer.h>
+#include <libavutil/cpu.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/mathematics.h>
+#include <libavutil/spherical.h>
+#include <libavutil/stereo3d.h>
+#include <libavutil/time.h>
 #include <libswscale/swscale.h>
 #include <x265.h>            // x265 encoder
 
+// FFmpeg 6.1 brought the codec parameters' side data used for the spatial media boxes
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(60, 31, 100) || LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(60, 16, 100)
+#error "FFmpeg 6.1 or newer is required"
+#endif
+
+// MV-HEVC view decoding and the sized stereo3d allocator arrived in FFmpeg 7.1; older
+// libraries decode the base view only
+#define HAVE_MV_HEVC (LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(59, 39, 100) && \
+                      LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 19, 100))
+
 // Configuration parameters
 #define INPUT_WIDTH 5760     // Input stereo width
 #define INPUT_HEIGHT 2880    // Input height
@@ -22,7 +62,498 @@
 // Enable fMP4 muxing
 #define ENABLE_MP4_MUXING 1  // Set to 1 to output fMP4, 0 for raw HEVC
 
+// SIMD levels the hand-written kernels, libav and x265 can be bound to
+typedef enum {
+    CPU_LEVEL_AUTO = -1,     // Pick the best level the host supports
+    CPU_LEVEL_C = 0,         // Portable C only
+    CPU_LEVEL_SSE41,         // x86 SSE4.1
+    CPU_LEVEL_AVX2,          // x86 AVX2 (Haswell, Zen)
+    CPU_LEVEL_AVX512,        // x86 AVX-512 (Ice Lake, Zen 4)
+    CPU_LEVEL_NEON           // ARM NEON (Graviton)
+} CpuLevel;
+
+// CPU dispatch state, filled once at startup by init_cpu_dispatch()
+typedef struct {
+    CpuLevel detected;       // Best level supported by this host
+    CpuLevel active;         // Level all kernels are bound to
+    int forced;              // 1 if the level came from --cpu
+} CpuDispatch;
+
+static CpuDispatch cpu_dispatch = { CPU_LEVEL_C, CPU_LEVEL_C, 0 };
+
+// Perceptual hash (--phash): DCT of a PHASH_SIZE x PHASH_SIZE luma thumbnail, of which the
+// lowest PHASH_COEFFS x PHASH_COEFFS frequencies become 64 bits
+#define PHASH_SIZE 32
+#define PHASH_COEFFS 8
+#define PHASH_MAGIC "HEVCPHS1"
+#define PHASH_VERSION 1
+
+// Hand-written kernels, bound to one implementation per level by bind_kernels()
+typedef const uint8_t *(*FindStartCodeFn)(const uint8_t *p, const uint8_t *end);
+typedef void (*DctProjectFn)(const float *basis, const float *x, float *out, int n);
+
+typedef struct {
+    FindStartCodeFn find_start_code;    // First 00 00 01 in [p, end), or end
+    CpuLevel find_start_code_level;
+    DctProjectFn dct_project;           // out[PHASH_COEFFS][n] = basis[PHASH_COEFFS][PHASH_SIZE] * x[PHASH_SIZE][n]
+    CpuLevel dct_project_level;
+} KernelTable;
+
+static KernelTable kernels;
+
+// Elementary stream input
+#define ES_SNIFF_SIZE 4096           // Leading bytes checked for an Annex-B start code
+#define HEVC_NAL_TYPES 64
+
+// Bounded input probing, used only when the container does not declare the stream
+#define PROBE_SIZE (2 * 1024 * 1024)   // Enough for the parameter sets and one 5.7K IDR picture
+#define PROBE_ANALYZE_US 500000
+
+// Mezzanine proxy of the cropped eye (--write-proxy), decoded instead of the source by later runs
+#define PROXY_WIDTH 1440
+#define PROXY_HEIGHT 1440
+#define PROXY_CRF 12.0                 // Near-transparent for a 200x200 target
+#define PROXY_HASH_BYTES (1024 * 1024) // Read from each end of the source for its identity hash
+
+// Spherical video metadata (--projection); the output is one eye of the source, so it is mono
+typedef enum {
+    PROJECTION_AUTO,         // Carry over the input's projection, if it declares one
+    PROJECTION_NONE,
+    PROJECTION_EQUIRECT,     // Full 360x180 equirectangular
+    PROJECTION_VR180,        // Equirectangular covering the front 180x180
+} Projection;
+#define HEVC_SEI_EQUIRECT_PROJECTION 150   // equirectangular_projection SEI payload type
+#define HEVC_SEI_RECOVERY_POINT 6          // recovery_point SEI payload type
+
+// Eye encoded from the stereo source (--eye): a half of side-by-side frames, or a view of
+// MV-HEVC input. The left eye is the MV-HEVC base view, so the second layer is never decoded
+typedef enum {
+    EYE_LEFT,
+    EYE_RIGHT,
+} Eye;
+
+// Inputs combined with the main one (--right-input, --mosaic) are decoded on their own threads
+// and matched to the main input's frames by timestamp
+#define SOURCE_QUEUE 8               // Decoded frames buffered ahead of the main input
+#define MOSAIC_MAX 16                // Inputs tiled into one picture (--mosaic)
+typedef enum {
+    STEREO_SIDE_BY_SIDE,             // Both eyes scaled into the halves of the output picture
+    STEREO_PER_EYE,                  // Left eye to the output, right eye to --right-output
+} StereoLayout;
+
+// Trick-play side outputs: thumbnail sprite sheets with a WebVTT map (--thumbnails) and an
+// HLS I-frame playlist over the fMP4 fragments (--iframe-playlist)
+#define THUMB_COLUMNS 10
+#define THUMB_ROWS 10
+#define THUMB_QUEUE 16               // Thumbnails waiting for the sprite thread before new ones are dropped
+#define THUMB_JPEG_QSCALE 3
+
+// Extra outputs of the same encode (--also), each written by its own thread
+#define SINK_MAX 4
+#define SINK_QUEUE 256               // Packets buffered per extra output, about 5 s at 50 fps
+typedef enum {
+    SINK_POLICY_BLOCK,               // A full queue stalls the encoder until the sink catches up
+    SINK_POLICY_DROP,                // A full queue drops packets for that sink up to its next keyframe
+} SinkPolicy;
+
+// Header-only pre-scan (--scan)
+#define SCAN_RBSP_SIZE 128             // Leading RBSP bytes unescaped per NAL, enough for SPS/PPS/slice headers
+#define SCAN_MAX_PPS 64
+// Rough single-core costs for the medium preset, used until measured runs say otherwise
+#define SCAN_COST_DECODE_NS_PER_PIXEL 2.5
+#define SCAN_COST_DECODE_NS_PER_BIT 4.0
+#define SCAN_COST_SCALE_NS_PER_PIXEL 0.5
+#define SCAN_COST_ENCODE_NS_PER_PIXEL 60.0
+
+// One GOP found by the pre-scan, starting at an IRAP picture (or at the stream start)
+typedef struct {
+    int64_t start_frame;
+    int64_t offset;        // Byte offset of the first access unit
+    int64_t frames;
+    int64_t bytes;
+    int irap_type;         // NAL type of the opening picture, -1 if the stream does not start on an IRAP
+} ScanGop;
+
+typedef struct {
+    int width, height;
+    int pps_extra_bits[SCAN_MAX_PPS];   // num_extra_slice_header_bits per PPS id
+    int64_t frames;
+    int64_t bytes;
+    int64_t type_frames[3];             // Indexed by slice_type: B, P, I
+    int64_t type_bytes[3];
+    ScanGop *gops;
+    int gop_count;
+    int gop_capacity;
+} ScanState;
+
+// Autotune calibration
+#define FORCED_IDR_QUEUE 32          // Forced keyframes in flight inside a libavcodec encoder
+#define AUTOTUNE_FRAMES 90           // Frames decoded+encoded per candidate configuration
+#define AUTOTUNE_WARMUP_FRAMES 15    // Leading frames excluded from the fps measurement
+#define AUTOTUNE_CACHE_FILE "hevc_processor_tune.txt"  // Per-host profile cache name
+
+// Run statistics database and cost model (--predict)
+#define RUN_STATS_FILE "hevc_processor_runs.csv"
+#define RUN_STATS_FIELDS 22
+#define PREDICT_FEATURES 4             // Intercept, decoded Mpx, input Mbit, encoded Mpx
+#define PREDICT_MIN_SAMPLES 8          // Below this the fixed model is only rescaled
+#define PREDICT_RIDGE 1e-3             // Ridge strength, relative to the mean feature energy
+
+// Random-access frame extraction (--extract)
+#define EXTRACT_SEEK_GAP 2.0           // Seconds ahead beyond which an unindexed input is seeked rather than decoded
+
+typedef struct {
+    int64_t target;        // Requested position in the stream time base
+    int index;             // Line of the request, which is also its slot in the output
+} ExtractRequest;
+
+// Thread split between the decoder and x265
+typedef struct {
+    int decoder_threads;     // libav decoder threads (1 = libav default)
+    int frame_threads;       // x265 frameNumThreads
+    int pool_threads;        // x265 worker pool size, 0 lets x265 decide
+} ThreadProfile;
+
+static const ThreadProfile default_thread_profile = { 1, 4, 0 };
+
+// Per-frame encoder statistics
+#define FRAME_STATS_RING 512         // Frames that can be inside x265 at once (lookahead + B + frame threads)
+#define FRAME_STATS_TYPES 6          // Indexed by X265_TYPE_* (AUTO..B)
+
+// Pipeline stages timed for the metrics endpoint and the report
+typedef enum {
+    STAGE_DEMUX,
+    STAGE_DECODE,
+    STAGE_SCALE,
+    STAGE_ENCODE,
+    STAGE_MUX,
+    STAGE_COUNT
+} PipelineStage;
+
+// Live pipeline counters, written with relaxed atomics from the hot path
+typedef struct {
+    atomic_llong stage_frames[STAGE_COUNT];  // Frames that went through each stage
+    atomic_llong stage_busy_us[STAGE_COUNT]; // Time spent inside each stage
+    atomic_llong stage_enter_us[STAGE_COUNT];// When the current call entered the stage, 0 when idle
+    atomic_llong stage_heartbeat_us[STAGE_COUNT]; // When the stage last finished a call
+    atomic_llong slow_calls[STAGE_COUNT];    // Stage calls that took longer than frame_budget_us
+    atomic_llong slow_call_us[STAGE_COUNT];  // Duration of the latest of them
+    atomic_llong last_input_pts;             // PTS of the last decoded frame
+    atomic_llong last_output_pts;            // PTS of the last frame returned by the encoder
+    atomic_llong frames_in;                  // Frames decoded
+    atomic_llong frames_submitted;           // Frames handed to the encoder
+    atomic_llong frames_out;                 // Frames returned by the encoder
+    atomic_llong frames_dropped;             // Frames lost to decode errors
+    atomic_llong frames_skipped;             // Frames left out on purpose (skip mode)
+    atomic_llong bytes_out;                  // Encoded bytes written
+    atomic_llong expected_frames;            // Input frame count estimate, 0 if unknown
+    atomic_llong first_packet_us;            // Launch to first encoded packet written, 0 until then
+    int64_t launch_time;                     // av_gettime_relative() when the process started
+    int64_t start_time;                      // av_gettime_relative() when processing began
+    int output_fps;                          // Output frame rate, for bitrate
+    int64_t frame_budget_us;                 // Slow stage call threshold (--frame-budget), 0 disables
+} PipelineMetrics;
+
+static PipelineMetrics pipeline_metrics;
+static const char *stage_names[STAGE_COUNT] = { "demux", "decode", "scale", "encode", "mux" };
+
+// Watchdog
+#define WATCHDOG_POLL_MS 1000        // How often stage heartbeats are checked
+#define WATCHDOG_EXIT_CODE 75        // EX_TEMPFAIL, tells the orchestrator to retry elsewhere
+#define WATCHDOG_BACKTRACE_DEPTH 64
+
+#define METRICS_MAX_CLIENTS_BACKLOG 8
+#define METRICS_RESPONSE_SIZE 8192
+
+typedef struct {
+    FILE *file;                            // CSV or JSON output, NULL when disabled
+    int json;                              // 1 for JSON, 0 for CSV
+    char summary_path[PATH_MAX];           // CSV only: per-type summary, <name>_summary.csv
+    int frames;                            // Frames recorded so far
+    int64_t submit_time[FRAME_STATS_RING]; // av_gettime_relative() at submission, by frame index
+    int64_t type_count[FRAME_STATS_TYPES]; // Frames per slice type
+    int64_t type_bits[FRAME_STATS_TYPES];  // Bits per slice type
+    int64_t type_min_bits[FRAME_STATS_TYPES];
+    int64_t type_max_bits[FRAME_STATS_TYPES];
+    double type_qp_sum[FRAME_STATS_TYPES];
+    double latency_sum_ms;
+    double latency_max_ms;
+} FrameStats;
+
+// One encoded access unit as handed from an encoder backend to the output
+typedef struct {
+    uint8_t *data;           // Bitstream (Annex-B for HEVC/H.264), owned by the backend until the next call
+    int size;
+    int64_t pts;             // In the output timebase
+    int64_t dts;
+    int keyframe;            // 1 for random access points
+    int recovery;            // 1 for the first picture of an intra refresh cycle, not a sync sample
+    int frame_type;          // X265_TYPE_*, also used for libavcodec encoders
+    int poc;                 // Picture order count, -1 if the backend does not report it
+    double qp;               // Average QP, 0 if unknown
+    double psnr_y;           // PSNR when the backend computes it, 0 otherwise
+    double psnr;
+} EncodedPacket;
+
+// Sidecar index of a raw HEVC output (--es-index): a header, then one fixed-size record per
+// access unit in decode order, in host (little-endian) byte order so loaders can mmap it
+#define ES_INDEX_MAGIC "HEVCIDX1"
+#define ES_INDEX_VERSION 1
+#define ES_INDEX_KEYFRAME 0x1
+#define ES_INDEX_RECOVERY 0x2        // Intra refresh recovery point (--intra-refresh)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;    // sizeof(EsIndexRecord), 32
+    int32_t timebase_num;    // Of pts and dts
+    int32_t timebase_den;
+    uint64_t record_count;   // Written when the output is closed, 0 while it is incomplete
+} EsIndexHeader;
+
+typedef struct {
+    uint64_t offset;         // Byte offset of the access unit in the output file
+    uint32_t size;
+    uint32_t flags;          // ES_INDEX_KEYFRAME for random access points (IDR, parameter sets included)
+    int64_t pts;             // Rebased like the output file, so each split segment starts at 0
+    int64_t dts;
+} EsIndexRecord;
+
+// Sidecar of data stream packets (--data-streams) when the output cannot carry them: a header,
+// then per packet one fixed-size record followed by its payload
+#define DATA_SIDECAR_MAGIC "HEVCDAT1"
+#define DATA_SIDECAR_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;    // sizeof(DataRecord), 32
+    int32_t timebase_num;    // Of pts and duration
+    int32_t timebase_den;
+    uint64_t reserved;
+} DataSidecarHeader;
+
+typedef struct {
+    uint32_t stream_index;   // Input stream the packet came from
+    uint32_t codec_tag;      // Of that stream, e.g. 'gpmd' or 'camm'
+    uint32_t size;           // Payload bytes following the record
+    uint32_t flags;          // AV_PKT_FLAG_* of the input packet
+    int64_t pts;             // On the output video's timeline
+    int64_t duration;
+} DataRecord;
+
+// Perceptual hash sidecar (--phash): a header, then one record per hashed frame
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;    // sizeof(PhashRecord), 16
+    int32_t timebase_num;    // Of pts
+    int32_t timebase_den;
+    uint64_t reserved;
+} PhashHeader;
+
+typedef struct {
+    int64_t pts;             // Output timestamp of the frame
+    uint64_t hash;           // Bit k*8+j set when DCT coefficient (k, j) is above the median
+} PhashRecord;
+
+// Hashes the scaled pictures of every interval-th encoded frame
+typedef struct {
+    FILE *file;
+    int interval;
+    struct SwsContext *sws_ctx;   // Scaled luma down to PHASH_SIZE x PHASH_SIZE
+    float basis[PHASH_COEFFS * PHASH_SIZE];
+    int64_t count;
+} PhashWriter;
+
+struct ProcessingContext;
+
+// Encoder backend: every encoder the output path can be fed from
+typedef struct {
+    const char *name;
+    int (*open)(struct ProcessingContext *ctx);
+    // Out-of-band parameter sets; size 0 if the backend only emits them in-band
+    int (*headers)(struct ProcessingContext *ctx, EncodedPacket *pkt);
+    // Encode the frame in scaled_buffer
+    int (*send_frame)(struct ProcessingContext *ctx, int64_t pts, int force_idr);
+    // Signal end of input
+    int (*flush)(struct ProcessingContext *ctx);
+    // 1 with a packet, 0 if more input is needed, AVERROR_EOF when fully flushed
+    int (*receive_packet)(struct ProcessingContext *ctx, EncodedPacket *pkt);
+} EncoderBackend;
+
+// Per-backend counters for the statistics report
+typedef struct {
+    int64_t open_us;         // Time spent opening the encoder
+    int64_t packets;
+    int64_t keyframes;
+    int64_t recovery_points;
+    int64_t bytes;
+} EncoderStats;
+
+// Raw Annex-B HEVC input read straight from a memory map, bypassing libavformat
 typedef struct {
+    int fd;
+    const uint8_t *data;          // Mapped file
+    size_t size;
+    const uint8_t *pos;           // Start of the next access unit
+    const uint8_t *pending_nal;   // Start code of the NAL that opens the next access unit
+    const uint8_t *pending_next;  // Start code following it
+    atomic_int refs;              // Owner plus zero-copy packets still held by the decoder
+    int64_t au_count;
+    int64_t nal_count[HEVC_NAL_TYPES];
+    int64_t nal_bytes[HEVC_NAL_TYPES];
+} EsReader;
+
+// Output file opened ahead of time so rolling over to it never waits on the filesystem. It is
+// created under a temporary name and renamed when used, so an existing file is never touched
+typedef struct {
+    pthread_t thread;
+    int pending;                  // Opener thread started and not yet joined
+    int mp4;
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32]; // Where the file is created until it is used
+    FILE *file;                   // Raw output
+    AVIOContext *pb;              // MP4 output
+} OutputOpener;
+
+// Sprite sheet writer: the encode loop queues copies of scaled pictures, a worker thread
+// tiles them, compresses full sheets to JPEG and writes the WebVTT cues
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;
+    int stop;
+    uint8_t *queue[THUMB_QUEUE];  // Scaled YUV420P pictures
+    int64_t queue_pts[THUMB_QUEUE];
+    int queue_head;
+    int queue_count;
+    int64_t interval;             // Output timebase units between thumbnails
+    int64_t next_pts;
+    int64_t dropped;
+    char stem[PATH_MAX];          // Sheets are <stem>_%03d.jpg, the map <stem>.vtt
+    AVCodecContext *jpeg;
+    AVFrame *sheet;
+    AVPacket *pkt;
+    FILE *vtt;
+    int tiles;                    // Tiles on the current sheet
+    int sheets;
+    int error;
+    uint8_t range_lut[2][256];    // Limited to full range for luma and chroma tiles
+} ThumbnailWriter;
+
+typedef struct {
+    uint8_t *data;                // Private copy, the encoder reuses its buffers
+    int size;
+    int keyframe;
+    int recovery;
+    int64_t pts;
+    int64_t dts;
+} SinkPacket;
+
+// Extra output fed with copies of the encoded packets: the encode loop queues them, a writer
+// thread owns the file or muxer, so a slow disk or pipe only affects its own sink
+typedef struct {
+    const char *path;
+    int raw;                      // Annex-B elementary stream, otherwise a libavformat muxer
+    FILE *file;
+    AVFormatContext *ofmt_ctx;
+    AVDictionary *mux_opts;
+    int fragmented;               // Fragmented MP4: intra refresh recovery points open fragments
+    AVPacket *pkt;
+    uint8_t *headers;             // Parameter sets written at the start of a raw sink
+    int headers_size;
+    int64_t duration;             // Packet duration in output timebase units
+    SinkPolicy policy;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;          // Signalled when a packet is queued or taken, and on stop
+    SinkPacket queue[SINK_QUEUE];
+    int queue_head;
+    int queue_count;
+    int running;
+    int stop;
+    int error;
+    int header_written;
+    int resync;                   // Drop policy: packets were dropped, wait for a keyframe
+    int64_t written;
+    int64_t dropped;
+    int64_t bytes;
+} Sink;
+
+// Input decoded by its own thread into a short queue of frames, which the encode loop pairs
+// with the main input's frames
+typedef struct {
+    const char *path;
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *decoder;
+    int stream_idx;
+    AVPacket *pkt;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;          // Signalled when a frame is queued or taken, at the end and on stop
+    AVFrame *queue[SOURCE_QUEUE];
+    int64_t queue_time[SOURCE_QUEUE]; // Microseconds since the first frame of the input
+    int queue_head;
+    int queue_count;
+    int running;
+    int stop;
+    int eof;
+    int error;                    // The input ended on a read error rather than its end
+    AVFrame *current;             // Picture paired with the current main input frame
+    int have_current;
+    int64_t start;                // First timestamp, which the inputs are aligned on
+    int64_t frames;
+    int64_t paired;
+    int64_t dropped;              // Frames with no main input partner
+    int64_t repeated;             // Main input frames shown with the previous picture
+} FrameSource;
+
+// Right eye of a per-eye recording (--right-input)
+typedef struct {
+    FrameSource right;
+    StereoLayout layout;
+    int64_t left_start;
+    struct SwsContext *half_sws;  // One eye into half the output width (side-by-side)
+    
+    // Second x265 session for the right eye (per-eye), same settings as the main encoder
+    x265_encoder *encoder;
+    x265_param *params;
+    x265_picture *pic;
+    x265_picture *pic_out;
+    uint8_t *buffer;              // Scaled right eye
+    uint8_t *nal_buf;
+    int nal_buf_size;
+    Sink *sink;
+} StereoInput;
+
+// Monitoring wall (--mosaic): the main input and further inputs tiled into one picture for a
+// single encoder
+typedef struct {
+    FrameSource *sources;         // Tiles 1..count-1; tile 0 is the main input
+    int count;                    // Tiles, the main input included
+    int columns;
+    int tile_width;
+    int tile_height;
+    struct SwsContext *sws[MOSAIC_MAX]; // Per tile, rebuilt if its input's geometry changes
+    int64_t main_start;
+} Mosaic;
+
+// All-intra proxy encoder running next to the main encoder on the same decoded frames
+typedef struct {
+    x265_encoder *encoder;
+    x265_param *params;
+    x265_picture *pic;
+    struct SwsContext *sws_ctx;
+    uint8_t *buffer;              // Cropped and scaled picture
+    FILE *file;                   // <path>.tmp, renamed to path once the proxy is complete
+    char path[PATH_MAX];
+    int64_t frames;
+    int64_t bytes;
+} ProxyWriter;
+
+typedef struct ProcessingContext {
     // Libav decoder
     AVCodec *decoder_codec;
     AVCodecContext *decoder_ctx;
@@ -30,93 +561,552 @@ typedef struct {
     int video_stream_idx;
     AVFrame *frame;
     AVPacket *pkt;
+    EsReader *es_reader;     // Set when the input is read as a raw elementary stream
+    int no_es_fastpath;      // 1 to always go through libavformat
+    int64_t probe_us;        // Time to open, probe and set up decoding of the input
+    AVCodecParameters *input_par; // Parameters the decoder was opened with
+    
+    // Inputs decoded back-to-back into one encoder session (--concat)
+    const char **inputs;
+    int input_count;
+    int input_index;
+    char *input_list;        // Backing storage of the list file for inputs
+    
+    // Frame counters
+    int frame_count;         // Frames encoded
+    int input_frame_count;   // Frames decoded
+    int force_idr;           // Start a closed GOP at the next encoded frame
+    
+    // Multiple output files: one per input (--clips) or split by duration/size (--split-*)
+    int clip_mode;
+    const char *output_pattern;   // printf pattern taking the output index
+    char output_pattern_buf[PATH_MAX];
+    int64_t *clip_start_pts;      // Output PTS of each clip's first frame, -1 until it is encoded
+    int output_index;             // Clip or segment whose packets are being written
+    int64_t output_pts_base;      // Subtracted from timestamps written to the current output
+    int64_t split_duration;       // Segment length in output timebase units, 0 for no limit
+    int64_t split_bytes;          // Segment size limit, 0 for no limit
+    int64_t segment_start_pts;    // PTS of the current segment's first packet, -1 before it
+    int64_t segment_bytes;
+    OutputOpener opener;          // Next output file, opened in the background
     
     // Crop and scale
     struct SwsContext *sws_ctx;
     uint8_t *scaled_buffer;
     
+    // Mezzanine proxy: written during this run (--write-proxy) or decoded instead of the source
+    ProxyWriter proxy;
+    int from_proxy;          // Input is a proxy, already cropped to one eye at PROXY_WIDTH x PROXY_HEIGHT
+    Eye eye;
+    int base_view_id;        // MV-HEVC view ID of the first view decoded, -1 before any
+    StereoInput stereo;      // Right-eye input of a per-eye recording (--right-input)
+    Mosaic mosaic;           // Inputs tiled into one picture (--mosaic)
+    char proxy_input[PATH_MAX];
+    
+    // Encoder backend
+    const EncoderBackend *backend;
+    const char *encoder_name;   // "x265" or a libavcodec encoder name
+    enum AVCodecID out_codec_id;
+    EncoderStats enc_stats;
+    uint8_t *enc_buf;           // Packet assembly buffer
+    int enc_buf_size;
+    
     // x265 encoder
     x265_encoder *encoder;
     x265_param *encoder_params;
     x265_picture *enc_pic;
+    x265_picture *enc_pic_out;  // Statistics of the frame each encode call returns
+    int x265_pending;           // 1 if 'x265_out' holds a packet not yet received
+    int x265_flushing;
+    EncodedPacket x265_out;
+    int enable_psnr;            // 1 to have x265 compute per-frame PSNR
+    int intra_refresh;          // 1 for periodic intra refresh instead of periodic IDRs
+    FrameStats frame_stats;
+    
+    // libavcodec encoder
+    AVCodecContext *av_enc_ctx;
+    AVFrame *av_enc_frame;
+    AVPacket *av_enc_pkt;
+    int64_t forced_idr_pts[FORCED_IDR_QUEUE]; // Forced keyframes not yet out of the encoder, in order
+    int forced_idr_head;
+    int forced_idr_count;
     
     // File I/O for raw HEVC
     FILE *output_file;
+    int es_index_enabled;    // Write a frame offset index next to each raw output (--es-index)
+    FILE *es_index;
+    int64_t es_offset;       // Bytes written to the current raw output
+    uint64_t es_index_records;
     
     // Muxing output to MP4
     AVFormatContext *ofmt_ctx;
     AVStream *out_stream;
-    int64_t pts_offset;
-    int64_t next_pts;
-    uint8_t *extradata;
-    int extradata_size;
+    AVPacket *mux_pkt;
+    
+    // Parameter sets, written at the start of every output file
+    uint8_t *stream_headers;
+    int stream_headers_size;
+    
+    // Trick-play side outputs
+    ThumbnailWriter thumbs;
+    PhashWriter phash;
+    int iframe_playlist;        // Write <output>_iframes.m3u8 next to every MP4 output
+    int64_t *keyframe_pts;      // Keyframes of the current MP4 output, one per fragment
+    int keyframe_count;
+    int keyframe_capacity;
+    int64_t output_end_pts;
+    
+    // Extra outputs of the same encode (--also), fed after the main output
+    Sink *sinks[SINK_MAX];
+    int sink_count;
+    
+    // Data streams copied without decoding (--data-streams): muxed when the output takes them
+    int data_passthrough;
+    int *data_stream_map;       // Output stream per input stream, -1 for streams not muxed
+    int data_stream_count;      // Entries in data_stream_map
+    uint64_t *data_layout;      // Per stream of the first input: codec id and tag of data streams, 0 otherwise
+    int data_layout_count;
+    FILE *data_sidecar;         // <output>.data for data streams that are not muxed
+    int64_t data_offset;        // Output time at which the current input starts (--concat)
+    int64_t data_packets;
+    
+    // Spherical metadata: side data on the MP4 stream, an SEI in raw x265 output
+    Projection projection;
+    x265_sei_payload projection_sei;
+    uint8_t projection_sei_data[1];
     
     // Processing options
     int skip_frames;        // 1 to skip every other frame, 0 to process all frames
     int mp4_output;         // 1 to output MP4, 0 for raw HEVC
+    ThreadProfile threads;  // Decoder/encoder thread split
+    int timestamp_increment; // Output timebase units per frame
 } ProcessingContext;
 
-// Initialize x265 encoder with better quality settings
-int init_encoder(ProcessingContext *ctx) {
-    // Allocate param structure
-    ctx->encoder_params = x265_param_alloc();
-    if (!ctx->encoder_params) {
-        fprintf(stderr, "Failed to allocate encoder parameters\n");
+// Name of a SIMD level as accepted by --cpu and printed in the report
+const char *cpu_level_name(CpuLevel level) {
+    switch (level) {
+        case CPU_LEVEL_AUTO:   return "auto";
+        case CPU_LEVEL_C:      return "c";
+        case CPU_LEVEL_SSE41:  return "sse4.1";
+        case CPU_LEVEL_AVX2:   return "avx2";
+        case CPU_LEVEL_AVX512: return "avx512";
+        case CPU_LEVEL_NEON:   return "neon";
+    }
+    return "unknown";
+}
+
+// Parse a numeric option that must be a positive number, returns 0 on success
+int parse_positive(const char *arg, double *value) {
+    char *end;
+    errno = 0;
+    double v = strtod(arg, &end);
+    if (end == arg || *end || errno || !(v > 0) || isinf(v)) {
+        return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+// Parse a --cpu argument, returns 0 on success
+int parse_cpu_level(const char *name, CpuLevel *level) {
+    for (int l = CPU_LEVEL_AUTO; l <= CPU_LEVEL_NEON; l++) {
+        if (strcmp(name, cpu_level_name((CpuLevel)l)) == 0) {
+            *level = (CpuLevel)l;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Detect the best SIMD level this host can run
+CpuLevel detect_cpu_level(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    // Only use AVX-512 when the byte/word and vector-length subsets are present
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vl")) {
+        return CPU_LEVEL_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return CPU_LEVEL_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return CPU_LEVEL_SSE41;
+    }
+    return CPU_LEVEL_C;
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+    // NEON is mandatory on AArch64
+    return CPU_LEVEL_NEON;
+#else
+    return CPU_LEVEL_C;
+#endif
+}
+
+// Check whether a level can run on a host whose best level is 'detected'
+int cpu_level_supported(CpuLevel level, CpuLevel detected) {
+    if (level == CPU_LEVEL_C) {
+        return 1;
+    }
+    if (level == CPU_LEVEL_NEON || detected == CPU_LEVEL_NEON) {
+        return level == detected;
+    }
+    return level <= detected;
+}
+
+// libav CPU flags matching a SIMD level, used when the level is forced
+int cpu_level_av_flags(CpuLevel level) {
+    int flags = 0;
+    switch (level) {
+        case CPU_LEVEL_AVX512:
+            flags |= AV_CPU_FLAG_AVX512;
+            // fall through
+        case CPU_LEVEL_AVX2:
+            flags |= AV_CPU_FLAG_SSE42 | AV_CPU_FLAG_AVX | AV_CPU_FLAG_AVX2 |
+                     AV_CPU_FLAG_FMA3 | AV_CPU_FLAG_BMI1 | AV_CPU_FLAG_BMI2;
+            // fall through
+        case CPU_LEVEL_SSE41:
+            flags |= AV_CPU_FLAG_MMX | AV_CPU_FLAG_MMXEXT | AV_CPU_FLAG_CMOV |
+                     AV_CPU_FLAG_SSE | AV_CPU_FLAG_SSE2 | AV_CPU_FLAG_SSE3 |
+                     AV_CPU_FLAG_SSSE3 | AV_CPU_FLAG_SSE4;
+            break;
+        case CPU_LEVEL_NEON:
+            flags = AV_CPU_FLAG_ARMV8 | AV_CPU_FLAG_NEON;
+            break;
+        default:
+            break;
+    }
+    return flags;
+}
+
+// Find the next Annex-B start code (00 00 01), scalar version
+// Skips ahead by up to 3 bytes whenever the pattern cannot start at p
+const uint8_t *find_start_code_c(const uint8_t *p, const uint8_t *end) {
+    while (end - p >= 3) {
+        if (p[2] > 1) {
+            p += 3;
+        } else if (p[1]) {
+            p += 2;
+        } else if (p[0] || p[2] != 1) {
+            p++;
+        } else {
+            return p;
+        }
+    }
+    return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 is the baseline of the SSE4.1 level; 16 candidate positions per step
+__attribute__((target("sse4.1")))
+const uint8_t *find_start_code_sse41(const uint8_t *p, const uint8_t *end) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    while (end - p >= 18) {
+        __m128i b0 = _mm_loadu_si128((const __m128i *)p);
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(p + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i *)(p + 2));
+        __m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+                                    _mm_cmpeq_epi8(b2, one));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return find_start_code_c(p, end);
+}
+
+__attribute__((target("avx2")))
+const uint8_t *find_start_code_avx2(const uint8_t *p, const uint8_t *end) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    while (end - p >= 34) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+        __m256i b2 = _mm256_loadu_si256((const __m256i *)(p + 2));
+        __m256i hit = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)),
+                                       _mm256_cmpeq_epi8(b2, one));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return find_start_code_sse41(p, end);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+const uint8_t *find_start_code_avx512(const uint8_t *p, const uint8_t *end) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i one = _mm512_set1_epi8(1);
+    while (end - p >= 66) {
+        __m512i b0 = _mm512_loadu_si512((const void *)p);
+        __m512i b1 = _mm512_loadu_si512((const void *)(p + 1));
+        __m512i b2 = _mm512_loadu_si512((const void *)(p + 2));
+        __mmask64 mask = _mm512_cmpeq_epi8_mask(b0, zero) & _mm512_cmpeq_epi8_mask(b1, zero) &
+                         _mm512_cmpeq_epi8_mask(b2, one);
+        if (mask) {
+            return p + __builtin_ctzll(mask);
+        }
+        p += 64;
+    }
+    return find_start_code_avx2(p, end);
+}
+#endif
+
+#if defined(__ARM_NEON)
+const uint8_t *find_start_code_neon(const uint8_t *p, const uint8_t *end) {
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    while (end - p >= 18) {
+        uint8x16_t b0 = vld1q_u8(p);
+        uint8x16_t b1 = vld1q_u8(p + 1);
+        uint8x16_t b2 = vld1q_u8(p + 2);
+        uint8x16_t hit = vandq_u8(vandq_u8(vceqq_u8(b0, zero), vceqq_u8(b1, zero)), vceqq_u8(b2, one));
+        // Narrow each byte lane to a nibble so the mask fits in 64 bits
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+        if (mask) {
+            return p + (__builtin_ctzll(mask) >> 2);
+        }
+        p += 16;
+    }
+    return find_start_code_c(p, end);
+}
+#endif
+
+// Project PHASH_SIZE rows of x onto the first PHASH_COEFFS DCT basis vectors, scalar version
+// Accumulates in the same order as the vector versions, so every level gives the same hashes
+// (the Makefile turns off FMA contraction, which would round the scalar sums differently)
+void dct_project_c(const float *basis, const float *x, float *out, int n) {
+    for (int k = 0; k < PHASH_COEFFS; k++) {
+        for (int j = 0; j < n; j++) {
+            float sum = 0;
+            for (int i = 0; i < PHASH_SIZE; i++) {
+                float term = basis[k * PHASH_SIZE + i] * x[i * n + j];
+                sum += term;
+            }
+            out[k * n + j] = sum;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Vectorized across the n columns; n is a multiple of 4 (SSE) or 8 (AVX2)
+__attribute__((target("sse4.1")))
+void dct_project_sse41(const float *basis, const float *x, float *out, int n) {
+    for (int k = 0; k < PHASH_COEFFS; k++) {
+        for (int j = 0; j < n; j += 4) {
+            __m128 sum = _mm_setzero_ps();
+            for (int i = 0; i < PHASH_SIZE; i++) {
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(basis[k * PHASH_SIZE + i]), _mm_loadu_ps(x + i * n + j)));
+            }
+            _mm_storeu_ps(out + k * n + j, sum);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void dct_project_avx2(const float *basis, const float *x, float *out, int n) {
+    for (int k = 0; k < PHASH_COEFFS; k++) {
+        for (int j = 0; j < n; j += 8) {
+            __m256 sum = _mm256_setzero_ps();
+            for (int i = 0; i < PHASH_SIZE; i++) {
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(basis[k * PHASH_SIZE + i]),
+                                                       _mm256_loadu_ps(x + i * n + j)));
+            }
+            _mm256_storeu_ps(out + k * n + j, sum);
+        }
+    }
+}
+#endif
+
+#if defined(__ARM_NEON)
+void dct_project_neon(const float *basis, const float *x, float *out, int n) {
+    for (int k = 0; k < PHASH_COEFFS; k++) {
+        for (int j = 0; j < n; j += 4) {
+            float32x4_t sum = vdupq_n_f32(0);
+            for (int i = 0; i < PHASH_SIZE; i++) {
+                // Separate multiply and add, not fused, to match the scalar rounding
+                sum = vaddq_f32(sum, vmulq_n_f32(vld1q_f32(x + i * n + j), basis[k * PHASH_SIZE + i]));
+            }
+            vst1q_f32(out + k * n + j, sum);
+        }
+    }
+}
+#endif
+
+// Bind every kernel to the best implementation available at the active level
+void bind_kernels(CpuLevel level) {
+    kernels.find_start_code = find_start_code_c;
+    kernels.find_start_code_level = CPU_LEVEL_C;
+    kernels.dct_project = dct_project_c;
+    kernels.dct_project_level = CPU_LEVEL_C;
+    
+#if defined(__x86_64__) || defined(__i386__)
+    if (level == CPU_LEVEL_AVX512) {
+        kernels.find_start_code = find_start_code_avx512;
+        kernels.dct_project = dct_project_avx2;
+        kernels.dct_project_level = CPU_LEVEL_AVX2;
+    } else if (level == CPU_LEVEL_AVX2) {
+        kernels.find_start_code = find_start_code_avx2;
+        kernels.dct_project = dct_project_avx2;
+    } else if (level == CPU_LEVEL_SSE41) {
+        kernels.find_start_code = find_start_code_sse41;
+        kernels.dct_project = dct_project_sse41;
+    }
+#elif defined(__ARM_NEON)
+    if (level == CPU_LEVEL_NEON) {
+        kernels.find_start_code = find_start_code_neon;
+        kernels.dct_project = dct_project_neon;
+    }
+#endif
+    if (kernels.find_start_code != find_start_code_c) {
+        kernels.find_start_code_level = level;
+    }
+    // A 32-wide row is only four AVX-512 vectors, so that level keeps the AVX2 kernel
+    if (kernels.dct_project != dct_project_c && kernels.dct_project_level == CPU_LEVEL_C) {
+        kernels.dct_project_level = level;
+    }
+}
+
+// Detect CPU features and bind every kernel to the chosen level
+int init_cpu_dispatch(CpuLevel requested) {
+    cpu_dispatch.detected = detect_cpu_level();
+    cpu_dispatch.forced = requested != CPU_LEVEL_AUTO;
+    cpu_dispatch.active = cpu_dispatch.forced ? requested : cpu_dispatch.detected;
+    
+    if (!cpu_level_supported(cpu_dispatch.active, cpu_dispatch.detected)) {
+        fprintf(stderr, "CPU level '%s' is not supported on this host (best: %s)\n",
+                cpu_level_name(cpu_dispatch.active), cpu_level_name(cpu_dispatch.detected));
+        return -1;
+    }
+    
+    // Decoder and swscale pick their own SIMD, so only restrict them when forced
+    if (cpu_dispatch.forced) {
+        av_force_cpu_flags(cpu_level_av_flags(cpu_dispatch.active));
+    }
+    
+    bind_kernels(cpu_dispatch.active);
+    return 0;
+}
+
+// Bind x265 primitives to the active level
+int apply_cpu_level_to_x265(x265_param *params) {
+    // x265 never enables AVX-512 on its own, so always pass the level explicitly
+    const char *asm_name = "0";
+    switch (cpu_dispatch.active) {
+        case CPU_LEVEL_SSE41:  asm_name = "sse4.1"; break;
+        case CPU_LEVEL_AVX2:   asm_name = "avx2";   break;
+        case CPU_LEVEL_AVX512: asm_name = "avx512"; break;
+        case CPU_LEVEL_NEON:   asm_name = "neon";   break;
+        default:               break;
+    }
+    
+    if (x265_param_parse(params, "asm", asm_name) != 0) {
+        fprintf(stderr, "x265 rejected asm level '%s'\n", asm_name);
         return -1;
     }
     
+    return 0;
+}
+
+// Output settings of the x265 backend, shared by every x265 session writing the output
+static int set_x265_output_params(ProcessingContext *ctx, x265_param *param) {
     // Set defaults for preset - use 'medium' instead of 'ultrafast' for better quality
-    x265_param_default_preset(ctx->encoder_params, "medium", "zerolatency");
+    x265_param_default_preset(param, "medium", "zerolatency");
     
     // Configure encoder for better quality while maintaining reasonable speed
-    ctx->encoder_params->sourceWidth = OUTPUT_WIDTH;
-    ctx->encoder_params->sourceHeight = OUTPUT_HEIGHT;
+    param->sourceWidth = OUTPUT_WIDTH;
+    param->sourceHeight = OUTPUT_HEIGHT;
     
     // Set frame rate - this is how x265 defines timebase internally
     int output_fps = ctx->skip_frames ? FRAME_RATE / 2 : FRAME_RATE;
-    ctx->encoder_params->fpsNum = output_fps;
-    ctx->encoder_params->fpsDenom = 1;
+    param->fpsNum = output_fps;
+    param->fpsDenom = 1;
     
     // Note: x265 doesn't have a direct timebase parameter, it derives it from fps
     
-    ctx->encoder_params->internalCsp = X265_CSP_I420;
+    param->internalCsp = X265_CSP_I420;
     
     // Quality settings
-    ctx->encoder_params->bframes = 3;                // Allow B-frames for better compression
-    ctx->encoder_params->maxNumReferences = 3;       // More reference frames for better quality
-    ctx->encoder_params->rc.bitrate = 3000;          // 3 Mbps for better quality
-    ctx->encoder_params->rc.qpMin = 17;              // Lower minimum QP for higher quality
-    ctx->encoder_params->rc.qpMax = 37;              // Lower maximum QP for better quality
-    ctx->encoder_params->rc.rateControlMode = X265_RC_ABR; // Average bitrate mode
+    param->bframes = 3;                // Allow B-frames for better compression
+    param->maxNumReferences = 3;       // More reference frames for better quality
+    param->rc.bitrate = 3000;          // 3 Mbps for better quality
+    param->rc.qpMin = 17;              // Lower minimum QP for higher quality
+    param->rc.qpMax = 37;              // Lower maximum QP for better quality
+    param->rc.rateControlMode = X265_RC_ABR; // Average bitrate mode
     
     // Performance settings - utilize more CPU for better quality
-    ctx->encoder_params->frameNumThreads = 4;        // Use multiple threads per frame
-    ctx->encoder_params->bEnableWavefront = 1;       // Enable wavefront parallel processing
-    ctx->encoder_params->lookaheadDepth = 20;        // Increased lookahead for better rate control
+    param->frameNumThreads = ctx->threads.frame_threads; // Frames encoded in parallel
+    param->bEnableWavefront = 1;       // Enable wavefront parallel processing
+    param->lookaheadDepth = 20;        // Increased lookahead for better rate control
     
     // Set HEVC profile and level for compatibility
-    ctx->encoder_params->bRepeatHeaders = 1;         // Include headers with each keyframe
-    ctx->encoder_params->bEmitHRDSEI = 1;            // Emit HRD info for better compatibility
-    ctx->encoder_params->keyframeMin = 1;            // Minimum GOP size
-    ctx->encoder_params->keyframeMax = 120;          // Maximum GOP size
-    ctx->encoder_params->bOpenGOP = 0;               // Closed GOP structure
-    ctx->encoder_params->levelIdc = 0;               // Let x265 choose level
+    param->bRepeatHeaders = 1;         // Include headers with each keyframe
+    param->bEmitHRDSEI = 1;            // Emit HRD info for better compatibility
+    param->keyframeMin = 1;            // Minimum GOP size
+    param->keyframeMax = 120;          // Maximum GOP size
+    param->bOpenGOP = 0;               // Closed GOP structure
+    param->levelIdc = 0;               // Let x265 choose level
+    
+    // Live outputs: after the first IDR a column of intra blocks sweeps across the picture every
+    // keyframeMax frames, each sweep starting at a recovery point SEI. Without whole intra
+    // pictures a half-second VBV can hold every frame near the average size
+    if (ctx->intra_refresh) {
+        param->bIntraRefresh = 1;
+        param->rc.vbvMaxBitrate = param->rc.bitrate;
+        param->rc.vbvBufferSize = param->rc.bitrate / 2;
+    }
     
     // Psychovisual optimizations for better perceived quality
-    ctx->encoder_params->psyRd = 1.0;                // Psychovisual rate-distortion optimization
-    ctx->encoder_params->psyRdoq = 1.0;              // Psychovisual optimization in quantization
+    param->psyRd = 1.0;                // Psychovisual rate-distortion optimization
+    param->psyRdoq = 1.0;              // Psychovisual optimization in quantization
+    
+    // PSNR costs a few percent of encode time, so only compute it on request
+    param->bEnablePsnr = ctx->enable_psnr;
+    
+    // Size the worker pool when the thread profile asks for it
+    if (ctx->threads.pool_threads > 0) {
+        char pools[16];
+        snprintf(pools, sizeof(pools), "%d", ctx->threads.pool_threads);
+        if (x265_param_parse(param, "pools", pools) < 0) {
+            fprintf(stderr, "x265 rejected pool size %s\n", pools);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Initialize x265 encoder with better quality settings
+int init_encoder(ProcessingContext *ctx) {
+    // Allocate param structure
+    ctx->encoder_params = x265_param_alloc();
+    if (!ctx->encoder_params) {
+        fprintf(stderr, "Failed to allocate encoder parameters\n");
+        return -1;
+    }
+    // Bind x265 SIMD primitives to the dispatched level
+    if (set_x265_output_params(ctx, ctx->encoder_params) < 0 ||
+        apply_cpu_level_to_x265(ctx->encoder_params) < 0) {
+        x265_param_free(ctx->encoder_params);
+        ctx->encoder_params = NULL;
+        return -1;
+    }
     
     // Create encoder
     ctx->encoder = x265_encoder_open(ctx->encoder_params);
     if (!ctx->encoder) {
         fprintf(stderr, "Failed to open x265 encoder\n");
         x265_param_free(ctx->encoder_params);
+        ctx->encoder_params = NULL;
         return -1;
     }
     
     // Allocate picture
     ctx->enc_pic = x265_picture_alloc();
     x265_picture_init(ctx->encoder_params, ctx->enc_pic);
+    ctx->enc_pic_out = x265_picture_alloc();
+    x265_picture_init(ctx->encoder_params, ctx->enc_pic_out);
     
     return 0;
 }
@@ -139,410 +1129,5791 @@ void prepare_for_encoding(ProcessingContext *ctx, int64_t pts) {
     ctx->enc_pic->colorSpace = X265_CSP_I420;
 }
 
-// Initialize MP4 muxer
-int init_mp4_muxer(ProcessingContext *ctx, const char *output_file) {
-    int ret;
-    avformat_alloc_output_context2(&ctx->ofmt_ctx, NULL, "mp4", output_file);
-    if (!ctx->ofmt_ctx) {
-        fprintf(stderr, "Could not create output context\n");
-        return -1;
+// Make sure the packet assembly buffer can hold 'size' bytes
+int ensure_enc_buf(ProcessingContext *ctx, int size) {
+    if (size <= ctx->enc_buf_size) {
+        return 0;
     }
-    
-    // Add video stream
-    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_HEVC);
-    ctx->out_stream = avformat_new_stream(ctx->ofmt_ctx, codec);
-    if (!ctx->out_stream) {
-        fprintf(stderr, "Failed to allocate output stream\n");
+    uint8_t *buf = av_realloc(ctx->enc_buf, size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate encoder packet buffer\n");
         return -1;
     }
-    
-    ctx->out_stream->id = ctx->ofmt_ctx->nb_streams - 1;
-    
-    // Configure stream parameters
-    AVCodecParameters *codecpar = ctx->out_stream->codecpar;
-    codecpar->codec_id = AV_CODEC_ID_HEVC;
-    codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
-    codecpar->width = OUTPUT_WIDTH;
-    codecpar->height = OUTPUT_HEIGHT;
-    codecpar->format = AV_PIX_FMT_YUV420P;
-    codecpar->bit_rate = ctx->encoder_params->rc.bitrate * 1000;
-    
-    // Set stream timebase - for MP4, must match the timebase we use for timestamps
-    ctx->out_stream->time_base = (AVRational){1, OUTPUT_TIMEBASE};
-    
-    // Set fragmented MP4 options
-    if (ctx->ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
-        ctx->ofmt_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    }
-    
-    // Open output file
-    if (!(ctx->ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&ctx->ofmt_ctx->pb, output_file, AVIO_FLAG_WRITE);
-        if (ret < 0) {
-            fprintf(stderr, "Could not open output file '%s'\n", output_file);
-            return -1;
-        }
-    }
-    
-    // Save initial x265 header info for extradata
-    ctx->extradata = NULL;
-    ctx->extradata_size = 0;
-    ctx->pts_offset = 0;
-    ctx->next_pts = 0;
-    
-    // Initialize with invalid PTS to detect the first real frame
-    ctx->pts_offset = AV_NOPTS_VALUE;
-    
+    ctx->enc_buf = buf;
+    ctx->enc_buf_size = size;
     return 0;
 }
 
-// Write x265 NAL units to MP4 container
-int write_nals_to_mp4(ProcessingContext *ctx, x265_nal *nals, uint32_t nal_count, int64_t pts, int is_key_frame) {
-    if (!nals || nal_count == 0) {
+// Whether an x265 NAL unit is a prefix SEI carrying a recovery point, which x265 writes at the
+// start of each intra refresh cycle
+static int x265_nal_is_recovery_point(const x265_nal *nal) {
+    if (nal->type != 39) {
         return 0;
     }
     
-    // Create AVPacket using modern API
-    AVPacket pkt = {0};
-    av_packet_unref(&pkt);
-    
-    // Calculate total size needed
+    // Skip the start code and NAL header, removing emulation prevention bytes
+    const uint8_t *p = nal->payload;
+    const uint8_t *end = nal->payload + nal->sizeBytes;
+    while (p < end && *p == 0) {
+        p++;
+    }
+    p += 3;
+    uint8_t rbsp[256];
+    int size = 0;
+    int zeros = 0;
+    for (; p < end && size < (int)sizeof(rbsp); p++) {
+        if (zeros >= 2 && *p == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = *p ? 0 : zeros + 1;
+        rbsp[size++] = *p;
+    }
+    
+    // sei_message(): payload type and size coded as runs of 0xFF plus a final byte
+    int pos = 0;
+    while (pos < size && rbsp[pos] != 0x80) {
+        int type = 0;
+        int len = 0;
+        while (pos < size && rbsp[pos] == 0xFF) {
+            type += rbsp[pos++];
+        }
+        if (pos >= size) {
+            break;
+        }
+        type += rbsp[pos++];
+        while (pos < size && rbsp[pos] == 0xFF) {
+            len += rbsp[pos++];
+        }
+        if (pos >= size) {
+            break;
+        }
+        len += rbsp[pos++];
+        if (type == HEVC_SEI_RECOVERY_POINT) {
+            return 1;
+        }
+        pos += len;
+    }
+    return 0;
+}
+
+// Concatenate x265 NAL units (which carry their own start codes) into one packet
+int pack_x265_nals(ProcessingContext *ctx, x265_nal *nals, uint32_t nal_count, EncodedPacket *pkt) {
     int total_size = 0;
     for (uint32_t i = 0; i < nal_count; i++) {
         total_size += nals[i].sizeBytes;
     }
-    
-    // Allocate buffer for packet data
-    uint8_t *packet_data = av_malloc(total_size);
-    if (!packet_data) {
-        fprintf(stderr, "Failed to allocate packet data buffer\n");
+    if (ensure_enc_buf(ctx, total_size) < 0) {
         return -1;
     }
     
-    // Copy NAL units into packet buffer
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->data = ctx->enc_buf;
+    pkt->size = total_size;
+    pkt->poc = -1;
+    
     int offset = 0;
     for (uint32_t i = 0; i < nal_count; i++) {
-        memcpy(packet_data + offset, nals[i].payload, nals[i].sizeBytes);
+        memcpy(ctx->enc_buf + offset, nals[i].payload, nals[i].sizeBytes);
         offset += nals[i].sizeBytes;
+        // NAL unit types 16-23 are IRAP (random access) pictures
+        if (nals[i].type >= 16 && nals[i].type <= 23) {
+            pkt->keyframe = 1;
+        }
+        pkt->recovery |= x265_nal_is_recovery_point(&nals[i]);
     }
     
-    // Set up packet
-    pkt.data = packet_data;
-    pkt.size = total_size;
-    pkt.pts = pkt.dts = pts;
-    pkt.duration = 0;  // Will be filled in by the muxer
-    pkt.stream_index = ctx->out_stream->index;
-    pkt.flags = is_key_frame ? AV_PKT_FLAG_KEY : 0;
+    // An IDR's own recovery point SEI adds nothing to its random access
+    pkt->recovery &= !pkt->keyframe;
+    return 0;
+}
+
+// Fill packet timing and statistics from the picture x265 returned
+void fill_x265_packet_info(ProcessingContext *ctx, x265_picture *pic_out, EncodedPacket *pkt) {
+    pkt->pts = pic_out->pts;
+    pkt->dts = pic_out->dts;
+    pkt->frame_type = pic_out->sliceType;
+    pkt->poc = pic_out->poc;
+    pkt->qp = pic_out->frameData.qp;
+    if (ctx->enable_psnr) {
+        pkt->psnr_y = pic_out->frameData.psnrY;
+        pkt->psnr = pic_out->frameData.psnr;
+    }
+}
+
+// x265 backend: parameter sets (VPS, SPS, PPS)
+int x265_backend_headers(ProcessingContext *ctx, EncodedPacket *pkt) {
+    x265_nal *nals = NULL;
+    uint32_t nal_count = 0;
+    if (x265_encoder_headers(ctx->encoder, &nals, &nal_count) < 0) {
+        fprintf(stderr, "Error getting encoder headers\n");
+        return -1;
+    }
+    return pack_x265_nals(ctx, nals, nal_count, pkt);
+}
+
+// x265 backend: encode one frame, keeping any output for x265_backend_receive_packet
+int x265_backend_send_frame(ProcessingContext *ctx, int64_t pts, int force_idr) {
+    x265_nal *nals = NULL;
+    uint32_t nal_count = 0;
     
-    // Store the latest PTS for duration calculations
-    ctx->next_pts = pts;
+    prepare_for_encoding(ctx, pts);
+    ctx->enc_pic->sliceType = force_idr ? X265_TYPE_IDR : X265_TYPE_AUTO;
     
-    // Write packet to MP4 container
-    int ret = av_interleaved_write_frame(ctx->ofmt_ctx, &pkt);
+    int ret = x265_encoder_encode(ctx->encoder, &nals, &nal_count, ctx->enc_pic, ctx->enc_pic_out);
     if (ret < 0) {
-        fprintf(stderr, "Error writing packet to output: %d\n", ret);
-        av_free(packet_data);
-        av_packet_unref(&pkt);
+        fprintf(stderr, "Error encoding frame: %d\n", ret);
         return -1;
     }
-    
-    // Free packet data
-    av_free(packet_data);
-    av_packet_unref(&pkt);
+    if (ret > 0) {
+        if (pack_x265_nals(ctx, nals, nal_count, &ctx->x265_out) < 0) {
+            return -1;
+        }
+        fill_x265_packet_info(ctx, ctx->enc_pic_out, &ctx->x265_out);
+        ctx->x265_pending = 1;
+    }
     
     return 0;
 }
 
-// Write HEVC headers (VPS, SPS, PPS) as extradata to MP4
-int write_hevc_headers_to_mp4(ProcessingContext *ctx, x265_nal *nals, uint32_t nal_count) {
-    if (!nals || nal_count == 0) {
+int x265_backend_flush(ProcessingContext *ctx) {
+    ctx->x265_flushing = 1;
+    return 0;
+}
+
+int x265_backend_receive_packet(ProcessingContext *ctx, EncodedPacket *pkt) {
+    if (ctx->x265_pending) {
+        ctx->x265_pending = 0;
+        *pkt = ctx->x265_out;
+        return 1;
+    }
+    if (!ctx->x265_flushing) {
         return 0;
     }
     
-    // Calculate total size needed
-    int total_size = 0;
-    for (uint32_t i = 0; i < nal_count; i++) {
-        total_size += nals[i].sizeBytes + 4; // 4 bytes for length prefix
+    // Drain frames still held in lookahead and frame threads
+    x265_nal *nals = NULL;
+    uint32_t nal_count = 0;
+    int ret = x265_encoder_encode(ctx->encoder, &nals, &nal_count, NULL, ctx->enc_pic_out);
+    if (ret < 0) {
+        fprintf(stderr, "Error flushing encoder: %d\n", ret);
+        return -1;
+    }
+    if (ret == 0) {
+        return AVERROR_EOF;
+    }
+    if (pack_x265_nals(ctx, nals, nal_count, pkt) < 0) {
+        return -1;
+    }
+    fill_x265_packet_info(ctx, ctx->enc_pic_out, pkt);
+    return 1;
+}
+
+void x265_backend_close(ProcessingContext *ctx) {
+    if (ctx->encoder) {
+        x265_encoder_close(ctx->encoder);
+        ctx->encoder = NULL;
+    }
+    if (ctx->encoder_params) {
+        x265_param_free(ctx->encoder_params);
+        ctx->encoder_params = NULL;
+    }
+    if (ctx->enc_pic) {
+        x265_picture_free(ctx->enc_pic);
+        ctx->enc_pic = NULL;
+    }
+    if (ctx->enc_pic_out) {
+        x265_picture_free(ctx->enc_pic_out);
+        ctx->enc_pic_out = NULL;
+    }
+}
+
+// x265 backend entry point; init_encoder() does the actual open
+int x265_backend_open(ProcessingContext *ctx) {
+    if (init_encoder(ctx) < 0) {
+        return -1;
+    }
+    ctx->out_codec_id = AV_CODEC_ID_HEVC;
+    return 0;
+}
+
+static const EncoderBackend x265_backend = {
+    "x265",
+    x265_backend_open,
+    x265_backend_headers,
+    x265_backend_send_frame,
+    x265_backend_flush,
+    x265_backend_receive_packet,
+};
+
+// libavcodec backend: open the encoder named by ctx->encoder_name with settings matching x265's
+int avcodec_backend_open(ProcessingContext *ctx) {
+    const AVCodec *codec = avcodec_find_encoder_by_name(ctx->encoder_name);
+    if (!codec || codec->type != AVMEDIA_TYPE_VIDEO) {
+        fprintf(stderr, "Unknown video encoder '%s'\n", ctx->encoder_name);
+        return -1;
     }
     
-    // Allocate buffer for extradata
-    ctx->extradata = av_mallocz(total_size);
-    if (!ctx->extradata) {
-        fprintf(stderr, "Failed to allocate extradata buffer\n");
+    ctx->av_enc_ctx = avcodec_alloc_context3(codec);
+    if (!ctx->av_enc_ctx) {
+        fprintf(stderr, "Failed to allocate encoder context\n");
         return -1;
     }
     
-    // Format headers as AVCC format (length-prefixed NALs)
-    int offset = 0;
-    for (uint32_t i = 0; i < nal_count; i++) {
-        uint32_t size = nals[i].sizeBytes;
-        ctx->extradata[offset++] = (size >> 24) & 0xFF;
-        ctx->extradata[offset++] = (size >> 16) & 0xFF;
-        ctx->extradata[offset++] = (size >> 8) & 0xFF;
-        ctx->extradata[offset++] = size & 0xFF;
-        memcpy(ctx->extradata + offset, nals[i].payload, nals[i].sizeBytes);
-        offset += nals[i].sizeBytes;
+    int output_fps = ctx->skip_frames ? FRAME_RATE / 2 : FRAME_RATE;
+    AVCodecContext *enc = ctx->av_enc_ctx;
+    enc->width = OUTPUT_WIDTH;
+    enc->height = OUTPUT_HEIGHT;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->time_base = (AVRational){1, OUTPUT_TIMEBASE};
+    enc->framerate = (AVRational){output_fps, 1};
+    enc->bit_rate = 3000 * 1000;         // Same 3 Mbps target as the x265 backend
+    enc->gop_size = 120;                 // Same maximum GOP as the x265 backend
+    enc->max_b_frames = 3;
+    enc->thread_count = 0;               // Let the encoder pick its thread count
+    
+    // MP4 needs parameter sets out of band
+    if (ctx->mp4_output) {
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
     
-    ctx->extradata_size = offset;
+    // Clip and segment boundaries need forced keyframes to be IDRs, not just I-frames; encoders
+    // without the option ignore it
+    AVDictionary *opts = NULL;
+    av_dict_set(&opts, "forced-idr", "1", 0);
+    int ret = avcodec_open2(enc, codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to open encoder '%s'\n", ctx->encoder_name);
+        return -1;
+    }
     
-    // Set the extradata in the stream codec parameters
-    ctx->out_stream->codecpar->extradata = av_mallocz(ctx->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
-    if (!ctx->out_stream->codecpar->extradata) {
-        fprintf(stderr, "Failed to allocate stream extradata\n");
-        av_free(ctx->extradata);
-        ctx->extradata = NULL;
+    ctx->av_enc_frame = av_frame_alloc();
+    ctx->av_enc_pkt = av_packet_alloc();
+    if (!ctx->av_enc_frame || !ctx->av_enc_pkt) {
+        fprintf(stderr, "Failed to allocate encoder frame\n");
         return -1;
     }
     
-    memcpy(ctx->out_stream->codecpar->extradata, ctx->extradata, ctx->extradata_size);
-    ctx->out_stream->codecpar->extradata_size = ctx->extradata_size;
+    ctx->out_codec_id = codec->id;
+    return 0;
+}
+
+int avcodec_backend_headers(ProcessingContext *ctx, EncodedPacket *pkt) {
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->data = ctx->av_enc_ctx->extradata;
+    pkt->size = ctx->av_enc_ctx->extradata_size;
+    return 0;
+}
+
+int avcodec_backend_send_frame(ProcessingContext *ctx, int64_t pts, int force_idr) {
+    AVFrame *frame = ctx->av_enc_frame;
     
-    // Create dictionary for MP4 muxer options
-    AVDictionary *opts = NULL;
-    av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    // Wrap the scaled buffer without copying
+    frame->data[0] = ctx->scaled_buffer;
+    frame->data[1] = ctx->scaled_buffer + (OUTPUT_WIDTH * OUTPUT_HEIGHT);
+    frame->data[2] = ctx->scaled_buffer + (OUTPUT_WIDTH * OUTPUT_HEIGHT) + (OUTPUT_WIDTH * OUTPUT_HEIGHT / 4);
+    frame->linesize[0] = OUTPUT_WIDTH;
+    frame->linesize[1] = OUTPUT_WIDTH / 2;
+    frame->linesize[2] = OUTPUT_WIDTH / 2;
+    frame->width = OUTPUT_WIDTH;
+    frame->height = OUTPUT_HEIGHT;
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->pts = pts;
+    frame->pict_type = force_idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    if (force_idr) {
+        frame->flags |= AV_FRAME_FLAG_KEY;
+        if (ctx->forced_idr_count < FORCED_IDR_QUEUE) {
+            ctx->forced_idr_pts[(ctx->forced_idr_head + ctx->forced_idr_count++) % FORCED_IDR_QUEUE] = pts;
+        }
+    } else {
+        frame->flags &= ~AV_FRAME_FLAG_KEY;
+    }
     
-    // Write MP4 header with options
-    int ret = avformat_write_header(ctx->ofmt_ctx, &opts);
+    int ret = avcodec_send_frame(ctx->av_enc_ctx, frame);
     if (ret < 0) {
-        fprintf(stderr, "Error writing MP4 header: %d\n", ret);
+        fprintf(stderr, "Error encoding frame: %d\n", ret);
         return -1;
     }
+    return 0;
+}
+
+int avcodec_backend_flush(ProcessingContext *ctx) {
+    return avcodec_send_frame(ctx->av_enc_ctx, NULL) < 0 ? -1 : 0;
+}
+
+int avcodec_backend_receive_packet(ProcessingContext *ctx, EncodedPacket *pkt) {
+    AVPacket *av_pkt = ctx->av_enc_pkt;
+    av_packet_unref(av_pkt);
     
-    // Free dictionary
-    av_dict_free(&opts);
+    int ret = avcodec_receive_packet(ctx->av_enc_ctx, av_pkt);
+    if (ret == AVERROR(EAGAIN)) {
+        return 0;
+    }
+    if (ret == AVERROR_EOF) {
+        return AVERROR_EOF;
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Error receiving encoded packet: %d\n", ret);
+        return -1;
+    }
+    
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->data = av_pkt->data;
+    pkt->size = av_pkt->size;
+    pkt->pts = av_pkt->pts;
+    pkt->dts = av_pkt->dts;
+    pkt->keyframe = (av_pkt->flags & AV_PKT_FLAG_KEY) != 0;
+    pkt->poc = -1;
+    pkt->frame_type = pkt->keyframe ? X265_TYPE_IDR : X265_TYPE_AUTO;
+    
+    // A forced keyframe that came out as a plain I-frame would start a clip or segment that
+    // cannot be decoded on its own
+    if (ctx->forced_idr_count > 0 && av_pkt->pts == ctx->forced_idr_pts[ctx->forced_idr_head]) {
+        ctx->forced_idr_head = (ctx->forced_idr_head + 1) % FORCED_IDR_QUEUE;
+        ctx->forced_idr_count--;
+        if (!pkt->keyframe) {
+            fprintf(stderr, "Encoder '%s' did not make the forced keyframe at pts %lld an IDR\n",
+                    ctx->encoder_name, (long long)av_pkt->pts);
+            return -1;
+        }
+    }
+    
+    // Encoders that export quality stats give us QP and picture type
+    size_t sd_size = 0;
+    uint8_t *sd = av_packet_get_side_data(av_pkt, AV_PKT_DATA_QUALITY_STATS, &sd_size);
+    if (sd && sd_size >= 5) {
+        int quality = sd[0] | (sd[1] << 8) | (sd[2] << 16) | ((uint32_t)sd[3] << 24);
+        pkt->qp = (double)quality / FF_QP2LAMBDA;
+        switch (sd[4]) {
+            case AV_PICTURE_TYPE_I: pkt->frame_type = pkt->keyframe ? X265_TYPE_IDR : X265_TYPE_I; break;
+            case AV_PICTURE_TYPE_P: pkt->frame_type = X265_TYPE_P; break;
+            case AV_PICTURE_TYPE_B: pkt->frame_type = X265_TYPE_B; break;
+            default: break;
+        }
+    }
+    
+    return 1;
+}
+
+void avcodec_backend_close(ProcessingContext *ctx) {
+    if (ctx->av_enc_ctx) {
+        avcodec_free_context(&ctx->av_enc_ctx);
+    }
+    if (ctx->av_enc_frame) {
+        av_frame_free(&ctx->av_enc_frame);
+    }
+    if (ctx->av_enc_pkt) {
+        av_packet_free(&ctx->av_enc_pkt);
+    }
+}
+
+static const EncoderBackend avcodec_backend = {
+    "libavcodec",
+    avcodec_backend_open,
+    avcodec_backend_headers,
+    avcodec_backend_send_frame,
+    avcodec_backend_flush,
+    avcodec_backend_receive_packet,
+};
+
+// Select and open the encoder backend named by ctx->encoder_name
+int init_encoder_backend(ProcessingContext *ctx) {
+    if (!ctx->encoder_name || strcmp(ctx->encoder_name, "x265") == 0) {
+        ctx->encoder_name = "x265";
+        ctx->backend = &x265_backend;
+    } else {
+        ctx->backend = &avcodec_backend;
+    }
+    
+    int64_t start = av_gettime_relative();
+    if (ctx->backend->open(ctx) < 0) {
+        return -1;
+    }
+    ctx->enc_stats.open_us = av_gettime_relative() - start;
     
+    printf("Encoder: %s (%s)\n", ctx->encoder_name, avcodec_get_name(ctx->out_codec_id));
     return 0;
 }
 
-// Clean up and free resources
-void cleanup(ProcessingContext *ctx) {
-    // Free encoder resources
-    if (ctx->encoder) {
-        x265_encoder_close(ctx->encoder);
+// Short name for an x265 slice type, used in the stats output
+const char *slice_type_name(int slice_type) {
+    static const char *names[FRAME_STATS_TYPES] = { "auto", "IDR", "I", "P", "Bref", "B" };
+    if (slice_type < 0 || slice_type >= FRAME_STATS_TYPES) {
+        return "unknown";
     }
-    if (ctx->encoder_params) {
-        x265_param_free(ctx->encoder_params);
+    return names[slice_type];
+}
+
+// Open the per-frame statistics file, JSON if the name ends in .json, CSV otherwise
+int open_frame_stats(ProcessingContext *ctx, const char *path) {
+    FrameStats *fs = &ctx->frame_stats;
+    fs->file = fopen(path, "w");
+    if (!fs->file) {
+        fprintf(stderr, "Could not open frame stats file '%s'\n", path);
+        return -1;
     }
-    if (ctx->enc_pic) {
-        x265_picture_free(ctx->enc_pic);
+    
+    const char *ext = strrchr(path, '.');
+    fs->json = ext && strcmp(ext, ".json") == 0;
+    if (fs->json) {
+        fprintf(fs->file, "{\n  \"frames\": [");
+    } else {
+        // The summary has its own columns, so it goes to a file of its own
+        int stem = ext && !strchr(ext, '/') ? (int)(ext - path) : (int)strlen(path);
+        snprintf(fs->summary_path, sizeof(fs->summary_path), "%.*s_summary.csv", stem, path);
+        fprintf(fs->file, "frame,poc,pts,type,qp,bits,psnr_y,psnr,latency_ms\n");
     }
     
-    // Free decoder resources
-    if (ctx->frame) {
-        av_frame_free(&ctx->frame);
+    return 0;
+}
+
+// Remember when a frame was handed to the encoder
+void mark_frame_submitted(ProcessingContext *ctx, int frame_index) {
+    ctx->frame_stats.submit_time[frame_index % FRAME_STATS_RING] = av_gettime_relative();
+}
+
+// Record the statistics of one encoded frame
+void record_frame_stats(ProcessingContext *ctx, const EncodedPacket *pkt) {
+    FrameStats *fs = &ctx->frame_stats;
+    int frame_index = ctx->timestamp_increment > 0 ? (int)(pkt->pts / ctx->timestamp_increment) : fs->frames;
+    int type = pkt->frame_type;
+    if (type < 0 || type >= FRAME_STATS_TYPES) {
+        type = X265_TYPE_AUTO;
     }
-    if (ctx->pkt) {
-        av_packet_free(&ctx->pkt);
+    
+    // Count bits actually emitted, including parameter sets and SEI
+    int64_t bits = (int64_t)pkt->size * 8;
+    
+    atomic_store_explicit(&pipeline_metrics.last_output_pts, pkt->pts, memory_order_relaxed);
+    
+    // Latency from submission to output includes lookahead and frame-thread delay
+    double latency_ms = (av_gettime_relative() - fs->submit_time[frame_index % FRAME_STATS_RING]) / 1000.0;
+    double qp = pkt->qp;
+    
+    if (fs->type_count[type] == 0 || bits < fs->type_min_bits[type]) {
+        fs->type_min_bits[type] = bits;
     }
-    if (ctx->decoder_ctx) {
-        avcodec_free_context(&ctx->decoder_ctx);
+    if (bits > fs->type_max_bits[type]) {
+        fs->type_max_bits[type] = bits;
     }
-    if (ctx->fmt_ctx) {
-        avformat_close_input(&ctx->fmt_ctx);
+    fs->type_count[type]++;
+    fs->type_bits[type] += bits;
+    fs->type_qp_sum[type] += qp;
+    fs->latency_sum_ms += latency_ms;
+    if (latency_ms > fs->latency_max_ms) {
+        fs->latency_max_ms = latency_ms;
     }
     
-    // Free scaling context
-    if (ctx->sws_ctx) {
-        sws_freeContext(ctx->sws_ctx);
+    if (fs->file) {
+        if (fs->json) {
+            fprintf(fs->file, "%s\n    {\"frame\": %d, \"poc\": %d, \"pts\": %lld, \"type\": \"%s\", "
+                    "\"qp\": %.2f, \"bits\": %lld, ",
+                    fs->frames ? "," : "", frame_index, pkt->poc, (long long)pkt->pts,
+                    slice_type_name(type), qp, (long long)bits);
+            if (ctx->enable_psnr) {
+                fprintf(fs->file, "\"psnr_y\": %.3f, \"psnr\": %.3f, ", pkt->psnr_y, pkt->psnr);
+            }
+            fprintf(fs->file, "\"latency_ms\": %.2f}", latency_ms);
+        } else {
+            fprintf(fs->file, "%d,%d,%lld,%s,%.2f,%lld,", frame_index, pkt->poc,
+                    (long long)pkt->pts, slice_type_name(type), qp, (long long)bits);
+            if (ctx->enable_psnr) {
+                fprintf(fs->file, "%.3f,%.3f,", pkt->psnr_y, pkt->psnr);
+            } else {
+                fprintf(fs->file, ",,");
+            }
+            fprintf(fs->file, "%.2f\n", latency_ms);
+        }
     }
     
-    // Free buffers
-    free(ctx->scaled_buffer);
+    fs->frames++;
+}
+
+// Print the bits-by-frame-type histogram
+void print_frame_stats_summary(FrameStats *fs) {
+    int64_t total_bits = 0;
+    for (int t = 0; t < FRAME_STATS_TYPES; t++) {
+        total_bits += fs->type_bits[t];
+    }
+    if (fs->frames == 0 || total_bits == 0) {
+        return;
+    }
     
-    // Close files
-    if (ctx->output_file) {
-        fclose(ctx->output_file);
+    printf("Bits by frame type:\n");
+    for (int t = 0; t < FRAME_STATS_TYPES; t++) {
+        if (fs->type_count[t] == 0) {
+            continue;
+        }
+        double share = 100.0 * fs->type_bits[t] / total_bits;
+        char bar[41];
+        int len = (int)(share * 40 / 100 + 0.5);
+        memset(bar, '#', len);
+        bar[len] = '\0';
+        printf("  %-4s %6lld frames  avg %9lld bits  qp %5.2f  %5.1f%% %s\n",
+               slice_type_name(t), (long long)fs->type_count[t],
+               (long long)(fs->type_bits[t] / fs->type_count[t]),
+               fs->type_qp_sum[t] / fs->type_count[t], share, bar);
+    }
+    printf("  encode latency: avg %.1f ms, max %.1f ms\n",
+           fs->latency_sum_ms / fs->frames, fs->latency_max_ms);
+}
+
+// Write the per-type summary and close the statistics file
+void close_frame_stats(FrameStats *fs) {
+    if (!fs->file) {
+        return;
     }
     
-    // Close MP4 muxer
-    if (ctx->ofmt_ctx) {
-        if (ctx->mp4_output && ctx->ofmt_ctx->pb) {
-            // Write trailer before closing
-            av_write_trailer(ctx->ofmt_ctx);
+    if (fs->json) {
+        fprintf(fs->file, "\n  ],\n  \"summary\": {");
+        int first = 1;
+        for (int t = 0; t < FRAME_STATS_TYPES; t++) {
+            if (fs->type_count[t] == 0) {
+                continue;
+            }
+            fprintf(fs->file, "%s\n    \"%s\": {\"frames\": %lld, \"bits\": %lld, \"min_bits\": %lld, "
+                    "\"max_bits\": %lld, \"avg_qp\": %.2f}",
+                    first ? "" : ",", slice_type_name(t), (long long)fs->type_count[t],
+                    (long long)fs->type_bits[t], (long long)fs->type_min_bits[t],
+                    (long long)fs->type_max_bits[t], fs->type_qp_sum[t] / fs->type_count[t]);
+            first = 0;
         }
-        
-        if (!(ctx->ofmt_ctx->oformat->flags & AVFMT_NOFILE) && ctx->ofmt_ctx->pb) {
-            avio_closep(&ctx->ofmt_ctx->pb);
+        fprintf(fs->file, "\n  }\n}\n");
+    } else {
+        FILE *summary = fopen(fs->summary_path, "w");
+        if (!summary) {
+            fprintf(stderr, "Could not open frame stats summary '%s'\n", fs->summary_path);
+        } else {
+            fprintf(summary, "type,frames,bits,min_bits,max_bits,avg_qp\n");
+            for (int t = 0; t < FRAME_STATS_TYPES; t++) {
+                if (fs->type_count[t] == 0) {
+                    continue;
+                }
+                fprintf(summary, "%s,%lld,%lld,%lld,%lld,%.2f\n", slice_type_name(t),
+                        (long long)fs->type_count[t], (long long)fs->type_bits[t],
+                        (long long)fs->type_min_bits[t], (long long)fs->type_max_bits[t],
+                        fs->type_qp_sum[t] / fs->type_count[t]);
+            }
+            fclose(summary);
         }
-        
-        avformat_free_context(ctx->ofmt_ctx);
     }
     
-    // Free extradata
-    if (ctx->extradata) {
-        av_free(ctx->extradata);
+    fclose(fs->file);
+    fs->file = NULL;
+}
+
+// Name of a --projection value
+const char *projection_name(Projection projection) {
+    switch (projection) {
+        case PROJECTION_AUTO:     return "auto";
+        case PROJECTION_NONE:     return "none";
+        case PROJECTION_EQUIRECT: return "equirect";
+        case PROJECTION_VR180:    return "vr180";
     }
+    return "unknown";
 }
 
-// Process frame using FFmpeg SwScale for crop and scale in one step
-int process_frame_with_swscale(ProcessingContext *ctx, AVFrame *frame) {
-    // Set up source planes for cropping - only use left half of the frame
-    const uint8_t *src_data[4] = {
-        frame->data[0],                   // Y plane source
-        frame->data[1],                   // U plane source
-        frame->data[2],                   // V plane source
-        NULL
-    };
-    
-    // Set up source strides for entire frame
-    int src_linesize[4] = {
-        frame->linesize[0],               // Y plane stride
-        frame->linesize[1],               // U plane stride
-        frame->linesize[2],               // V plane stride
-        0
-    };
+// Spherical mapping of the output, NULL for flat video. In auto mode the input stream's mapping
+// is copied, which also covers projections the options cannot describe, such as fisheye
+static AVSphericalMapping *output_spherical_mapping(ProcessingContext *ctx, size_t *size) {
+    AVSphericalMapping *mapping = NULL;
     
-    // Set up destination planes
-    uint8_t *dst_data[4] = {
-        ctx->scaled_buffer,                                             // Y plane destination
-        ctx->scaled_buffer + (OUTPUT_WIDTH * OUTPUT_HEIGHT),            // U plane destination
-        ctx->scaled_buffer + (OUTPUT_WIDTH * OUTPUT_HEIGHT) + 
-            (OUTPUT_WIDTH * OUTPUT_HEIGHT / 4),                         // V plane destination
-        NULL
-    };
+    if (ctx->projection == PROJECTION_AUTO) {
+        if (!ctx->fmt_ctx) {
+            return NULL;
+        }
+        AVCodecParameters *par = ctx->fmt_ctx->streams[ctx->video_stream_idx]->codecpar;
+        const AVPacketSideData *sd = av_packet_side_data_get(par->coded_side_data, par->nb_coded_side_data,
+                                                             AV_PKT_DATA_SPHERICAL);
+        if (sd && (mapping = av_malloc(sd->size))) {
+            memcpy(mapping, sd->data, sd->size);
+            *size = sd->size;
+        }
+        return mapping;
+    }
+    if (ctx->projection == PROJECTION_NONE || !(mapping = av_spherical_alloc(size))) {
+        return NULL;
+    }
     
-    // Set up destination strides
-    int dst_linesize[4] = {
-        OUTPUT_WIDTH,                     // Y plane stride
-        OUTPUT_WIDTH / 2,                 // U plane stride
-        OUTPUT_WIDTH / 2,                 // V plane stride
-        0
-    };
+    // VR180 crops a quarter of the full sphere's width from each side (0.32 fixed point)
+    mapping->projection = AV_SPHERICAL_EQUIRECTANGULAR;
+    if (ctx->projection == PROJECTION_VR180) {
+        mapping->projection = AV_SPHERICAL_EQUIRECTANGULAR_TILE;
+        mapping->bound_left = 0x40000000;
+        mapping->bound_right = 0x40000000;
+    }
+    return mapping;
+}
+
+// Attach stereo and spherical side data to the output stream, so the MP4 muxer writes the
+// st3d and sv3d boxes in the first pass instead of a separate injector rewriting the file
+static int add_spherical_side_data(ProcessingContext *ctx, AVCodecParameters *codecpar) {
+    size_t size = 0;
+    AVSphericalMapping *mapping = output_spherical_mapping(ctx, &size);
+    if (!mapping) {
+        return 0;
+    }
+    if (!av_packet_side_data_add(&codecpar->coded_side_data, &codecpar->nb_coded_side_data,
+                                 AV_PKT_DATA_SPHERICAL, mapping, size, 0)) {
+        av_free(mapping);
+        return -1;
+    }
     
-    // Perform crop and scale in one step
-    // The crop is achieved by only using the left half of the input frame as source
-    // srcSliceY = 0, srcSliceH = INPUT_HEIGHT means process the whole height
-    sws_scale(ctx->sws_ctx, src_data, src_linesize, 0, INPUT_HEIGHT, dst_data, dst_linesize);
+    // One eye is encoded, or both packed side by side from per-eye inputs
+    // The struct may grow between libavutil versions, so the size comes from the allocator
+#if HAVE_MV_HEVC
+    size_t stereo_size;
+    AVStereo3D *stereo = av_stereo3d_alloc_size(&stereo_size);
+#else
+    size_t stereo_size = sizeof(AVStereo3D);
+    AVStereo3D *stereo = av_stereo3d_alloc();
+#endif
+    if (!stereo) {
+        return -1;
+    }
+    if (ctx->stereo.right.path && ctx->stereo.layout == STEREO_SIDE_BY_SIDE) {
+        stereo->type = AV_STEREO3D_SIDEBYSIDE;
+        stereo->view = AV_STEREO3D_VIEW_PACKED;
+    } else {
+        stereo->type = AV_STEREO3D_2D;
+        stereo->view = ctx->eye == EYE_RIGHT ? AV_STEREO3D_VIEW_RIGHT : AV_STEREO3D_VIEW_LEFT;
+    }
+    if (!av_packet_side_data_add(&codecpar->coded_side_data, &codecpar->nb_coded_side_data,
+                                 AV_PKT_DATA_STEREO3D, stereo, stereo_size, 0)) {
+        av_free(stereo);
+        return -1;
+    }
     
+    // The mp4 muxer only writes the spatial media boxes at this compliance level
+    ctx->ofmt_ctx->strict_std_compliance = FF_COMPLIANCE_UNOFFICIAL;
     return 0;
 }
 
-// Init decoder using demuxing API instead of raw NAL parsing
-int init_decoder(ProcessingContext *ctx, const char *input_file) {
-    int ret;
-    
-    // Open input file using FFmpeg demuxer
-    ret = avformat_open_input(&ctx->fmt_ctx, input_file, NULL, NULL);
-    if (ret < 0) {
+// Tag raw x265 output with an equirectangular projection SEI on every picture; it persists
+// to the end of each coded video sequence, so every IDR needs its own copy
+int set_projection_sei(ProcessingContext *ctx) {
+    size_t size = 0;
+    AVSphericalMapping *mapping = output_spherical_mapping(ctx, &size);
+    if (!mapping) {
+        return 0;
+    }
+    int equirect = mapping->projection == AV_SPHERICAL_EQUIRECTANGULAR ||
+                   mapping->projection == AV_SPHERICAL_EQUIRECTANGULAR_TILE;
+    av_free(mapping);
+    if (!equirect || !ctx->enc_pic) {
+        fprintf(stderr, "Warning: no projection SEI for this projection or encoder, the raw output is untagged\n");
+        return 0;
+    }
+    
+    // erp_cancel_flag 0, erp_persistence_flag 1, erp_padding_flag 0, 2 reserved bits, then byte alignment
+    ctx->projection_sei_data[0] = 0x44;
+    ctx->projection_sei.payloadType = HEVC_SEI_EQUIRECT_PROJECTION;
+    ctx->projection_sei.payloadSize = sizeof(ctx->projection_sei_data);
+    ctx->projection_sei.payload = ctx->projection_sei_data;
+    ctx->enc_pic->userSEI.numPayloads = 1;
+    ctx->enc_pic->userSEI.payloads = &ctx->projection_sei;
+    return 0;
+}
+
+// Data streams of the current input, which are copied by --data-streams
+static int count_data_streams(ProcessingContext *ctx) {
+    int count = 0;
+    for (unsigned int i = 0; ctx->fmt_ctx && i < ctx->fmt_ctx->nb_streams; i++) {
+        count += ctx->fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_DATA;
+    }
+    return count;
+}
+
+// Add the input's data streams to a single MP4 output when the muxer supports every one of them;
+// otherwise they all go to the sidecar, so a loader finds them in one place
+static int add_data_streams(ProcessingContext *ctx) {
+    AVFormatContext *in = ctx->fmt_ctx;
+    for (unsigned int i = 0; i < in->nb_streams; i++) {
+        AVCodecParameters *par = in->streams[i]->codecpar;
+        if (par->codec_type == AVMEDIA_TYPE_DATA &&
+            avformat_query_codec(ctx->ofmt_ctx->oformat, par->codec_id, FF_COMPLIANCE_NORMAL) != 1) {
+            return 0;
+        }
+    }
+    
+    ctx->data_stream_map = malloc(in->nb_streams * sizeof(*ctx->data_stream_map));
+    if (!ctx->data_stream_map) {
+        return -1;
+    }
+    ctx->data_stream_count = in->nb_streams;
+    for (unsigned int i = 0; i < in->nb_streams; i++) {
+        ctx->data_stream_map[i] = -1;
+        if (in->streams[i]->codecpar->codec_type != AVMEDIA_TYPE_DATA) {
+            continue;
+        }
+        AVStream *out = avformat_new_stream(ctx->ofmt_ctx, NULL);
+        if (!out || avcodec_parameters_copy(out->codecpar, in->streams[i]->codecpar) < 0) {
+            fprintf(stderr, "Failed to add data stream %u to output\n", i);
+            return -1;
+        }
+        out->codecpar->codec_tag = 0;
+        out->time_base = (AVRational){1, OUTPUT_TIMEBASE};
+        ctx->data_stream_map[i] = out->index;
+    }
+    return 0;
+}
+
+// Data stream signature of one input stream: its codec id and tag, 0 for other streams
+static uint64_t data_stream_signature(ProcessingContext *ctx, int index) {
+    AVCodecParameters *par = ctx->fmt_ctx->streams[index]->codecpar;
+    if (par->codec_type != AVMEDIA_TYPE_DATA) {
+        return 0;
+    }
+    return (1ULL << 63) | ((uint64_t)par->codec_id << 32) | par->codec_tag;
+}
+
+// Remember the first input's data streams; the track map and sidecar records are by stream index
+int record_data_layout(ProcessingContext *ctx) {
+    int count = ctx->fmt_ctx ? (int)ctx->fmt_ctx->nb_streams : 0;
+    ctx->data_layout = calloc(count > 0 ? count : 1, sizeof(*ctx->data_layout));
+    if (!ctx->data_layout) {
+        return -1;
+    }
+    ctx->data_layout_count = count;
+    for (int i = 0; i < count; i++) {
+        ctx->data_layout[i] = data_stream_signature(ctx, i);
+    }
+    return 0;
+}
+
+// Check that a further --concat input has the same data streams at the same indices
+static int check_data_layout(ProcessingContext *ctx, const char *path) {
+    int count = ctx->fmt_ctx ? (int)ctx->fmt_ctx->nb_streams : 0;
+    int max = count > ctx->data_layout_count ? count : ctx->data_layout_count;
+    for (int i = 0; i < max; i++) {
+        uint64_t expected = i < ctx->data_layout_count ? ctx->data_layout[i] : 0;
+        uint64_t actual = i < count ? data_stream_signature(ctx, i) : 0;
+        if (actual != expected) {
+            fprintf(stderr, "Error: %s has different data streams than the first input; --data-streams "
+                    "with --concat needs the same layout in every input\n", path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Create <output>.data for data streams the output does not carry
+int open_data_sidecar(ProcessingContext *ctx, const char *output_file) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.data", output_file);
+    ctx->data_sidecar = fopen(path, "wb");
+    if (!ctx->data_sidecar) {
+        fprintf(stderr, "Error: Could not open data sidecar: %s\n", path);
+        return -1;
+    }
+    
+    DataSidecarHeader header = {
+        .version = DATA_SIDECAR_VERSION,
+        .record_size = sizeof(DataRecord),
+        .timebase_num = 1,
+        .timebase_den = OUTPUT_TIMEBASE,
+    };
+    memcpy(header.magic, DATA_SIDECAR_MAGIC, sizeof(header.magic));
+    if (fwrite(&header, sizeof(header), 1, ctx->data_sidecar) != 1) {
+        fprintf(stderr, "Error writing data sidecar\n");
+        return -1;
+    }
+    printf("Copying %d data streams to %s\n", count_data_streams(ctx), path);
+    return 0;
+}
+
+// Copy a demuxed data packet to the output or the sidecar, retimed onto the output video's
+// timeline: the first video frame of the input is output time 0, shifted by earlier inputs
+int write_data_packet(ProcessingContext *ctx, AVPacket *pkt) {
+    AVStream *in = ctx->fmt_ctx->streams[pkt->stream_index];
+    if (in->codecpar->codec_type != AVMEDIA_TYPE_DATA) {
+        return 0;
+    }
+    
+    AVRational output_time_base = {1, OUTPUT_TIMEBASE};
+    AVStream *video = ctx->fmt_ctx->streams[ctx->video_stream_idx];
+    int64_t origin = video->start_time != AV_NOPTS_VALUE ?
+                     av_rescale_q(video->start_time, video->time_base, output_time_base) : 0;
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    int64_t pts = (ts != AV_NOPTS_VALUE ? av_rescale_q(ts, in->time_base, output_time_base) : 0) -
+                  origin + ctx->data_offset;
+    int64_t duration = av_rescale_q(pkt->duration, in->time_base, output_time_base);
+    if (pts < 0) {
+        return 0;    // Before the first video frame
+    }
+    
+    int out_index = pkt->stream_index < ctx->data_stream_count ? ctx->data_stream_map[pkt->stream_index] : -1;
+    if (out_index >= 0 && ctx->ofmt_ctx) {
+        AVPacket *out = ctx->mux_pkt;
+        av_packet_unref(out);
+        if (av_packet_ref(out, pkt) < 0) {
+            return -1;
+        }
+        out->stream_index = out_index;
+        out->pts = out->dts = pts;
+        out->duration = duration;
+        out->pos = -1;
+        av_packet_rescale_ts(out, output_time_base, ctx->ofmt_ctx->streams[out_index]->time_base);
+        if (av_interleaved_write_frame(ctx->ofmt_ctx, out) < 0) {
+            fprintf(stderr, "Error writing data packet to output\n");
+            return -1;
+        }
+    } else if (ctx->data_sidecar) {
+        DataRecord rec = {
+            .stream_index = pkt->stream_index,
+            .codec_tag = in->codecpar->codec_tag,
+            .size = pkt->size,
+            .flags = pkt->flags,
+            .pts = pts,
+            .duration = duration,
+        };
+        if (fwrite(&rec, sizeof(rec), 1, ctx->data_sidecar) != 1 ||
+            fwrite(pkt->data, 1, pkt->size, ctx->data_sidecar) != (size_t)pkt->size) {
+            fprintf(stderr, "Error writing data sidecar\n");
+            return -1;
+        }
+    } else {
+        return 0;
+    }
+    ctx->data_packets++;
+    return 0;
+}
+
+// Initialize MP4 muxer
+int init_mp4_muxer(ProcessingContext *ctx, const char *output_file, AVIOContext *pb) {
+    int ret;
+    avformat_alloc_output_context2(&ctx->ofmt_ctx, NULL, "mp4", output_file);
+    if (!ctx->ofmt_ctx) {
+        fprintf(stderr, "Could not create output context\n");
+        return -1;
+    }
+    
+    // Add video stream
+    const AVCodec *codec = avcodec_find_encoder(ctx->out_codec_id);
+    ctx->out_stream = avformat_new_stream(ctx->ofmt_ctx, codec);
+    if (!ctx->out_stream) {
+        fprintf(stderr, "Failed to allocate output stream\n");
+        return -1;
+    }
+    
+    ctx->out_stream->id = ctx->ofmt_ctx->nb_streams - 1;
+    
+    // Configure stream parameters
+    AVCodecParameters *codecpar = ctx->out_stream->codecpar;
+    if (ctx->av_enc_ctx) {
+        // libavcodec encoders describe themselves, including extradata
+        ret = avcodec_parameters_from_context(codecpar, ctx->av_enc_ctx);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to copy encoder parameters to output stream\n");
+            return -1;
+        }
+    } else {
+        codecpar->codec_id = ctx->out_codec_id;
+        codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+        codecpar->width = OUTPUT_WIDTH;
+        codecpar->height = OUTPUT_HEIGHT;
+        codecpar->format = AV_PIX_FMT_YUV420P;
+        codecpar->bit_rate = ctx->encoder_params->rc.bitrate * 1000;
+    }
+    
+    // Set stream timebase - for MP4, must match the timebase we use for timestamps
+    ctx->out_stream->time_base = (AVRational){1, OUTPUT_TIMEBASE};
+    
+    if (add_spherical_side_data(ctx, codecpar) < 0) {
+        fprintf(stderr, "Failed to add spherical metadata to output stream\n");
+        return -1;
+    }
+    
+    // Telemetry tracks are only muxed into a single output; split outputs use the sidecar
+    if (ctx->data_passthrough && !ctx->output_pattern && count_data_streams(ctx) > 0) {
+        if (add_data_streams(ctx) < 0) {
+            return -1;
+        }
+        if (ctx->data_stream_map) {
+            printf("Copying %d data streams into %s\n", count_data_streams(ctx), output_file);
+        }
+    }
+    
+    // Set fragmented MP4 options
+    if (ctx->ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+        ctx->ofmt_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    
+    // Open output file, unless the background opener already did
+    if (pb) {
+        ctx->ofmt_ctx->pb = pb;
+    } else if (!(ctx->ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&ctx->ofmt_ctx->pb, output_file, AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            fprintf(stderr, "Could not open output file '%s'\n", output_file);
+            return -1;
+        }
+    }
+    
+    // Reused for every packet written, across output files
+    if (!ctx->mux_pkt) {
+        ctx->mux_pkt = av_packet_alloc();
+    }
+    if (!ctx->mux_pkt) {
+        fprintf(stderr, "Failed to allocate mux packet\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Write one encoded packet to the MP4 container
+int write_packet_to_mp4(ProcessingContext *ctx, const EncodedPacket *pkt) {
+    if (pkt->size == 0) {
+        return 0;
+    }
+    
+    // The muxer copies the data since the packet is not reference counted
+    AVPacket *out = ctx->mux_pkt;
+    av_packet_unref(out);
+    out->data = pkt->data;
+    out->size = pkt->size;
+    out->pts = pkt->pts - ctx->output_pts_base;
+    out->dts = pkt->dts - ctx->output_pts_base;
+    out->duration = ctx->timestamp_increment;
+    out->stream_index = ctx->out_stream->index;
+    out->flags = pkt->keyframe ? AV_PKT_FLAG_KEY : 0;
+    
+    // Every keyframe opens a fragment, and so does each intra refresh cycle: the recovery point
+    // stays a non-sync sample, but players can join at its fragment. The I-frame playlist needs
+    // the keyframes' times. Packets queued in the interleaver (with data tracks) are written
+    // first, so none of them land after the cut
+    if (pkt->recovery && (av_interleaved_write_frame(ctx->ofmt_ctx, NULL) < 0 ||
+                          av_write_frame(ctx->ofmt_ctx, NULL) < 0)) {
+        fprintf(stderr, "Error flushing output fragment\n");
+        return -1;
+    }
+    if (ctx->iframe_playlist) {
+        if (pkt->keyframe) {
+            if (ctx->keyframe_count == ctx->keyframe_capacity) {
+                int capacity = ctx->keyframe_capacity ? ctx->keyframe_capacity * 2 : 256;
+                int64_t *grown = realloc(ctx->keyframe_pts, capacity * sizeof(*grown));
+                if (!grown) {
+                    return -1;
+                }
+                ctx->keyframe_pts = grown;
+                ctx->keyframe_capacity = capacity;
+            }
+            ctx->keyframe_pts[ctx->keyframe_count++] = out->pts;
+        }
+        ctx->output_end_pts = FFMAX(ctx->output_end_pts, out->pts + out->duration);
+    }
+    
+    // The muxer may have changed the stream timebase in avformat_write_header()
+    av_packet_rescale_ts(out, (AVRational){1, OUTPUT_TIMEBASE}, ctx->out_stream->time_base);
+    
+    // Write packet to MP4 container
+    int ret = av_interleaved_write_frame(ctx->ofmt_ctx, out);
+    if (ret < 0) {
+        fprintf(stderr, "Error writing packet to output: %d\n", ret);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Write stream headers to MP4; x265 parameter sets are passed as Annex-B extradata,
+// which the muxer converts to an hvcC box
+int write_hevc_headers_to_mp4(ProcessingContext *ctx, const uint8_t *headers, int headers_size) {
+    AVCodecParameters *codecpar = ctx->out_stream->codecpar;
+    
+    // Set the extradata in the stream codec parameters unless the encoder already did
+    if (headers_size > 0 && codecpar->extradata_size == 0) {
+        codecpar->extradata = av_mallocz(headers_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!codecpar->extradata) {
+            fprintf(stderr, "Failed to allocate stream extradata\n");
+            return -1;
+        }
+        memcpy(codecpar->extradata, headers, headers_size);
+        codecpar->extradata_size = headers_size;
+    }
+    
+    // Create dictionary for MP4 muxer options
+    AVDictionary *opts = NULL;
+    av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    
+    // Write MP4 header with options
+    int ret = avformat_write_header(ctx->ofmt_ctx, &opts);
+    
+    // Free dictionary
+    av_dict_free(&opts);
+    
+    if (ret < 0) {
+        fprintf(stderr, "Error writing MP4 header: %d\n", ret);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Write the encoder's stream headers to the output
+int write_stream_headers(ProcessingContext *ctx) {
+    // Parameter sets are fixed for the session; fetch them once since the x265 backend
+    // packs them into the same buffer as the packet being written when outputs switch
+    if (!ctx->stream_headers) {
+        EncodedPacket headers;
+        if (ctx->backend->headers(ctx, &headers) < 0) {
+            return -1;
+        }
+        ctx->stream_headers = av_malloc(headers.size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!ctx->stream_headers) {
+            return -1;
+        }
+        memcpy(ctx->stream_headers, headers.data, headers.size);
+        ctx->stream_headers_size = headers.size;
+    }
+    
+    if (ctx->mp4_output) {
+        return write_hevc_headers_to_mp4(ctx, ctx->stream_headers, ctx->stream_headers_size);
+    }
+    
+    // Raw output: parameter sets lead the elementary stream
+    int size = ctx->stream_headers_size;
+    if (size > 0 && fwrite(ctx->stream_headers, 1, size, ctx->output_file) != (size_t)size) {
+        fprintf(stderr, "Error writing stream headers\n");
+        return -1;
+    }
+    ctx->es_offset += size;
+    return 0;
+}
+
+// Write the index header; the record count is only final when the output is closed
+static int write_es_index_header(ProcessingContext *ctx) {
+    EsIndexHeader header = {
+        .version = ES_INDEX_VERSION,
+        .record_size = sizeof(EsIndexRecord),
+        .timebase_num = 1,
+        .timebase_den = OUTPUT_TIMEBASE,
+        .record_count = ctx->es_index_records,
+    };
+    memcpy(header.magic, ES_INDEX_MAGIC, sizeof(header.magic));
+    if (fseeko(ctx->es_index, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, ctx->es_index) != 1) {
+        fprintf(stderr, "Error writing frame index\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Create the index for the raw output at path, named <path>.idx
+static int open_es_index(ProcessingContext *ctx, const char *path) {
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    ctx->es_index = fopen(index_path, "wb");
+    if (!ctx->es_index) {
+        fprintf(stderr, "Error: Could not open frame index: %s\n", index_path);
+        return -1;
+    }
+    ctx->es_offset = 0;
+    ctx->es_index_records = 0;
+    return write_es_index_header(ctx);
+}
+
+// Finish the index with its record count
+static void close_es_index(ProcessingContext *ctx) {
+    if (ctx->es_index) {
+        write_es_index_header(ctx);
+        fclose(ctx->es_index);
+        ctx->es_index = NULL;
+    }
+}
+
+// Send one encoded packet to the output, MP4 or raw elementary stream
+int write_encoded_packet(ProcessingContext *ctx, const EncodedPacket *pkt) {
+    if (ctx->mp4_output) {
+        return write_packet_to_mp4(ctx, pkt);
+    }
+    
+    if (ctx->es_index) {
+        EsIndexRecord rec = {
+            .offset = ctx->es_offset,
+            .size = pkt->size,
+            .flags = (pkt->keyframe ? ES_INDEX_KEYFRAME : 0) | (pkt->recovery ? ES_INDEX_RECOVERY : 0),
+            .pts = pkt->pts - ctx->output_pts_base,
+            .dts = pkt->dts - ctx->output_pts_base,
+        };
+        if (fwrite(&rec, sizeof(rec), 1, ctx->es_index) != 1) {
+            fprintf(stderr, "Error writing frame index\n");
+            return -1;
+        }
+        ctx->es_index_records++;
+    }
+    if (fwrite(pkt->data, 1, pkt->size, ctx->output_file) != (size_t)pkt->size) {
+        fprintf(stderr, "Error writing to output file\n");
+        return -1;
+    }
+    ctx->es_offset += pkt->size;
+    return 0;
+}
+
+static void *output_opener_thread(void *opaque) {
+    OutputOpener *op = opaque;
+    
+    // O_EXCL: a leftover file under the temporary name is not ours to truncate
+    int fd = open(op->tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (op->mp4) {
+        close(fd);
+        if (avio_open(&op->pb, op->tmp_path, AVIO_FLAG_WRITE) < 0) {
+            op->pb = NULL;
+            remove(op->tmp_path);
+        }
+    } else {
+        op->file = fdopen(fd, "wb");
+        if (!op->file) {
+            close(fd);
+            remove(op->tmp_path);
+        }
+    }
+    return NULL;
+}
+
+// Start creating the next output file in the background
+void start_output_opener(ProcessingContext *ctx, const char *path) {
+    OutputOpener *op = &ctx->opener;
+    op->mp4 = ctx->mp4_output;
+    snprintf(op->path, sizeof(op->path), "%s", path);
+    snprintf(op->tmp_path, sizeof(op->tmp_path), "%s.%ld.opening", path, (long)getpid());
+    op->pending = pthread_create(&op->thread, NULL, output_opener_thread, op) == 0;
+}
+
+// Wait for the opener and hand over its file if it opened path, moving it to its real name;
+// returns 1 if it did
+static int take_preopened_output(ProcessingContext *ctx, const char *path, FILE **file, AVIOContext **pb) {
+    OutputOpener *op = &ctx->opener;
+    if (op->pending) {
+        pthread_join(op->thread, NULL);
+        op->pending = 0;
+    }
+    if ((!op->file && !op->pb) || strcmp(op->path, path) != 0) {
+        return 0;
+    }
+    if (rename(op->tmp_path, path) != 0) {
+        if (op->file) {
+            fclose(op->file);
+            op->file = NULL;
+        }
+        if (op->pb) {
+            avio_closep(&op->pb);
+        }
+        remove(op->tmp_path);
+        return 0;
+    }
+    *file = op->file;
+    *pb = op->pb;
+    op->file = NULL;
+    op->pb = NULL;
+    return 1;
+}
+
+// Close and delete a preopened output that was never used; only its temporary name exists
+void discard_preopened_output(ProcessingContext *ctx) {
+    OutputOpener *op = &ctx->opener;
+    if (op->pending) {
+        pthread_join(op->thread, NULL);
+        op->pending = 0;
+    }
+    if (!op->file && !op->pb) {
+        return;
+    }
+    if (op->file) {
+        fclose(op->file);
+        op->file = NULL;
+    }
+    if (op->pb) {
+        avio_closep(&op->pb);
+    }
+    remove(op->tmp_path);
+}
+
+// Open an output file, MP4 or raw HEVC as selected for the run, and write the stream headers
+int open_output(ProcessingContext *ctx, const char *path) {
+    FILE *file = NULL;
+    AVIOContext *pb = NULL;
+    take_preopened_output(ctx, path, &file, &pb);
+    
+    if (ctx->mp4_output) {
+        if (init_mp4_muxer(ctx, path, pb) < 0) {
+            fprintf(stderr, "Error: MP4 muxer initialization failed\n");
+            return -1;
+        }
+    } else {
+        ctx->output_file = file ? file : fopen(path, "wb");
+        if (!ctx->output_file) {
+            fprintf(stderr, "Error: Could not open output file: %s\n", path);
+            return -1;
+        }
+        ctx->es_offset = 0;
+        if (ctx->es_index_enabled && open_es_index(ctx, path) < 0) {
+            return -1;
+        }
+    }
+    
+    if (write_stream_headers(ctx) < 0) {
+        fprintf(stderr, "Failed to write stream headers\n");
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Offset, from the start of its moof, and size of the first sample of a track in a fragment
+static int parse_first_sample(const uint8_t *moof, int64_t size, uint32_t track_id,
+                              int64_t *data_offset, uint32_t *sample_size) {
+    for (int64_t pos = 8; pos + 8 <= size; ) {
+        int64_t traf_size = read_be32(moof + pos);
+        if (traf_size < 8 || pos + traf_size > size) {
+            break;
+        }
+        if (memcmp(moof + pos + 4, "traf", 4) == 0) {
+            uint32_t default_size = 0;
+            int match = 0;
+            for (int64_t box = pos + 8; box + 16 <= pos + traf_size; ) {
+                const uint8_t *b = moof + box;
+                int64_t box_size = read_be32(b);
+                if (box_size < 8 || box + box_size > pos + traf_size) {
+                    break;
+                }
+                uint32_t flags = read_be32(b + 8) & 0xffffff;
+                if (memcmp(b + 4, "tfhd", 4) == 0) {
+                    // track_ID, then optional base_data_offset, description, duration, size
+                    match = read_be32(b + 12) == track_id;
+                    int field = 16 + (flags & 0x1 ? 8 : 0) + (flags & 0x2 ? 4 : 0) + (flags & 0x8 ? 4 : 0);
+                    if ((flags & 0x10) && field + 4 <= box_size) {
+                        default_size = read_be32(b + field);
+                    }
+                } else if (match && memcmp(b + 4, "trun", 4) == 0 && (flags & 0x1) && box_size >= 20) {
+                    // sample_count, data_offset, optional first_sample_flags, then the first sample
+                    *data_offset = (int32_t)read_be32(b + 16);
+                    int field = 20 + (flags & 0x4 ? 4 : 0) + (flags & 0x100 ? 4 : 0);
+                    *sample_size = (flags & 0x200) && field + 4 <= box_size ? read_be32(b + field) : default_size;
+                    return 0;
+                }
+                box += box_size;
+            }
+        }
+        pos += traf_size;
+    }
+    return -1;
+}
+
+// Write <output>_iframes.m3u8: an HLS I-frame-only playlist whose byte ranges cover each
+// fragment's moof and keyframe. Only box headers and fragment headers are read back.
+static int write_iframe_playlist(ProcessingContext *ctx, const char *path, uint32_t track_id) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        return -1;
+    }
+    
+    // Walk the top-level boxes: ftyp and moov form the init segment, then moof/mdat pairs
+    int64_t *ranges = malloc(2 * (ctx->keyframe_count + 1) * sizeof(*ranges));
+    int fragments = 0;
+    int64_t init_size = 0;
+    int64_t offset = 0;
+    uint8_t header[16];
+    while (ranges && fragments < ctx->keyframe_count && fseeko(in, offset, SEEK_SET) == 0 &&
+           fread(header, 1, 8, in) == 8) {
+        int64_t box_size = read_be32(header);
+        if (box_size == 1 && fread(header + 8, 1, 8, in) == 8) {
+            box_size = ((int64_t)read_be32(header + 8) << 32) | read_be32(header + 12);
+        }
+        if (box_size < 8) {
+            break;
+        }
+        if (memcmp(header + 4, "moov", 4) == 0 || memcmp(header + 4, "ftyp", 4) == 0) {
+            init_size = offset + box_size;
+        } else if (memcmp(header + 4, "moof", 4) == 0) {
+            uint8_t *moof = malloc(box_size);
+            int64_t data_offset;
+            uint32_t sample_size;
+            if (moof && fseeko(in, offset, SEEK_SET) == 0 && fread(moof, 1, box_size, in) == (size_t)box_size &&
+                parse_first_sample(moof, box_size, track_id, &data_offset, &sample_size) == 0) {
+                ranges[2 * fragments] = offset;
+                ranges[2 * fragments + 1] = data_offset + sample_size;
+                fragments++;
+            }
+            free(moof);
+        }
+        offset += box_size;
+    }
+    fclose(in);
+    if (!ranges || fragments == 0) {
+        free(ranges);
+        fprintf(stderr, "Warning: no fragments found in %s, skipping the I-frame playlist\n", path);
+        return -1;
+    }
+    if (fragments != ctx->keyframe_count) {
+        fprintf(stderr, "Warning: %d fragments for %d keyframes in %s\n", fragments, ctx->keyframe_count, path);
+    }
+    
+    // Each I-frame lasts until the next one
+    char playlist[PATH_MAX];
+    const char *dot = strrchr(path, '.');
+    int stem = dot && !strchr(dot, '/') ? (int)(dot - path) : (int)strlen(path);
+    snprintf(playlist, sizeof(playlist), "%.*s_iframes.m3u8", stem, path);
+    const char *slash = strrchr(path, '/');
+    const char *uri = slash ? slash + 1 : path;
+    double target = 0;
+    for (int i = 0; i < fragments; i++) {
+        int64_t end = i + 1 < fragments ? ctx->keyframe_pts[i + 1] : ctx->output_end_pts;
+        target = FFMAX(target, (double)(end - ctx->keyframe_pts[i]) / OUTPUT_TIMEBASE);
+    }
+    
+    FILE *out = fopen(playlist, "w");
+    if (!out) {
+        free(ranges);
+        fprintf(stderr, "Could not write I-frame playlist %s\n", playlist);
+        return -1;
+    }
+    fprintf(out, "#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-TARGETDURATION:%d\n", (int)ceil(target));
+    fprintf(out, "#EXT-X-MEDIA-SEQUENCE:0\n#EXT-X-PLAYLIST-TYPE:VOD\n#EXT-X-I-FRAMES-ONLY\n");
+    fprintf(out, "#EXT-X-MAP:URI=\"%s\",BYTERANGE=\"%lld@0\"\n", uri, (long long)init_size);
+    for (int i = 0; i < fragments; i++) {
+        int64_t end = i + 1 < fragments ? ctx->keyframe_pts[i + 1] : ctx->output_end_pts;
+        fprintf(out, "#EXTINF:%.5f,\n#EXT-X-BYTERANGE:%lld@%lld\n%s\n", (double)(end - ctx->keyframe_pts[i]) / OUTPUT_TIMEBASE,
+                (long long)ranges[2 * i + 1], (long long)ranges[2 * i], uri);
+    }
+    fprintf(out, "#EXT-X-ENDLIST\n");
+    fclose(out);
+    free(ranges);
+    printf("Wrote I-frame playlist %s (%d I-frames)\n", playlist, fragments);
+    return 0;
+}
+
+// Finish and close the current output file
+void close_output(ProcessingContext *ctx) {
+    if (ctx->output_file) {
+        fclose(ctx->output_file);
+        ctx->output_file = NULL;
+    }
+    close_es_index(ctx);
+    
+    // Close MP4 muxer
+    if (ctx->ofmt_ctx) {
+        if (ctx->mp4_output && ctx->ofmt_ctx->pb) {
+            // Write trailer before closing
+            av_write_trailer(ctx->ofmt_ctx);
+        }
+        
+        if (!(ctx->ofmt_ctx->oformat->flags & AVFMT_NOFILE) && ctx->ofmt_ctx->pb) {
+            avio_closep(&ctx->ofmt_ctx->pb);
+        }
+        
+        // The fragment layout is only final once the trailer is written
+        if (ctx->iframe_playlist && ctx->keyframe_count > 0) {
+            write_iframe_playlist(ctx, ctx->ofmt_ctx->url, ctx->out_stream->index + 1);
+        }
+        ctx->keyframe_count = 0;
+        ctx->output_end_pts = 0;
+        
+        avformat_free_context(ctx->ofmt_ctx);
+        ctx->ofmt_ctx = NULL;
+        ctx->out_stream = NULL;
+    }
+}
+
+// Whether an output pattern is safe to hand to snprintf with one int: exactly one %d, optionally
+// zero-padded with a width (%03d), and any other % written as %%
+int valid_output_pattern(const char *pattern) {
+    int conversions = 0;
+    for (const char *p = pattern; *p; p++) {
+        if (*p != '%') {
+            continue;
+        }
+        p++;
+        if (*p == '%') {
+            continue;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+        if (*p != 'd') {
+            return 0;
+        }
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+// Name of an output file from the --clips or split pattern
+void clip_output_path(ProcessingContext *ctx, int index, char *path, size_t path_size) {
+    snprintf(path, path_size, ctx->output_pattern, index);
+}
+
+// Close the current output, open the one at index and start opening the one after it
+static int roll_over_output(ProcessingContext *ctx, int index) {
+    char path[PATH_MAX];
+    
+    close_output(ctx);
+    clip_output_path(ctx, ctx->output_index, path, sizeof(path));
+    printf("Finished output %d: %s\n", ctx->output_index, path);
+    
+    ctx->output_index = index;
+    clip_output_path(ctx, index, path, sizeof(path));
+    if (open_output(ctx, path) < 0) {
+        return -1;
+    }
+    if (!ctx->clip_mode || index + 1 < ctx->input_count) {
+        clip_output_path(ctx, index + 1, path, sizeof(path));
+        start_output_opener(ctx, path);
+    }
+    return 0;
+}
+
+// Switch outputs once the encoder reaches the first packet of the next clip
+// Clip boundaries are IDR pictures, so every earlier packet in decode order belongs to earlier clips
+int route_packet_to_clip(ProcessingContext *ctx, const EncodedPacket *pkt) {
+    while (ctx->output_index + 1 < ctx->input_count && ctx->clip_start_pts[ctx->output_index + 1] >= 0 &&
+           pkt->pts >= ctx->clip_start_pts[ctx->output_index + 1]) {
+        if (roll_over_output(ctx, ctx->output_index + 1) < 0) {
+            return -1;
+        }
+        ctx->output_pts_base = ctx->clip_start_pts[ctx->output_index];
+    }
+    return 0;
+}
+
+// Start a new segment at the first keyframe past the duration or size limit
+// Keyframes are IDRs (closed GOP), so the keyframe's PTS is the lowest in its segment
+int route_packet_to_segment(ProcessingContext *ctx, const EncodedPacket *pkt) {
+    if (ctx->segment_start_pts < 0) {
+        ctx->segment_start_pts = pkt->pts;
+    }
+    if (pkt->keyframe && ctx->segment_bytes > 0 &&
+        ((ctx->split_duration > 0 && pkt->pts - ctx->segment_start_pts >= ctx->split_duration) ||
+         (ctx->split_bytes > 0 && ctx->segment_bytes >= ctx->split_bytes))) {
+        if (roll_over_output(ctx, ctx->output_index + 1) < 0) {
+            return -1;
+        }
+        ctx->output_pts_base = pkt->pts;
+        ctx->segment_start_pts = pkt->pts;
+        ctx->segment_bytes = 0;
+    }
+    ctx->segment_bytes += pkt->size;
+    return 0;
+}
+
+// Open the sink's file or muxer and write its stream headers; done on the sink's thread so
+// a FIFO waiting for its reader does not hold up the encoder
+static int open_sink_output(Sink *sink) {
+    if (sink->raw) {
+        sink->file = fopen(sink->path, "wb");
+        return sink->file && fwrite(sink->headers, 1, sink->headers_size, sink->file) == (size_t)sink->headers_size ? 0 : -1;
+    }
+    if (!(sink->ofmt_ctx->oformat->flags & AVFMT_NOFILE) &&
+        avio_open(&sink->ofmt_ctx->pb, sink->path, AVIO_FLAG_WRITE) < 0) {
+        return -1;
+    }
+    if (avformat_write_header(sink->ofmt_ctx, &sink->mux_opts) < 0) {
+        return -1;
+    }
+    sink->header_written = 1;
+    return 0;
+}
+
+static int write_sink_packet(Sink *sink, const SinkPacket *sp) {
+    if (sink->raw) {
+        return fwrite(sp->data, 1, sp->size, sink->file) == (size_t)sp->size ? 0 : -1;
+    }
+    
+    AVStream *st = sink->ofmt_ctx->streams[0];
+    AVPacket *out = sink->pkt;
+    av_packet_unref(out);
+    out->data = sp->data;
+    out->size = sp->size;
+    out->pts = sp->pts;
+    out->dts = sp->dts;
+    out->duration = sink->duration;
+    out->stream_index = 0;
+    out->flags = sp->keyframe ? AV_PKT_FLAG_KEY : 0;
+    av_packet_rescale_ts(out, (AVRational){1, OUTPUT_TIMEBASE}, st->time_base);
+    if (sp->recovery && sink->fragmented && av_write_frame(sink->ofmt_ctx, NULL) < 0) {
+        return -1;
+    }
+    
+    // One stream in decode order, so no interleaving is needed
+    return av_write_frame(sink->ofmt_ctx, out) < 0 ? -1 : 0;
+}
+
+static void *sink_thread(void *opaque) {
+    Sink *sink = opaque;
+    int failed = open_sink_output(sink) < 0;
+    if (failed) {
+        fprintf(stderr, "Error: Could not open extra output %s\n", sink->path);
+    }
+    
+    pthread_mutex_lock(&sink->lock);
+    sink->error = failed;
+    while (1) {
+        while (sink->queue_count == 0 && !sink->stop) {
+            pthread_cond_wait(&sink->cond, &sink->lock);
+        }
+        if (sink->queue_count == 0) {
+            break;
+        }
+        SinkPacket *sp = &sink->queue[sink->queue_head];
+        int error = sink->error;
+        pthread_mutex_unlock(&sink->lock);
+        
+        // A failed sink keeps emptying its queue, so a blocked encoder always resumes
+        if (!error && write_sink_packet(sink, sp) < 0) {
+            fprintf(stderr, "Error writing to extra output %s\n", sink->path);
+            error = 1;
+        } else if (!error) {
+            sink->written++;
+            sink->bytes += sp->size;
+        }
+        free(sp->data);
+        sp->data = NULL;
+        
+        pthread_mutex_lock(&sink->lock);
+        sink->error = error;
+        sink->queue_head = (sink->queue_head + 1) % SINK_QUEUE;
+        sink->queue_count--;
+        pthread_cond_signal(&sink->cond);
+    }
+    pthread_mutex_unlock(&sink->lock);
+    
+    if (sink->header_written && av_write_trailer(sink->ofmt_ctx) < 0) {
+        sink->error = 1;
+    }
+    return NULL;
+}
+
+// Let the writer thread empty its queue and finish the output, then free the sink.
+// Returns -1 if the output failed
+static int close_sink(Sink *sink) {
+    if (sink->running) {
+        pthread_mutex_lock(&sink->lock);
+        sink->stop = 1;
+        pthread_cond_signal(&sink->cond);
+        pthread_mutex_unlock(&sink->lock);
+        pthread_join(sink->thread, NULL);
+        pthread_mutex_destroy(&sink->lock);
+        pthread_cond_destroy(&sink->cond);
+    }
+    if (sink->file && fclose(sink->file) != 0) {
+        sink->error = 1;
+    }
+    if (sink->ofmt_ctx) {
+        if (!(sink->ofmt_ctx->oformat->flags & AVFMT_NOFILE) && sink->ofmt_ctx->pb) {
+            avio_closep(&sink->ofmt_ctx->pb);
+        }
+        avformat_free_context(sink->ofmt_ctx);
+    }
+    if (sink->running) {
+        printf("Extra output %s: %lld packets, %.1f MB", sink->path, (long long)sink->written,
+               sink->bytes / (1024.0 * 1024.0));
+        if (sink->dropped > 0) {
+            printf(", dropped %lld packets", (long long)sink->dropped);
+        }
+        printf("%s\n", sink->error ? " (failed)" : "");
+    }
+    int result = sink->error || !sink->running ? -1 : 0;
+    av_dict_free(&sink->mux_opts);
+    av_packet_free(&sink->pkt);
+    av_free(sink->headers);
+    free(sink);
+    return result;
+}
+
+// Open an output for a stream of encoded packets, headers being its parameter sets, and start
+// its writer thread. The container follows the extension: .hevc/.h265/.265 raw Annex-B, .mp4
+// fragmented MP4, .m3u8 an HLS segmenter with fMP4 segments, anything else (.ts, .mkv, ...)
+// the matching muxer. Returns NULL on failure
+static Sink *open_sink(ProcessingContext *ctx, const char *path, SinkPolicy policy,
+                       const uint8_t *headers, int headers_size) {
+    Sink *sink = calloc(1, sizeof(*sink));
+    if (!sink) {
+        return NULL;
+    }
+    sink->path = path;
+    sink->policy = policy;
+    sink->duration = ctx->timestamp_increment;
+    
+    const char *ext = strrchr(path, '.');
+    sink->raw = ext && (!strcasecmp(ext, ".hevc") || !strcasecmp(ext, ".h265") || !strcasecmp(ext, ".265"));
+    if (sink->raw) {
+        sink->headers = av_malloc(headers_size + 1);
+        if (!sink->headers) {
+            goto fail;
+        }
+        memcpy(sink->headers, headers, headers_size);
+        sink->headers_size = headers_size;
+    } else {
+        const AVOutputFormat *fmt = av_guess_format(NULL, path, NULL);
+        if (!fmt || avformat_alloc_output_context2(&sink->ofmt_ctx, fmt, NULL, path) < 0) {
+            fprintf(stderr, "Error: No muxer for extra output %s\n", path);
+            goto fail;
+        }
+        AVStream *st = avformat_new_stream(sink->ofmt_ctx, NULL);
+        sink->pkt = av_packet_alloc();
+        if (!st || !sink->pkt) {
+            fprintf(stderr, "Failed to allocate extra output stream\n");
+            goto fail;
+        }
+        
+        // Same stream description as the main output's MP4 track
+        AVCodecParameters *codecpar = st->codecpar;
+        if (ctx->av_enc_ctx) {
+            if (avcodec_parameters_from_context(codecpar, ctx->av_enc_ctx) < 0) {
+                fprintf(stderr, "Failed to copy encoder parameters to extra output\n");
+                goto fail;
+            }
+        } else {
+            codecpar->codec_id = ctx->out_codec_id;
+            codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+            codecpar->width = OUTPUT_WIDTH;
+            codecpar->height = OUTPUT_HEIGHT;
+            codecpar->format = AV_PIX_FMT_YUV420P;
+            codecpar->bit_rate = ctx->encoder_params->rc.bitrate * 1000;
+        }
+        if (codecpar->extradata_size == 0 && headers_size > 0) {
+            codecpar->extradata = av_mallocz(headers_size + AV_INPUT_BUFFER_PADDING_SIZE);
+            if (!codecpar->extradata) {
+                goto fail;
+            }
+            memcpy(codecpar->extradata, headers, headers_size);
+            codecpar->extradata_size = headers_size;
+        }
+        st->time_base = (AVRational){1, OUTPUT_TIMEBASE};
+        
+        if (strcmp(fmt->name, "mp4") == 0) {
+            av_dict_set(&sink->mux_opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+            sink->fragmented = 1;
+        } else if (strcmp(fmt->name, "hls") == 0) {
+            av_dict_set(&sink->mux_opts, "hls_segment_type", "fmp4", 0);
+            av_dict_set(&sink->mux_opts, "hls_playlist_type", "event", 0);
+        }
+    }
+    
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->cond, NULL);
+    if (pthread_create(&sink->thread, NULL, sink_thread, sink) != 0) {
+        pthread_mutex_destroy(&sink->lock);
+        pthread_cond_destroy(&sink->cond);
+        fprintf(stderr, "Failed to start writer thread for %s\n", path);
+        goto fail;
+    }
+    sink->running = 1;
+    return sink;
+    
+fail:
+    close_sink(sink);
+    return NULL;
+}
+
+// Add an extra output for the main encoded stream (--also). Called once the main output is
+// open, so the parameter sets are known
+int add_sink(ProcessingContext *ctx, const char *path, SinkPolicy policy) {
+    Sink *sink = open_sink(ctx, path, policy, ctx->stream_headers, ctx->stream_headers_size);
+    if (!sink) {
+        return -1;
+    }
+    ctx->sinks[ctx->sink_count++] = sink;
+    printf("Also writing the encoded stream to %s (%s, %s when behind)\n", path,
+           sink->raw ? "raw HEVC" : sink->ofmt_ctx->oformat->name, policy == SINK_POLICY_DROP ? "drop" : "block");
+    return 0;
+}
+
+// Queue a copy of an encoded packet for a sink. When its queue is full the encoder waits for
+// it, or with the drop policy the sink skips packets up to the next keyframe or intra refresh
+// recovery point, so its stream stays decodable
+static int queue_sink_packet(Sink *sink, const EncodedPacket *pkt) {
+    pthread_mutex_lock(&sink->lock);
+    while (sink->policy == SINK_POLICY_BLOCK && sink->queue_count == SINK_QUEUE && !sink->error) {
+        pthread_cond_wait(&sink->cond, &sink->lock);
+    }
+    int full = sink->queue_count == SINK_QUEUE;
+    int error = sink->error;
+    int slot = (sink->queue_head + sink->queue_count) % SINK_QUEUE;
+    pthread_mutex_unlock(&sink->lock);
+    
+    // Only this thread touches resync and dropped
+    sink->resync |= full;
+    if (error || full || (sink->resync && !pkt->keyframe && !pkt->recovery)) {
+        sink->dropped++;
+        return 0;
+    }
+    sink->resync = 0;
+    
+    // Only this thread fills free slots, so the copy needs no lock
+    SinkPacket *sp = &sink->queue[slot];
+    sp->data = malloc(pkt->size);
+    if (!sp->data) {
+        return -1;
+    }
+    memcpy(sp->data, pkt->data, pkt->size);
+    sp->size = pkt->size;
+    sp->keyframe = pkt->keyframe;
+    sp->recovery = pkt->recovery;
+    sp->pts = pkt->pts;
+    sp->dts = pkt->dts;
+    
+    pthread_mutex_lock(&sink->lock);
+    sink->queue_count++;
+    pthread_cond_signal(&sink->cond);
+    pthread_mutex_unlock(&sink->lock);
+    return 0;
+}
+
+// Send an encoded packet of the main stream to every extra output
+static int fan_out_packet(ProcessingContext *ctx, const EncodedPacket *pkt) {
+    for (int i = 0; i < ctx->sink_count; i++) {
+        if (queue_sink_packet(ctx->sinks[i], pkt) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Finish every extra output; returns -1 if any of them failed
+int close_sinks(ProcessingContext *ctx) {
+    int result = 0;
+    for (int i = 0; i < ctx->sink_count; i++) {
+        if (close_sink(ctx->sinks[i]) < 0) {
+            result = -1;
+        }
+        ctx->sinks[i] = NULL;
+    }
+    ctx->sink_count = 0;
+    return result;
+}
+
+// Mark entry into a pipeline stage, returns the start time for stage_done()
+static inline int64_t stage_begin(PipelineStage stage) {
+    int64_t now = av_gettime_relative();
+    atomic_store_explicit(&pipeline_metrics.stage_enter_us[stage], now, memory_order_relaxed);
+    return now;
+}
+
+// Account time spent in a pipeline stage since 'start' and record a heartbeat; calls over the
+// frame budget are counted for the watchdog to report
+static inline void stage_done(PipelineStage stage, int64_t start, int frames) {
+    int64_t now = av_gettime_relative();
+    if (pipeline_metrics.frame_budget_us > 0 && now - start > pipeline_metrics.frame_budget_us) {
+        atomic_store_explicit(&pipeline_metrics.slow_call_us[stage], now - start, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pipeline_metrics.slow_calls[stage], 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&pipeline_metrics.stage_busy_us[stage], now - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pipeline_metrics.stage_frames[stage], frames, memory_order_relaxed);
+    atomic_store_explicit(&pipeline_metrics.stage_enter_us[stage], 0, memory_order_relaxed);
+    atomic_store_explicit(&pipeline_metrics.stage_heartbeat_us[stage], now, memory_order_relaxed);
+}
+
+// Bump a pipeline counter
+static inline void metrics_add(atomic_llong *counter, long long value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline long long metrics_get(atomic_llong *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Resident set size of this process in bytes
+long long read_rss_bytes(void) {
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(f);
+    }
+    return (long long)pages * sysconf(_SC_PAGESIZE);
+}
+
+// Render all metrics in Prometheus text exposition format
+int format_metrics(char *buf, size_t size) {
+    PipelineMetrics *m = &pipeline_metrics;
+    double elapsed = (av_gettime_relative() - m->start_time) / 1000000.0;
+    long long frames_in = metrics_get(&m->frames_in);
+    long long frames_out = metrics_get(&m->frames_out);
+    long long submitted = metrics_get(&m->frames_submitted);
+    long long expected = metrics_get(&m->expected_frames);
+    long long bytes_out = metrics_get(&m->bytes_out);
+    int n = 0;
+    
+#define METRICS_PRINTF(...) \
+    do { \
+        int w = snprintf(buf + n, n < (int)size ? size - n : 0, __VA_ARGS__); \
+        n += w > 0 ? w : 0; \
+    } while (0)
+    
+    METRICS_PRINTF("# TYPE hevc_stage_busy_seconds_total counter\n");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        METRICS_PRINTF("hevc_stage_busy_seconds_total{stage=\"%s\"} %.6f\n", stage_names[s],
+                       metrics_get(&m->stage_busy_us[s]) / 1000000.0);
+    }
+    METRICS_PRINTF("# TYPE hevc_stage_frames_total counter\n");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        METRICS_PRINTF("hevc_stage_frames_total{stage=\"%s\"} %lld\n", stage_names[s],
+                       metrics_get(&m->stage_frames[s]));
+    }
+    METRICS_PRINTF("# TYPE hevc_stage_slow_calls_total counter\n");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        METRICS_PRINTF("hevc_stage_slow_calls_total{stage=\"%s\"} %lld\n", stage_names[s],
+                       metrics_get(&m->slow_calls[s]));
+    }
+    // Throughput each stage would reach on its own, from its busy time
+    METRICS_PRINTF("# TYPE hevc_stage_fps gauge\n");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        long long busy = metrics_get(&m->stage_busy_us[s]);
+        METRICS_PRINTF("hevc_stage_fps{stage=\"%s\"} %.2f\n", stage_names[s],
+                       busy > 0 ? metrics_get(&m->stage_frames[s]) * 1000000.0 / busy : 0.0);
+    }
+    
+    METRICS_PRINTF("# TYPE hevc_frames_in_total counter\nhevc_frames_in_total %lld\n", frames_in);
+    METRICS_PRINTF("# TYPE hevc_frames_out_total counter\nhevc_frames_out_total %lld\n", frames_out);
+    METRICS_PRINTF("# TYPE hevc_frames_dropped_total counter\nhevc_frames_dropped_total %lld\n",
+                   metrics_get(&m->frames_dropped));
+    METRICS_PRINTF("# TYPE hevc_frames_skipped_total counter\nhevc_frames_skipped_total %lld\n",
+                   metrics_get(&m->frames_skipped));
+    METRICS_PRINTF("# TYPE hevc_output_bytes_total counter\nhevc_output_bytes_total %lld\n", bytes_out);
+    
+    // Frames queued inside x265 (lookahead, B-frames, frame threads)
+    METRICS_PRINTF("# TYPE hevc_encoder_lag_frames gauge\nhevc_encoder_lag_frames %lld\n", submitted - frames_out);
+    METRICS_PRINTF("# TYPE hevc_fps gauge\nhevc_fps %.2f\n", elapsed > 0 ? frames_in / elapsed : 0.0);
+    
+    double bitrate = 0.0;
+    if (frames_out > 0 && m->output_fps > 0) {
+        bitrate = bytes_out * 8.0 * m->output_fps / frames_out;
+    }
+    METRICS_PRINTF("# TYPE hevc_output_bitrate_bps gauge\nhevc_output_bitrate_bps %.0f\n", bitrate);
+    METRICS_PRINTF("# TYPE hevc_rss_bytes gauge\nhevc_rss_bytes %lld\n", read_rss_bytes());
+    
+    // ETA is only known when the input declares its length
+    double eta = -1.0;
+    if (expected > 0 && frames_in > 0 && elapsed > 0) {
+        eta = (expected > frames_in ? expected - frames_in : 0) * elapsed / frames_in;
+    }
+    METRICS_PRINTF("# TYPE hevc_eta_seconds gauge\nhevc_eta_seconds %.1f\n", eta);
+    METRICS_PRINTF("# TYPE hevc_uptime_seconds gauge\nhevc_uptime_seconds %.1f\n", elapsed);
+    
+    // Startup latency, -1 until the first packet is out
+    long long first_packet = metrics_get(&m->first_packet_us);
+    METRICS_PRINTF("# TYPE hevc_time_to_first_packet_seconds gauge\nhevc_time_to_first_packet_seconds %.3f\n",
+                   first_packet > 0 ? first_packet / 1000000.0 : -1.0);
+    
+#undef METRICS_PRINTF
+    
+    return n < (int)size ? n : (int)size - 1;
+}
+
+// Metrics endpoint served by a background thread
+typedef struct {
+    int listen_fd;
+    pthread_t thread;
+    atomic_int stop;
+    char unix_path[108];
+} MetricsServer;
+
+static MetricsServer metrics_server = { .listen_fd = -1 };
+
+// Answer one scrape; the request itself is not inspected
+void serve_metrics_client(int fd) {
+    char request[1024];
+    char body[METRICS_RESPONSE_SIZE];
+    char header[256];
+    
+    // Wait briefly for the request so clients that send nothing do not block the loop
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 1000) > 0) {
+        if (recv(fd, request, sizeof(request), 0) < 0) {
+            return;
+        }
+    }
+    
+    int body_len = format_metrics(body, sizeof(body));
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %d\r\n"
+                              "Connection: close\r\n\r\n", body_len);
+    if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len) {
+        send(fd, body, body_len, MSG_NOSIGNAL);
+    }
+}
+
+// Accept loop; polls so stop requests are noticed within a second
+void *metrics_server_thread(void *arg) {
+    MetricsServer *server = (MetricsServer *)arg;
+    
+    while (!atomic_load(&server->stop)) {
+        struct pollfd pfd = { server->listen_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        int client = accept(server->listen_fd, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+        serve_metrics_client(client);
+        close(client);
+    }
+    
+    return NULL;
+}
+
+// Start serving metrics on "unix:/path", "host:port" or a bare port (localhost)
+int start_metrics_server(const char *address) {
+    MetricsServer *server = &metrics_server;
+    
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        snprintf(server->unix_path, sizeof(server->unix_path), "%s", address + 5);
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", server->unix_path);
+        unlink(server->unix_path);
+        
+        server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server->listen_fd < 0 ||
+            bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Could not bind metrics socket '%s'\n", server->unix_path);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in addr = {0};
+        char host[64] = "127.0.0.1";
+        const char *port = address;
+        const char *colon = strrchr(address, ':');
+        if (colon) {
+            snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+            port = colon + 1;
+        }
+        
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)atoi(port));
+        if (inet_pton(AF_INET, host, &addr.sin_addr) != 1 || addr.sin_port == 0) {
+            fprintf(stderr, "Invalid metrics address '%s'\n", address);
+            return -1;
+        }
+        
+        int one = 1;
+        server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server->listen_fd >= 0) {
+            setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        if (server->listen_fd < 0 ||
+            bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Could not bind metrics address '%s'\n", address);
+            return -1;
+        }
+    }
+    
+    if (listen(server->listen_fd, METRICS_MAX_CLIENTS_BACKLOG) < 0 ||
+        pthread_create(&server->thread, NULL, metrics_server_thread, server) != 0) {
+        fprintf(stderr, "Could not start metrics endpoint\n");
+        close(server->listen_fd);
+        server->listen_fd = -1;
+        return -1;
+    }
+    
+    printf("Serving metrics on %s\n", address);
+    return 0;
+}
+
+// Stop the metrics thread and release its socket
+void stop_metrics_server(void) {
+    MetricsServer *server = &metrics_server;
+    if (server->listen_fd < 0) {
+        return;
+    }
+    
+    atomic_store(&server->stop, 1);
+    pthread_join(server->thread, NULL);
+    close(server->listen_fd);
+    server->listen_fd = -1;
+    if (server->unix_path[0]) {
+        unlink(server->unix_path);
+    }
+}
+
+// Stall and slow-frame watchdog
+typedef struct {
+    pthread_t thread;
+    int running;
+    atomic_int stop;
+    int64_t stall_us;                    // No progress for this long is a stall, 0 disables
+    int abort_on_trigger;                // Exit with WATCHDOG_EXIT_CODE after a dump
+    const char *dump_path;               // Append dumps here, stderr when NULL
+    pthread_t main_thread;               // Thread running the decode/encode loop
+    long long reported_slow[STAGE_COUNT]; // Slow calls per stage already reported
+} Watchdog;
+
+static Watchdog watchdog;
+static volatile sig_atomic_t watchdog_trace_fd = -1;
+static volatile sig_atomic_t watchdog_trace_done;
+
+// SIGUSR2 handler: the interrupted thread writes its own backtrace into the dump
+void watchdog_backtrace_handler(int sig) {
+    (void)sig;
+#ifdef __GLIBC__
+    void *frames[WATCHDOG_BACKTRACE_DEPTH];
+    int depth = backtrace(frames, WATCHDOG_BACKTRACE_DEPTH);
+    if (watchdog_trace_fd >= 0) {
+        backtrace_symbols_fd(frames, depth, watchdog_trace_fd);
+    }
+#endif
+    watchdog_trace_done = 1;
+}
+
+// List this process's threads with scheduler state and wait channel
+void watchdog_dump_threads(FILE *out) {
+    DIR *dir = opendir("/proc/self/task");
+    if (!dir) {
+        return;
+    }
+    
+    struct dirent *entry;
+    fprintf(out, "threads:\n");
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[300];
+        char comm[64] = "?";
+        char wchan[64] = "?";
+        char stat[512] = "";
+        char state = '?';
+        FILE *f;
+        
+        snprintf(path, sizeof(path), "/proc/self/task/%s/comm", entry->d_name);
+        if ((f = fopen(path, "r"))) {
+            if (fgets(comm, sizeof(comm), f)) {
+                comm[strcspn(comm, "\n")] = '\0';
+            }
+            fclose(f);
+        }
+        // The state follows the parenthesised command name
+        snprintf(path, sizeof(path), "/proc/self/task/%s/stat", entry->d_name);
+        if ((f = fopen(path, "r"))) {
+            if (fgets(stat, sizeof(stat), f)) {
+                char *paren = strrchr(stat, ')');
+                if (paren && paren[1] == ' ') {
+                    state = paren[2];
+                }
+            }
+            fclose(f);
+        }
+        snprintf(path, sizeof(path), "/proc/self/task/%s/wchan", entry->d_name);
+        if ((f = fopen(path, "r"))) {
+            if (!fgets(wchan, sizeof(wchan), f)) {
+                snprintf(wchan, sizeof(wchan), "?");
+            }
+            fclose(f);
+        }
+        fprintf(out, "  tid %-8s %-16s state %c wchan %s\n", entry->d_name, comm, state, wchan);
+    }
+    closedir(dir);
+}
+
+// Write a diagnostic snapshot of the pipeline
+void watchdog_dump(const char *reason) {
+    PipelineMetrics *m = &pipeline_metrics;
+    int64_t now = av_gettime_relative();
+    FILE *out = stderr;
+    if (watchdog.dump_path) {
+        out = fopen(watchdog.dump_path, "a");
+        if (!out) {
+            out = stderr;
+        }
+    }
+    
+    time_t wall = time(NULL);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&wall));
+    fprintf(out, "=== watchdog: %s at %s (uptime %.1f s) ===\n", reason, when,
+            (now - m->start_time) / 1000000.0);
+    
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        long long enter = metrics_get(&m->stage_enter_us[s]);
+        long long beat = metrics_get(&m->stage_heartbeat_us[s]);
+        if (enter) {
+            fprintf(out, "stage %-7s busy for %lld ms", stage_names[s], (now - enter) / 1000);
+        } else {
+            fprintf(out, "stage %-7s idle", stage_names[s]);
+        }
+        if (beat) {
+            fprintf(out, ", last heartbeat %lld ms ago", (now - beat) / 1000);
+        }
+        fprintf(out, ", %lld frames, %.2f s busy\n", metrics_get(&m->stage_frames[s]),
+                metrics_get(&m->stage_busy_us[s]) / 1000000.0);
+    }
+    
+    long long submitted = metrics_get(&m->frames_submitted);
+    long long frames_out = metrics_get(&m->frames_out);
+    fprintf(out, "frames: in %lld, submitted %lld, out %lld, dropped %lld, skipped %lld\n",
+            metrics_get(&m->frames_in), submitted, frames_out, metrics_get(&m->frames_dropped),
+            metrics_get(&m->frames_skipped));
+    fprintf(out, "queues: encoder lag %lld frames\n", submitted - frames_out);
+    fprintf(out, "last pts: input %lld, output %lld\n",
+            metrics_get(&m->last_input_pts), metrics_get(&m->last_output_pts));
+    fprintf(out, "rss: %lld bytes\n", read_rss_bytes());
+    watchdog_dump_threads(out);
+    
+    // Ask the processing thread for its own stack; give it a second to answer
+    fprintf(out, "processing thread backtrace:\n");
+    fflush(out);
+    watchdog_trace_done = 0;
+    watchdog_trace_fd = fileno(out);
+    if (pthread_kill(watchdog.main_thread, SIGUSR2) == 0) {
+        for (int i = 0; i < 100 && !watchdog_trace_done; i++) {
+            av_usleep(10000);
+        }
+    }
+    if (!watchdog_trace_done) {
+        fprintf(out, "  (not available)\n");
+    }
+    watchdog_trace_fd = -1;
+    fprintf(out, "=== end watchdog dump ===\n");
+    
+    if (out != stderr) {
+        fclose(out);
+    } else {
+        fflush(out);
+    }
+}
+
+// Poll stage heartbeats, dump on stalls and on stage calls stage_done() found over budget
+void *watchdog_thread(void *arg) {
+    (void)arg;
+    PipelineMetrics *m = &pipeline_metrics;
+    long long last_progress = -1;
+    int64_t last_progress_time = av_gettime_relative();
+    int stall_reported = 0;
+    
+    while (!atomic_load(&watchdog.stop)) {
+        av_usleep(WATCHDOG_POLL_MS * 1000);
+        int64_t now = av_gettime_relative();
+        int triggered = 0;
+        char reason[128];
+        
+        // Slow frames: stage calls that finished over the budget since the last poll
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            long long slow = metrics_get(&m->slow_calls[s]);
+            if (slow > watchdog.reported_slow[s]) {
+                snprintf(reason, sizeof(reason), "%s exceeded frame budget %lld times, last %lld ms",
+                         stage_names[s], slow - watchdog.reported_slow[s], metrics_get(&m->slow_call_us[s]) / 1000);
+                watchdog.reported_slow[s] = slow;
+                watchdog_dump(reason);
+                triggered = 1;
+            }
+        }
+        
+        // Stalls: no packet read, frame decoded or frame encoded for too long
+        long long progress = metrics_get(&m->stage_frames[STAGE_DEMUX]) +
+                             metrics_get(&m->frames_in) + metrics_get(&m->frames_out);
+        if (progress != last_progress) {
+            last_progress = progress;
+            last_progress_time = now;
+            stall_reported = 0;
+        } else if (watchdog.stall_us > 0 && now - last_progress_time > watchdog.stall_us && !stall_reported) {
+            snprintf(reason, sizeof(reason), "no progress for %lld s",
+                     (long long)(now - last_progress_time) / 1000000);
+            watchdog_dump(reason);
+            stall_reported = 1;
+            triggered = 1;
+        }
+        
+        if (triggered && watchdog.abort_on_trigger) {
+            fprintf(stderr, "Watchdog: aborting with exit code %d\n", WATCHDOG_EXIT_CODE);
+            _exit(WATCHDOG_EXIT_CODE);
+        }
+    }
+    
+    return NULL;
+}
+
+// Start the watchdog for the calling (processing) thread
+int start_watchdog(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watchdog_backtrace_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+    
+#ifdef __GLIBC__
+    // The first backtrace() call loads libgcc, which must not happen inside the handler
+    void *warmup[1];
+    backtrace(warmup, 1);
+#endif
+    
+    watchdog.main_thread = pthread_self();
+    if (pthread_create(&watchdog.thread, NULL, watchdog_thread, NULL) != 0) {
+        fprintf(stderr, "Could not start watchdog thread\n");
+        return -1;
+    }
+    watchdog.running = 1;
+    
+    printf("Watchdog: stall after %lld s, frame budget %lld ms%s\n",
+           (long long)(watchdog.stall_us / 1000000), (long long)(pipeline_metrics.frame_budget_us / 1000),
+           watchdog.abort_on_trigger ? ", abort on trigger" : "");
+    return 0;
+}
+
+// Stop the watchdog thread
+void stop_watchdog(void) {
+    if (!watchdog.running) {
+        return;
+    }
+    atomic_store(&watchdog.stop, 1);
+    pthread_join(watchdog.thread, NULL);
+    watchdog.running = 0;
+}
+
+// Pull every packet the encoder has ready and write it to the output
+// Returns 0 when more input is needed, AVERROR_EOF once fully flushed, -1 on error
+int drain_encoder(ProcessingContext *ctx) {
+    EncodedPacket pkt;
+    
+    while (1) {
+        int64_t stage_start = stage_begin(STAGE_ENCODE);
+        int ret = ctx->backend->receive_packet(ctx, &pkt);
+        stage_done(STAGE_ENCODE, stage_start, 0);
+        if (ret <= 0) {
+            return ret;
+        }
+        
+        record_frame_stats(ctx, &pkt);
+        metrics_add(&pipeline_metrics.frames_out, 1);
+        metrics_add(&pipeline_metrics.bytes_out, pkt.size);
+        ctx->enc_stats.packets++;
+        ctx->enc_stats.keyframes += pkt.keyframe;
+        ctx->enc_stats.recovery_points += pkt.recovery;
+        ctx->enc_stats.bytes += pkt.size;
+        
+        stage_start = stage_begin(STAGE_MUX);
+        if ((ctx->clip_mode && route_packet_to_clip(ctx, &pkt) < 0) ||
+            ((ctx->split_duration > 0 || ctx->split_bytes > 0) && route_packet_to_segment(ctx, &pkt) < 0)) {
+            stage_done(STAGE_MUX, stage_start, 0);
+            return -1;
+        }
+        ret = write_encoded_packet(ctx, &pkt);
+        if (ret >= 0 && ctx->sink_count > 0) {
+            ret = fan_out_packet(ctx, &pkt);
+        }
+        stage_done(STAGE_MUX, stage_start, 1);
+        if (ret < 0) {
+            return -1;
+        }
+        if (!metrics_get(&pipeline_metrics.first_packet_us)) {
+            atomic_store(&pipeline_metrics.first_packet_us, av_gettime_relative() - pipeline_metrics.launch_time);
+        }
+    }
+}
+
+// Names of the HEVC NAL unit types reported in the input statistics
+static const char *const hevc_nal_type_names[HEVC_NAL_TYPES] = {
+    [0] = "TRAIL_N", [1] = "TRAIL_R", [2] = "TSA_N", [3] = "TSA_R",
+    [4] = "STSA_N", [5] = "STSA_R", [6] = "RADL_N", [7] = "RADL_R",
+    [8] = "RASL_N", [9] = "RASL_R", [16] = "BLA_W_LP", [17] = "BLA_W_RADL",
+    [18] = "BLA_N_LP", [19] = "IDR_W_RADL", [20] = "IDR_N_LP", [21] = "CRA_NUT",
+    [32] = "VPS", [33] = "SPS", [34] = "PPS", [35] = "AUD",
+    [36] = "EOS", [37] = "EOB", [38] = "FD", [39] = "SEI_PREFIX", [40] = "SEI_SUFFIX",
+};
+
+// Check whether a file looks like a raw Annex-B HEVC stream we can read directly
+static int is_hevc_es_file(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (!ext || (strcasecmp(ext, ".hevc") && strcasecmp(ext, ".h265") && strcasecmp(ext, ".265"))) {
+        return 0;
+    }
+    
+    uint8_t head[ES_SNIFF_SIZE];
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    size_t n = fread(head, 1, sizeof(head), f);
+    fclose(f);
+    
+    // Only zero bytes may precede the first start code
+    const uint8_t *sc = find_start_code_c(head, head + n);
+    for (const uint8_t *p = head; p < sc; p++) {
+        if (*p) {
+            return 0;
+        }
+    }
+    return sc < head + n;
+}
+
+// Map an elementary stream file and position the reader on its first NAL
+EsReader *es_reader_open(const char *path) {
+    EsReader *r = calloc(1, sizeof(EsReader));
+    if (!r) {
+        return NULL;
+    }
+    
+    r->fd = open(path, O_RDONLY);
+    struct stat st;
+    if (r->fd < 0 || fstat(r->fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Could not open elementary stream '%s'\n", path);
+        if (r->fd >= 0) {
+            close(r->fd);
+        }
+        free(r);
+        return NULL;
+    }
+    
+    r->size = st.st_size;
+    void *map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map elementary stream '%s'\n", path);
+        close(r->fd);
+        free(r);
+        return NULL;
+    }
+    madvise(map, r->size, MADV_SEQUENTIAL);
+    
+    r->data = map;
+    r->pos = r->data;
+    atomic_init(&r->refs, 1);
+    r->pending_nal = kernels.find_start_code(r->data, r->data + r->size);
+    return r;
+}
+
+// Drop a reference; the mapping goes away once the owner and every packet let go
+static void es_reader_unref(EsReader *r) {
+    if (atomic_fetch_sub(&r->refs, 1) == 1) {
+        munmap((void *)r->data, r->size);
+        close(r->fd);
+        free(r);
+    }
+}
+
+void es_reader_close(EsReader *r) {
+    if (r) {
+        es_reader_unref(r);
+    }
+}
+
+// Whether a NAL following a VCL NAL of the current picture opens a new access unit.
+// The pictures of all MV-HEVC views form one access unit, so only base layer NALs can open one
+static int es_nal_starts_au(int type, const uint8_t *payload, const uint8_t *next) {
+    if ((payload[0] & 1) || (payload[1] >> 3)) {
+        return 0;                                          // nuh_layer_id > 0
+    }
+    if (type < 32) {
+        return next - payload > 2 && (payload[2] & 0x80);  // first_slice_segment_in_pic_flag
+    }
+    return (type >= 32 && type <= 35) || type == 39 ||
+           (type >= 41 && type <= 44) || (type >= 48 && type <= 55);
+}
+
+// Packet data lives in the mapping, which each packet keeps alive
+static void es_buffer_free(void *opaque, uint8_t *data) {
+    (void)data;
+    es_reader_unref(opaque);
+}
+
+// Read the next access unit into pkt, returns AVERROR_EOF at the end of the stream
+int es_reader_read(EsReader *r, AVPacket *pkt) {
+    const uint8_t *end = r->data + r->size;
+    const uint8_t *nal = r->pending_nal;
+    const uint8_t *next = r->pending_next;
+    int seen_vcl = 0;
+    
+    if (nal >= end) {
+        return AVERROR_EOF;
+    }
+    
+    // Walk NAL units until one opens the next picture
+    while (nal < end) {
+        const uint8_t *payload = nal + 3;
+        if (!next) {
+            next = kernels.find_start_code(payload, end);
+        }
+        if (next - payload >= 2) {
+            int type = (payload[0] >> 1) & 0x3f;
+            if (seen_vcl && es_nal_starts_au(type, payload, next)) {
+                break;
+            }
+            r->nal_count[type]++;
+            r->nal_bytes[type] += next - payload;
+            seen_vcl |= type < 32;
+        }
+        nal = next;
+        next = NULL;
+    }
+    r->pending_nal = nal;
+    r->pending_next = next;
+    
+    // Leading zeros of a 4-byte start code belong to the next access unit
+    const uint8_t *au_start = r->pos;
+    const uint8_t *au_end = nal;
+    while (nal < end && au_end > au_start && au_end[-1] == 0) {
+        au_end--;
+    }
+    r->pos = au_end;
+    r->au_count++;
+    
+    // Zero-copy when the mapping has room for the decoder's overread padding
+    int size = au_end - au_start;
+    if (end - au_end >= AV_INPUT_BUFFER_PADDING_SIZE) {
+        pkt->buf = av_buffer_create((uint8_t *)au_start, size, es_buffer_free, r, AV_BUFFER_FLAG_READONLY);
+        if (!pkt->buf) {
+            return AVERROR(ENOMEM);
+        }
+        atomic_fetch_add(&r->refs, 1);
+        pkt->data = (uint8_t *)au_start;
+        pkt->size = size;
+    } else {
+        int ret = av_new_packet(pkt, size);
+        if (ret < 0) {
+            return ret;
+        }
+        memcpy(pkt->data, au_start, size);
+    }
+    pkt->pts = AV_NOPTS_VALUE;
+    pkt->dts = AV_NOPTS_VALUE;
+    pkt->stream_index = 0;
+    return 0;
+}
+
+// Read the next input packet from the elementary stream reader or the demuxer
+int read_input_packet(ProcessingContext *ctx) {
+    if (ctx->es_reader) {
+        return es_reader_read(ctx->es_reader, ctx->pkt);
+    }
+    return av_read_frame(ctx->fmt_ctx, ctx->pkt);
+}
+
+// Close the current input, whichever reader it uses
+void close_input(ProcessingContext *ctx) {
+    if (ctx->fmt_ctx) {
+        avformat_close_input(&ctx->fmt_ctx);
+    }
+    es_reader_close(ctx->es_reader);
+    ctx->es_reader = NULL;
+}
+
+// Open the proxy encoder: all-intra, so any frame of the proxy decodes on its own
+int open_proxy_writer(ProcessingContext *ctx, const char *path) {
+    ProxyWriter *pw = &ctx->proxy;
+    char tmp_path[PATH_MAX];
+    
+    pw->params = x265_param_alloc();
+    if (!pw->params) {
+        fprintf(stderr, "Failed to allocate proxy encoder parameters\n");
+        return -1;
+    }
+    x265_param_default_preset(pw->params, "veryfast", NULL);
+    pw->params->sourceWidth = PROXY_WIDTH;
+    pw->params->sourceHeight = PROXY_HEIGHT;
+    pw->params->fpsNum = FRAME_RATE;
+    pw->params->fpsDenom = 1;
+    pw->params->internalCsp = X265_CSP_I420;
+    pw->params->keyframeMin = 1;
+    pw->params->keyframeMax = 1;
+    pw->params->bframes = 0;
+    pw->params->rc.rateControlMode = X265_RC_CRF;
+    pw->params->rc.rfConstant = PROXY_CRF;
+    pw->params->bRepeatHeaders = 1;
+    if (apply_cpu_level_to_x265(pw->params) < 0) {
+        return -1;
+    }
+    pw->encoder = x265_encoder_open(pw->params);
+    if (!pw->encoder) {
+        fprintf(stderr, "Failed to open proxy encoder\n");
+        return -1;
+    }
+    pw->pic = x265_picture_alloc();
+    x265_picture_init(pw->params, pw->pic);
+    
+    // Same left-eye crop as the main scaler, to the proxy size
+    pw->sws_ctx = sws_getContext(INPUT_WIDTH/2, INPUT_HEIGHT, AV_PIX_FMT_YUV420P,
+                                 PROXY_WIDTH, PROXY_HEIGHT, AV_PIX_FMT_YUV420P,
+                                 SWS_BICUBIC, NULL, NULL, NULL);
+    pw->buffer = malloc(PROXY_WIDTH * PROXY_HEIGHT * 3 / 2);
+    if (!pw->sws_ctx || !pw->buffer) {
+        fprintf(stderr, "Failed to initialize proxy scaler\n");
+        return -1;
+    }
+    
+    snprintf(pw->path, sizeof(pw->path), "%s", path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    pw->file = fopen(tmp_path, "wb");
+    if (!pw->file) {
+        fprintf(stderr, "Error: Could not open proxy file: %s\n", tmp_path);
+        return -1;
+    }
+    printf("Writing %dx%d intra-only proxy to %s\n", PROXY_WIDTH, PROXY_HEIGHT, path);
+    return 0;
+}
+
+static int write_proxy_nals(ProxyWriter *pw, x265_nal *nals, uint32_t nal_count) {
+    for (uint32_t i = 0; i < nal_count; i++) {
+        if (fwrite(nals[i].payload, 1, nals[i].sizeBytes, pw->file) != nals[i].sizeBytes) {
+            fprintf(stderr, "Error writing proxy\n");
+            return -1;
+        }
+        pw->bytes += nals[i].sizeBytes;
+    }
+    return 0;
+}
+
+// Crop, scale and encode one decoded source frame into the proxy
+int write_proxy_frame(ProcessingContext *ctx, AVFrame *frame) {
+    ProxyWriter *pw = &ctx->proxy;
+    x265_nal *nals = NULL;
+    uint32_t nal_count = 0;
+    
+    uint8_t *dst_data[4] = {
+        pw->buffer,
+        pw->buffer + PROXY_WIDTH * PROXY_HEIGHT,
+        pw->buffer + PROXY_WIDTH * PROXY_HEIGHT * 5 / 4,
+        NULL
+    };
+    int dst_linesize[4] = { PROXY_WIDTH, PROXY_WIDTH / 2, PROXY_WIDTH / 2, 0 };
+    sws_scale(pw->sws_ctx, (const uint8_t * const *)frame->data, frame->linesize, 0, INPUT_HEIGHT,
+              dst_data, dst_linesize);
+    
+    for (int i = 0; i < 3; i++) {
+        pw->pic->planes[i] = dst_data[i];
+        pw->pic->stride[i] = dst_linesize[i];
+    }
+    pw->pic->pts = pw->frames++;
+    pw->pic->bitDepth = 8;
+    pw->pic->colorSpace = X265_CSP_I420;
+    
+    if (x265_encoder_encode(pw->encoder, &nals, &nal_count, pw->pic, NULL) < 0) {
+        fprintf(stderr, "Error encoding proxy frame\n");
+        return -1;
+    }
+    return write_proxy_nals(pw, nals, nal_count);
+}
+
+// Flush the proxy encoder and publish the proxy under its final name
+int finish_proxy_writer(ProcessingContext *ctx) {
+    ProxyWriter *pw = &ctx->proxy;
+    x265_nal *nals = NULL;
+    uint32_t nal_count = 0;
+    char tmp_path[PATH_MAX];
+    int ret;
+    
+    while ((ret = x265_encoder_encode(pw->encoder, &nals, &nal_count, NULL, NULL)) > 0) {
+        if (write_proxy_nals(pw, nals, nal_count) < 0) {
+            return -1;
+        }
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", pw->path);
+    int close_ret = fclose(pw->file);
+    pw->file = NULL;
+    if (ret < 0 || close_ret != 0 || rename(tmp_path, pw->path) != 0) {
+        fprintf(stderr, "Error finishing proxy %s\n", pw->path);
+        remove(tmp_path);
+        return -1;
+    }
+    printf("Wrote proxy %s: %lld frames, %.1f MB\n", pw->path, (long long)pw->frames, pw->bytes / (1024.0 * 1024.0));
+    return 0;
+}
+
+// Free the proxy encoder; an unfinished proxy is deleted so no later run picks it up
+void close_proxy_writer(ProcessingContext *ctx) {
+    ProxyWriter *pw = &ctx->proxy;
+    if (pw->file) {
+        char tmp_path[PATH_MAX];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", pw->path);
+        fclose(pw->file);
+        pw->file = NULL;
+        remove(tmp_path);
+    }
+    if (pw->encoder) {
+        x265_encoder_close(pw->encoder);
+        pw->encoder = NULL;
+    }
+    if (pw->params) {
+        x265_param_free(pw->params);
+        pw->params = NULL;
+    }
+    if (pw->pic) {
+        x265_picture_free(pw->pic);
+        pw->pic = NULL;
+    }
+    if (pw->sws_ctx) {
+        sws_freeContext(pw->sws_ctx);
+        pw->sws_ctx = NULL;
+    }
+    free(pw->buffer);
+    pw->buffer = NULL;
+}
+
+// Black out the (full range) sprite sheet for the next set of tiles
+static void clear_sprite_sheet(AVFrame *sheet) {
+    memset(sheet->data[0], 0, sheet->linesize[0] * sheet->height);
+    memset(sheet->data[1], 128, sheet->linesize[1] * (sheet->height / 2));
+    memset(sheet->data[2], 128, sheet->linesize[2] * (sheet->height / 2));
+}
+
+// Compress the current sheet to <stem>_NNN.jpg
+static int write_sprite_sheet(ThumbnailWriter *tw) {
+    char path[PATH_MAX];
+    int ret = avcodec_send_frame(tw->jpeg, tw->sheet);
+    if (ret >= 0) {
+        ret = avcodec_receive_packet(tw->jpeg, tw->pkt);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Error compressing sprite sheet %d\n", tw->sheets);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s_%03d.jpg", tw->stem, tw->sheets);
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(tw->pkt->data, 1, tw->pkt->size, f) != (size_t)tw->pkt->size) {
+        fprintf(stderr, "Error writing sprite sheet %s\n", path);
+        if (f) {
+            fclose(f);
+        }
+        av_packet_unref(tw->pkt);
+        return -1;
+    }
+    fclose(f);
+    av_packet_unref(tw->pkt);
+    
+    tw->sheets++;
+    tw->tiles = 0;
+    if (av_frame_make_writable(tw->sheet) < 0) {
+        return -1;
+    }
+    clear_sprite_sheet(tw->sheet);
+    return 0;
+}
+
+static void format_vtt_time(char *buf, size_t size, int64_t pts) {
+    int64_t ms = pts * 1000 / OUTPUT_TIMEBASE;
+    snprintf(buf, size, "%02lld:%02lld:%02lld.%03lld", (long long)(ms / 3600000), (long long)(ms / 60000 % 60),
+             (long long)(ms / 1000 % 60), (long long)(ms % 1000));
+}
+
+// Copy one scaled picture onto the sheet and add its cue to the WebVTT map
+static int add_sprite_tile(ThumbnailWriter *tw, const uint8_t *picture, int64_t pts) {
+    int x = (tw->tiles % THUMB_COLUMNS) * OUTPUT_WIDTH;
+    int y = (tw->tiles / THUMB_COLUMNS) * OUTPUT_HEIGHT;
+    const uint8_t *planes[3] = {
+        picture,
+        picture + OUTPUT_WIDTH * OUTPUT_HEIGHT,
+        picture + OUTPUT_WIDTH * OUTPUT_HEIGHT * 5 / 4
+    };
+    for (int p = 0; p < 3; p++) {
+        int shift = p > 0;
+        int width = OUTPUT_WIDTH >> shift;
+        const uint8_t *lut = tw->range_lut[shift];
+        for (int row = 0; row < OUTPUT_HEIGHT >> shift; row++) {
+            // Scaled pictures are limited range, the JPEG sheet is full range
+            uint8_t *dst = tw->sheet->data[p] + ((y >> shift) + row) * tw->sheet->linesize[p] + (x >> shift);
+            const uint8_t *src = planes[p] + row * width;
+            for (int i = 0; i < width; i++) {
+                dst[i] = lut[src[i]];
+            }
+        }
+    }
+    
+    // Cues point at the sheet by file name, relative to the map
+    char start[32], end[32];
+    const char *slash = strrchr(tw->stem, '/');
+    format_vtt_time(start, sizeof(start), pts);
+    format_vtt_time(end, sizeof(end), pts + tw->interval);
+    fprintf(tw->vtt, "%s --> %s\n%s_%03d.jpg#xywh=%d,%d,%d,%d\n\n", start, end, slash ? slash + 1 : tw->stem,
+            tw->sheets, x, y, OUTPUT_WIDTH, OUTPUT_HEIGHT);
+    
+    if (++tw->tiles == THUMB_COLUMNS * THUMB_ROWS) {
+        return write_sprite_sheet(tw);
+    }
+    return 0;
+}
+
+static void *thumbnail_thread(void *opaque) {
+    ThumbnailWriter *tw = opaque;
+    
+    pthread_mutex_lock(&tw->lock);
+    while (1) {
+        while (tw->queue_count == 0 && !tw->stop) {
+            pthread_cond_wait(&tw->cond, &tw->lock);
+        }
+        if (tw->queue_count == 0) {
+            break;
+        }
+        int slot = tw->queue_head;
+        pthread_mutex_unlock(&tw->lock);
+        
+        // Tiling and JPEG compression run without the lock, so the encode loop never waits on them
+        if (!tw->error && add_sprite_tile(tw, tw->queue[slot], tw->queue_pts[slot]) < 0) {
+            tw->error = 1;
+        }
+        
+        pthread_mutex_lock(&tw->lock);
+        tw->queue_head = (tw->queue_head + 1) % THUMB_QUEUE;
+        tw->queue_count--;
+    }
+    pthread_mutex_unlock(&tw->lock);
+    
+    // The last, partly filled sheet
+    if (!tw->error && tw->tiles > 0 && write_sprite_sheet(tw) < 0) {
+        tw->error = 1;
+    }
+    return NULL;
+}
+
+// Set up sprite sheets <stem>_NNN.jpg and their map <stem>.vtt next to the output, one
+// thumbnail every 'seconds', and start the thread that builds them
+int start_thumbnail_writer(ProcessingContext *ctx, const char *output_file, double seconds) {
+    ThumbnailWriter *tw = &ctx->thumbs;
+    char path[PATH_MAX];
+    
+    // out.mp4 gives out_thumbs; a pattern such as clip_%03d.mp4 gives clip_thumbs
+    const char *end = strchr(output_file, '%');
+    if (!end) {
+        end = strrchr(output_file, '.');
+        if (!end || strchr(end, '/')) {
+            end = output_file + strlen(output_file);
+        }
+    }
+    int len = (int)(end - output_file);
+    snprintf(tw->stem, sizeof(tw->stem), "%.*s%sthumbs", len, output_file,
+             len > 0 && output_file[len - 1] == '_' ? "" : "_");
+    tw->interval = (int64_t)(seconds * OUTPUT_TIMEBASE);
+    
+    // Luma 16-235 and chroma 16-240 stretch to 0-255 for the YUVJ420P sheets
+    for (int v = 0; v < 256; v++) {
+        int luma = ((v - 16) * 255 + 109) / 219;
+        int chroma = 128 + (int)lrint((v - 128) * 255.0 / 224.0);
+        tw->range_lut[0][v] = luma < 0 ? 0 : luma > 255 ? 255 : luma;
+        tw->range_lut[1][v] = chroma < 0 ? 0 : chroma > 255 ? 255 : chroma;
+    }
+    
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    tw->jpeg = codec ? avcodec_alloc_context3(codec) : NULL;
+    if (!tw->jpeg) {
+        fprintf(stderr, "No JPEG encoder for sprite sheets\n");
+        return -1;
+    }
+    tw->jpeg->width = THUMB_COLUMNS * OUTPUT_WIDTH;
+    tw->jpeg->height = THUMB_ROWS * OUTPUT_HEIGHT;
+    tw->jpeg->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    tw->jpeg->time_base = (AVRational){1, 1};
+    tw->jpeg->flags |= AV_CODEC_FLAG_QSCALE;
+    tw->jpeg->global_quality = FF_QP2LAMBDA * THUMB_JPEG_QSCALE;
+    if (avcodec_open2(tw->jpeg, codec, NULL) < 0) {
+        fprintf(stderr, "Failed to open JPEG encoder for sprite sheets\n");
+        return -1;
+    }
+    
+    tw->sheet = av_frame_alloc();
+    tw->pkt = av_packet_alloc();
+    if (!tw->sheet || !tw->pkt) {
+        return -1;
+    }
+    tw->sheet->format = AV_PIX_FMT_YUVJ420P;
+    tw->sheet->width = tw->jpeg->width;
+    tw->sheet->height = tw->jpeg->height;
+    tw->sheet->quality = tw->jpeg->global_quality;
+    if (av_frame_get_buffer(tw->sheet, 0) < 0) {
+        return -1;
+    }
+    clear_sprite_sheet(tw->sheet);
+    for (int i = 0; i < THUMB_QUEUE; i++) {
+        tw->queue[i] = malloc(OUTPUT_WIDTH * OUTPUT_HEIGHT * 3 / 2);
+        if (!tw->queue[i]) {
+            return -1;
+        }
+    }
+    
+    snprintf(path, sizeof(path), "%s.vtt", tw->stem);
+    tw->vtt = fopen(path, "w");
+    if (!tw->vtt) {
+        fprintf(stderr, "Error: Could not open thumbnail map %s\n", path);
+        return -1;
+    }
+    fprintf(tw->vtt, "WEBVTT\n\n");
+    
+    pthread_mutex_init(&tw->lock, NULL);
+    pthread_cond_init(&tw->cond, NULL);
+    if (pthread_create(&tw->thread, NULL, thumbnail_thread, tw) != 0) {
+        fprintf(stderr, "Failed to start thumbnail thread\n");
+        pthread_mutex_destroy(&tw->lock);
+        pthread_cond_destroy(&tw->cond);
+        return -1;
+    }
+    tw->running = 1;
+    printf("Writing a thumbnail every %.1f s to %s_NNN.jpg and %s\n", seconds, tw->stem, path);
+    return 0;
+}
+
+// Queue the picture in scaled_buffer when a thumbnail is due; dropped rather than waited for
+// when the sprite thread is behind
+void submit_thumbnail(ProcessingContext *ctx, int64_t pts) {
+    ThumbnailWriter *tw = &ctx->thumbs;
+    if (pts < tw->next_pts) {
+        return;
+    }
+    while (tw->next_pts <= pts) {
+        tw->next_pts += tw->interval;
+    }
+    
+    pthread_mutex_lock(&tw->lock);
+    int full = tw->queue_count == THUMB_QUEUE;
+    int slot = (tw->queue_head + tw->queue_count) % THUMB_QUEUE;
+    pthread_mutex_unlock(&tw->lock);
+    if (full) {
+        tw->dropped++;
+        return;
+    }
+    
+    // Only this thread fills free slots, so the copy needs no lock
+    memcpy(tw->queue[slot], ctx->scaled_buffer, OUTPUT_WIDTH * OUTPUT_HEIGHT * 3 / 2);
+    tw->queue_pts[slot] = pts;
+    pthread_mutex_lock(&tw->lock);
+    tw->queue_count++;
+    pthread_cond_signal(&tw->cond);
+    pthread_mutex_unlock(&tw->lock);
+}
+
+// Let the sprite thread finish the queued thumbnails and the last sheet, then free everything
+void close_thumbnail_writer(ProcessingContext *ctx) {
+    ThumbnailWriter *tw = &ctx->thumbs;
+    if (tw->running) {
+        pthread_mutex_lock(&tw->lock);
+        tw->stop = 1;
+        pthread_cond_signal(&tw->cond);
+        pthread_mutex_unlock(&tw->lock);
+        pthread_join(tw->thread, NULL);
+        pthread_mutex_destroy(&tw->lock);
+        pthread_cond_destroy(&tw->cond);
+        tw->running = 0;
+        printf("Wrote %d sprite sheets to %s_NNN.jpg%s", tw->sheets, tw->stem, tw->error ? " (with errors)" : "");
+        if (tw->dropped > 0) {
+            printf(", dropped %lld thumbnails", (long long)tw->dropped);
+        }
+        printf("\n");
+    }
+    if (tw->vtt) {
+        fclose(tw->vtt);
+        tw->vtt = NULL;
+    }
+    for (int i = 0; i < THUMB_QUEUE; i++) {
+        free(tw->queue[i]);
+        tw->queue[i] = NULL;
+    }
+    av_frame_free(&tw->sheet);
+    av_packet_free(&tw->pkt);
+    avcodec_free_context(&tw->jpeg);
+}
+
+// Create <output>.phash for a hash of every interval-th encoded frame
+int open_phash_writer(ProcessingContext *ctx, const char *output_file, int interval) {
+    PhashWriter *ph = &ctx->phash;
+    char path[PATH_MAX];
+    
+    // Area averaging down to the thumbnail the DCT runs on
+    ph->sws_ctx = sws_getContext(OUTPUT_WIDTH, OUTPUT_HEIGHT, AV_PIX_FMT_GRAY8,
+                                 PHASH_SIZE, PHASH_SIZE, AV_PIX_FMT_GRAY8,
+                                 SWS_AREA, NULL, NULL, NULL);
+    if (!ph->sws_ctx) {
+        fprintf(stderr, "Failed to initialize perceptual hash scaler\n");
+        return -1;
+    }
+    for (int k = 0; k < PHASH_COEFFS; k++) {
+        for (int i = 0; i < PHASH_SIZE; i++) {
+            ph->basis[k * PHASH_SIZE + i] = (float)cos(M_PI * (2 * i + 1) * k / (2.0 * PHASH_SIZE));
+        }
+    }
+    ph->interval = interval;
+    
+    snprintf(path, sizeof(path), "%s.phash", output_file);
+    ph->file = fopen(path, "wb");
+    if (!ph->file) {
+        fprintf(stderr, "Error: Could not open perceptual hash file: %s\n", path);
+        return -1;
+    }
+    PhashHeader header = {
+        .version = PHASH_VERSION,
+        .record_size = sizeof(PhashRecord),
+        .timebase_num = 1,
+        .timebase_den = OUTPUT_TIMEBASE,
+    };
+    memcpy(header.magic, PHASH_MAGIC, sizeof(header.magic));
+    if (fwrite(&header, sizeof(header), 1, ph->file) != 1) {
+        fprintf(stderr, "Error writing perceptual hash file\n");
+        return -1;
+    }
+    printf("Writing perceptual hashes of every %d. frame to %s\n", interval, path);
+    return 0;
+}
+
+static int compare_floats(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// 64-bit DCT hash of the picture in scaled_buffer: the 8x8 lowest frequencies of its 32x32
+// luma thumbnail, each compared against their median (the DC term excluded)
+uint64_t compute_phash(ProcessingContext *ctx) {
+    PhashWriter *ph = &ctx->phash;
+    uint8_t thumb[PHASH_SIZE * PHASH_SIZE];
+    float x[PHASH_SIZE * PHASH_SIZE];
+    float rows[PHASH_COEFFS * PHASH_SIZE];
+    float rows_t[PHASH_SIZE * PHASH_COEFFS];
+    float coeffs[PHASH_COEFFS * PHASH_COEFFS];
+    float sorted[PHASH_COEFFS * PHASH_COEFFS - 1];
+    
+    const uint8_t *src_data[4] = { ctx->scaled_buffer, NULL, NULL, NULL };
+    int src_linesize[4] = { OUTPUT_WIDTH, 0, 0, 0 };
+    uint8_t *dst_data[4] = { thumb, NULL, NULL, NULL };
+    int dst_linesize[4] = { PHASH_SIZE, 0, 0, 0 };
+    sws_scale(ph->sws_ctx, src_data, src_linesize, 0, OUTPUT_HEIGHT, dst_data, dst_linesize);
+    for (int i = 0; i < PHASH_SIZE * PHASH_SIZE; i++) {
+        x[i] = thumb[i];
+    }
+    
+    // Separable 2D DCT: project the columns, transpose, project again
+    kernels.dct_project(ph->basis, x, rows, PHASH_SIZE);
+    for (int k = 0; k < PHASH_COEFFS; k++) {
+        for (int i = 0; i < PHASH_SIZE; i++) {
+            rows_t[i * PHASH_COEFFS + k] = rows[k * PHASH_SIZE + i];
+        }
+    }
+    kernels.dct_project(ph->basis, rows_t, coeffs, PHASH_COEFFS);
+    
+    memcpy(sorted, coeffs + 1, sizeof(sorted));
+    qsort(sorted, PHASH_COEFFS * PHASH_COEFFS - 1, sizeof(float), compare_floats);
+    float median = sorted[(PHASH_COEFFS * PHASH_COEFFS - 1) / 2];
+    uint64_t hash = 0;
+    for (int i = 0; i < PHASH_COEFFS * PHASH_COEFFS; i++) {
+        if (coeffs[i] > median) {
+            hash |= 1ULL << i;
+        }
+    }
+    return hash;
+}
+
+// Hash the picture in scaled_buffer if this frame is due
+int write_phash(ProcessingContext *ctx, int64_t pts) {
+    PhashWriter *ph = &ctx->phash;
+    if (ctx->frame_count % ph->interval != 0) {
+        return 0;
+    }
+    PhashRecord rec = { pts, compute_phash(ctx) };
+    if (fwrite(&rec, sizeof(rec), 1, ph->file) != 1) {
+        fprintf(stderr, "Error writing perceptual hash file\n");
+        return -1;
+    }
+    ph->count++;
+    return 0;
+}
+
+void close_phash_writer(ProcessingContext *ctx) {
+    PhashWriter *ph = &ctx->phash;
+    if (ph->file) {
+        fclose(ph->file);
+        ph->file = NULL;
+    }
+    if (ph->sws_ctx) {
+        sws_freeContext(ph->sws_ctx);
+        ph->sws_ctx = NULL;
+    }
+}
+
+// Stop the decoder thread and free the input
+void close_frame_source(FrameSource *fs) {
+    if (fs->running) {
+        pthread_mutex_lock(&fs->lock);
+        fs->stop = 1;
+        pthread_cond_broadcast(&fs->cond);
+        pthread_mutex_unlock(&fs->lock);
+        pthread_join(fs->thread, NULL);
+        pthread_mutex_destroy(&fs->lock);
+        pthread_cond_destroy(&fs->cond);
+        fs->running = 0;
+    }
+    for (int i = 0; i < SOURCE_QUEUE; i++) {
+        av_frame_free(&fs->queue[i]);
+    }
+    av_frame_free(&fs->current);
+    av_packet_free(&fs->pkt);
+    avcodec_free_context(&fs->decoder);
+    avformat_close_input(&fs->fmt_ctx);
+}
+
+// Stop the right-eye decoder and free the right eye's decoder, encoder and output.
+// Returns -1 if the right-eye output failed
+int close_stereo_input(ProcessingContext *ctx) {
+    StereoInput *si = &ctx->stereo;
+    int result = 0;
+    close_frame_source(&si->right);
+    sws_freeContext(si->half_sws);
+    si->half_sws = NULL;
+    
+    if (si->encoder) {
+        x265_encoder_close(si->encoder);
+        si->encoder = NULL;
+    }
+    if (si->params) {
+        x265_param_free(si->params);
+        si->params = NULL;
+    }
+    if (si->pic) {
+        x265_picture_free(si->pic);
+        si->pic = NULL;
+    }
+    if (si->pic_out) {
+        x265_picture_free(si->pic_out);
+        si->pic_out = NULL;
+    }
+    free(si->buffer);
+    si->buffer = NULL;
+    av_freep(&si->nal_buf);
+    if (si->sink) {
+        result = close_sink(si->sink);
+        si->sink = NULL;
+    }
+    return result;
+}
+
+// Stop the mosaic's decoder threads and free its inputs and scalers
+void close_mosaic(ProcessingContext *ctx) {
+    Mosaic *m = &ctx->mosaic;
+    for (int i = 0; m->sources && i < m->count - 1; i++) {
+        close_frame_source(&m->sources[i]);
+    }
+    free(m->sources);
+    m->sources = NULL;
+    for (int i = 0; i < MOSAIC_MAX; i++) {
+        sws_freeContext(m->sws[i]);
+        m->sws[i] = NULL;
+    }
+    m->count = 0;
+}
+
+// Clean up and free resources
+void cleanup(ProcessingContext *ctx) {
+    // Free encoder resources of whichever backend was opened
+    x265_backend_close(ctx);
+    avcodec_backend_close(ctx);
+    av_freep(&ctx->enc_buf);
+    
+    // Free decoder resources
+    if (ctx->frame) {
+        av_frame_free(&ctx->frame);
+    }
+    if (ctx->pkt) {
+        av_packet_free(&ctx->pkt);
+    }
+    if (ctx->decoder_ctx) {
+        avcodec_free_context(&ctx->decoder_ctx);
+    }
+    close_input(ctx);
+    avcodec_parameters_free(&ctx->input_par);
+    free(ctx->inputs);
+    free(ctx->input_list);
+    
+    // Free scaling context
+    if (ctx->sws_ctx) {
+        sws_freeContext(ctx->sws_ctx);
+    }
+    
+    // Free buffers
+    free(ctx->scaled_buffer);
+    close_proxy_writer(ctx);
+    close_thumbnail_writer(ctx);
+    close_phash_writer(ctx);
+    
+    // Stop serving metrics before the state they describe goes away
+    stop_watchdog();
+    stop_metrics_server();
+    
+    // Close files
+    close_frame_stats(&ctx->frame_stats);
+    close_sinks(ctx);
+    close_stereo_input(ctx);
+    close_mosaic(ctx);
+    close_output(ctx);
+    discard_preopened_output(ctx);
+    av_freep(&ctx->stream_headers);
+    free(ctx->clip_start_pts);
+    free(ctx->keyframe_pts);
+    free(ctx->data_stream_map);
+    free(ctx->data_layout);
+    if (ctx->data_sidecar) {
+        fclose(ctx->data_sidecar);
+    }
+    if (ctx->mux_pkt) {
+        av_packet_free(&ctx->mux_pkt);
+    }
+}
+
+// Whether a decoded frame shows the eye being encoded. Both views of MV-HEVC input are only
+// decoded for the right eye; the other view's frames are dropped here. Side-by-side frames
+// carry no view and always pass
+static int is_selected_view(ProcessingContext *ctx, const AVFrame *frame) {
+#if HAVE_MV_HEVC
+    const AVFrameSideData *sd = av_frame_get_side_data(frame, AV_FRAME_DATA_VIEW_ID);
+    if (!sd || ctx->eye == EYE_LEFT) {
+        return 1;
+    }
+    
+    // Prefer the view position the stream declares, otherwise the view that is not the base;
+    // the base view's picture is output first in every access unit
+    const AVFrameSideData *stereo = av_frame_get_side_data(frame, AV_FRAME_DATA_STEREO3D);
+    if (stereo && ((const AVStereo3D *)stereo->data)->view == AV_STEREO3D_VIEW_RIGHT) {
+        return 1;
+    }
+    if (stereo && ((const AVStereo3D *)stereo->data)->view == AV_STEREO3D_VIEW_LEFT) {
+        return 0;
+    }
+    int view_id = *(const int *)sd->data;
+    if (ctx->base_view_id < 0) {
+        ctx->base_view_id = view_id;
+    }
+    return view_id != ctx->base_view_id;
+#else
+    (void)ctx;
+    (void)frame;
+    return 1;
+#endif
+}
+
+// Process frame using FFmpeg SwScale for crop and scale in one step
+int process_frame_with_swscale(ProcessingContext *ctx, AVFrame *frame) {
+    // Set up source planes for cropping - the selected half of side-by-side frames; a frame
+    // that is a single view (MV-HEVC) is already one eye
+    int x = ctx->eye == EYE_RIGHT && frame->width >= INPUT_WIDTH ? INPUT_WIDTH / 2 : 0;
+    const uint8_t *src_data[4] = {
+        frame->data[0] + x,               // Y plane source
+        frame->data[1] + x / 2,           // U plane source
+        frame->data[2] + x / 2,           // V plane source
+        NULL
+    };
+    
+    // Set up source strides for entire frame
+    int src_linesize[4] = {
+        frame->linesize[0],               // Y plane stride
+        frame->linesize[1],               // U plane stride
+        frame->linesize[2],               // V plane stride
+        0
+    };
+    
+    // Set up destination planes
+    uint8_t *dst_data[4] = {
+        ctx->scaled_buffer,                                             // Y plane destination
+        ctx->scaled_buffer + (OUTPUT_WIDTH * OUTPUT_HEIGHT),            // U plane destination
+        ctx->scaled_buffer + (OUTPUT_WIDTH * OUTPUT_HEIGHT) + 
+            (OUTPUT_WIDTH * OUTPUT_HEIGHT / 4),                         // V plane destination
+        NULL
+    };
+    
+    // Set up destination strides
+    int dst_linesize[4] = {
+        OUTPUT_WIDTH,                     // Y plane stride
+        OUTPUT_WIDTH / 2,                 // U plane stride
+        OUTPUT_WIDTH / 2,                 // V plane stride
+        0
+    };
+    
+    // Perform crop and scale in one step
+    // The crop is achieved by only using one half of the input frame as source
+    // srcSliceY = 0, srcSliceH = INPUT_HEIGHT means process the whole height
+    // A proxy input is already cropped, so its whole frame is the source
+    sws_scale(ctx->sws_ctx, src_data, src_linesize, 0, ctx->from_proxy ? PROXY_HEIGHT : INPUT_HEIGHT,
+              dst_data, dst_linesize);
+    
+    return 0;
+}
+
+// Index of the first video stream, -1 if there is none
+static int find_video_stream(AVFormatContext *fmt_ctx) {
+    for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+        if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Open an input with the demuxing API, or the mapped reader for raw HEVC streams,
+// and return the parameters its decoder needs in *par
+int open_input(ProcessingContext *ctx, const char *input_file, AVCodecParameters **par) {
+    int ret;
+    
+    *par = avcodec_parameters_alloc();
+    if (!*par) {
+        return -1;
+    }
+    
+    // Raw Annex-B input skips probing entirely; the decoder reads parameters from the SPS
+    if (!ctx->no_es_fastpath && is_hevc_es_file(input_file)) {
+        ctx->es_reader = es_reader_open(input_file);
+        if (!ctx->es_reader) {
+            return -1;
+        }
+        ctx->video_stream_idx = 0;
+        (*par)->codec_type = AVMEDIA_TYPE_VIDEO;
+        (*par)->codec_id = AV_CODEC_ID_HEVC;
+        printf("Reading %s as a raw HEVC elementary stream\n", input_file);
+        return 0;
+    }
+    
+    // Open input file using FFmpeg demuxer, with probing bounded for large frames
+    AVDictionary *opts = NULL;
+    av_dict_set_int(&opts, "probesize", PROBE_SIZE, 0);
+    av_dict_set_int(&opts, "analyzeduration", PROBE_ANALYZE_US, 0);
+    ret = avformat_open_input(&ctx->fmt_ctx, input_file, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
         fprintf(stderr, "Could not open input file '%s'\n", input_file);
         return -1;
     }
     
-    // Get stream information
-    ret = avformat_find_stream_info(ctx->fmt_ctx, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Could not find stream information\n");
-        return -1;
+    // Trust containers that declare geometry and parameter sets (MP4, MKV); probe the rest
+    ctx->video_stream_idx = find_video_stream(ctx->fmt_ctx);
+    if (ctx->video_stream_idx < 0 ||
+        ctx->fmt_ctx->streams[ctx->video_stream_idx]->codecpar->width <= 0 ||
+        ctx->fmt_ctx->streams[ctx->video_stream_idx]->codecpar->extradata_size <= 0) {
+        ret = avformat_find_stream_info(ctx->fmt_ctx, NULL);
+        if (ret < 0) {
+            fprintf(stderr, "Could not find stream information\n");
+            return -1;
+        }
+        ctx->video_stream_idx = find_video_stream(ctx->fmt_ctx);
+    }
+    
+    if (ctx->video_stream_idx == -1) {
+        fprintf(stderr, "Could not find video stream\n");
+        return -1;
+    }
+    
+    if (avcodec_parameters_copy(*par, ctx->fmt_ctx->streams[ctx->video_stream_idx]->codecpar) < 0) {
+        fprintf(stderr, "Failed to copy codec parameters\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Whether the decoder opened for one input cannot take packets of the next
+int input_params_changed(const AVCodecParameters *a, const AVCodecParameters *b) {
+    return a->codec_id != b->codec_id || a->width != b->width || a->height != b->height ||
+           a->format != b->format || a->extradata_size != b->extradata_size ||
+           (a->extradata_size > 0 && memcmp(a->extradata, b->extradata, a->extradata_size) != 0);
+}
+
+// Open a decoder for par; the context takes ownership of par
+int open_decoder(ProcessingContext *ctx, AVCodecParameters *par) {
+    int ret;
+    
+    avcodec_parameters_free(&ctx->input_par);
+    ctx->input_par = par;
+    
+    // Find decoder - using const AVCodec* as required by newer FFmpeg
+    const AVCodec *decoder_codec = avcodec_find_decoder(par->codec_id);
+    if (!decoder_codec) {
+        fprintf(stderr, "Failed to find decoder\n");
+        return -1;
+    }
+    
+    // Store in context - need to cast away const for compatibility with older FFmpeg
+    ctx->decoder_codec = (AVCodec *)decoder_codec;
+    
+    // Create decoder context
+    ctx->decoder_ctx = avcodec_alloc_context3(ctx->decoder_codec);
+    if (!ctx->decoder_ctx) {
+        fprintf(stderr, "Failed to allocate decoder context\n");
+        return -1;
+    }
+    
+    // Copy codec parameters to decoder context
+    ret = avcodec_parameters_to_context(ctx->decoder_ctx, par);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to copy codec parameters to decoder context\n");
+        return -1;
+    }
+    
+    // Frame and slice threading as set by the thread profile
+    ctx->decoder_ctx->thread_count = ctx->threads.decoder_threads;
+    if (ctx->threads.decoder_threads != 1) {
+        ctx->decoder_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
+    
+    // MV-HEVC: the left eye is the base view, decoded alone so second layer NALs are skipped
+    // outright; the right eye needs both layers, since the second view predicts from the base.
+    // Single-layer streams ignore the option
+    AVDictionary *opts = NULL;
+#if HAVE_MV_HEVC
+    if (par->codec_id == AV_CODEC_ID_HEVC) {
+        av_dict_set(&opts, "view_ids", ctx->eye == EYE_RIGHT ? "-1" : "0", 0);
+    }
+#endif
+    
+    // Open codec
+    ret = avcodec_open2(ctx->decoder_ctx, ctx->decoder_codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to open codec\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Open the input and its decoder
+int init_decoder(ProcessingContext *ctx, const char *input_file) {
+    AVCodecParameters *par = NULL;
+    
+    if (open_input(ctx, input_file, &par) < 0) {
+        avcodec_parameters_free(&par);
+        return -1;
+    }
+    if (open_decoder(ctx, par) < 0) {
+        return -1;
+    }
+    
+    // Allocate frame and packet
+    ctx->frame = av_frame_alloc();
+    if (!ctx->frame) {
+        fprintf(stderr, "Failed to allocate frame\n");
+        return -1;
+    }
+    
+    ctx->pkt = av_packet_alloc();
+    if (!ctx->pkt) {
+        fprintf(stderr, "Failed to allocate packet\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Init the crop and scale context, which depends only on the fixed geometry
+int init_scaler(ProcessingContext *ctx) {
+    // Initialize SwScale context for cropping and scaling
+    // Using one eye (INPUT_WIDTH/2) as source width, or the whole proxy frame
+    ctx->sws_ctx = sws_getContext(
+        ctx->from_proxy ? PROXY_WIDTH : INPUT_WIDTH/2,   // Source width - half width for one eye
+        ctx->from_proxy ? PROXY_HEIGHT : INPUT_HEIGHT,
+        AV_PIX_FMT_YUV420P,           // Source format
+        OUTPUT_WIDTH, OUTPUT_HEIGHT,  // Destination width/height
+        AV_PIX_FMT_YUV420P,           // Destination format
+        SWS_BICUBIC,                  // High quality algorithm
+        NULL, NULL, NULL              // Default parameters
+    );
+    
+    if (!ctx->sws_ctx) {
+        fprintf(stderr, "Failed to initialize SwScale context\n");
+        return -1;
+    }
+    
+    // Allocate scaled buffer (output size)
+    int scaled_y_size = OUTPUT_WIDTH * OUTPUT_HEIGHT;
+    int scaled_uv_size = scaled_y_size / 4;
+    ctx->scaled_buffer = (uint8_t*)malloc(scaled_y_size + 2 * scaled_uv_size);
+    if (!ctx->scaled_buffer) {
+        fprintf(stderr, "Failed to allocate scaled buffer\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Encoder and scaler setup run on a helper thread while the input is opened and probed
+typedef struct {
+    ProcessingContext *ctx;
+    int ret;
+} EncoderInitJob;
+
+static void *encoder_init_thread(void *opaque) {
+    EncoderInitJob *job = opaque;
+    job->ret = init_encoder_backend(job->ctx) < 0 || init_scaler(job->ctx) < 0 ? -1 : 0;
+    return NULL;
+}
+
+// Open decoder, encoder and scaler, overlapping encoder startup with input probing
+int init_pipeline(ProcessingContext *ctx, const char *input_file) {
+    EncoderInitJob job = { ctx, -1 };
+    pthread_t thread;
+    
+    // The two sides touch disjoint context fields; fall back to serial if no thread
+    int threaded = pthread_create(&thread, NULL, encoder_init_thread, &job) == 0;
+    if (!threaded) {
+        encoder_init_thread(&job);
+    }
+    
+    int64_t start = av_gettime_relative();
+    int ret = init_decoder(ctx, input_file);
+    ctx->probe_us = av_gettime_relative() - start;
+    
+    if (threaded) {
+        pthread_join(thread, NULL);
+    }
+    return ret < 0 || job.ret < 0 ? -1 : 0;
+}
+
+// Time of a decoded frame in microseconds since the first frame of its input. Raw streams
+// without timestamps are taken to run at the nominal frame rate
+static int64_t frame_time_us(const AVFrame *frame, AVRational time_base, int64_t *start, int64_t index) {
+    if (frame->best_effort_timestamp == AV_NOPTS_VALUE) {
+        return index * AV_TIME_BASE / FRAME_RATE;
+    }
+    int64_t t = av_rescale_q(frame->best_effort_timestamp, time_base, AV_TIME_BASE_Q);
+    if (*start == AV_NOPTS_VALUE) {
+        *start = t;
+    }
+    return t - *start;
+}
+
+static void *frame_source_thread(void *opaque) {
+    FrameSource *fs = opaque;
+    AVRational time_base = fs->fmt_ctx->streams[fs->stream_idx]->time_base;
+    AVFrame *frame = av_frame_alloc();
+    int done = !frame;
+    int read_error = 0;
+    
+    while (!done) {
+        int ret = av_read_frame(fs->fmt_ctx, fs->pkt);
+        int input_eof = ret < 0;
+        if (input_eof && ret != AVERROR_EOF) {
+            fprintf(stderr, "Error reading %s: %d\n", fs->path, ret);
+            read_error = 1;
+        }
+        if (input_eof) {
+            // Drain the frames still held for reordering
+            avcodec_send_packet(fs->decoder, NULL);
+        } else if (fs->pkt->stream_index == fs->stream_idx && avcodec_send_packet(fs->decoder, fs->pkt) < 0) {
+            fprintf(stderr, "Error sending packet of %s for decoding\n", fs->path);
+        }
+        av_packet_unref(fs->pkt);
+        done = input_eof;
+        
+        while (avcodec_receive_frame(fs->decoder, frame) >= 0) {
+            int64_t t = frame_time_us(frame, time_base, &fs->start, fs->frames++);
+            
+            // Wait while the main input is a full queue behind
+            pthread_mutex_lock(&fs->lock);
+            while (fs->queue_count == SOURCE_QUEUE && !fs->stop) {
+                pthread_cond_wait(&fs->cond, &fs->lock);
+            }
+            if (fs->stop) {
+                done = 1;
+            } else {
+                int slot = (fs->queue_head + fs->queue_count) % SOURCE_QUEUE;
+                av_frame_move_ref(fs->queue[slot], frame);
+                fs->queue_time[slot] = t;
+                fs->queue_count++;
+                pthread_cond_broadcast(&fs->cond);
+            }
+            pthread_mutex_unlock(&fs->lock);
+            av_frame_unref(frame);
+            if (done) {
+                break;
+            }
+        }
+    }
+    av_frame_free(&frame);
+    
+    pthread_mutex_lock(&fs->lock);
+    fs->eof = 1;
+    fs->error = read_error;
+    pthread_cond_broadcast(&fs->cond);
+    pthread_mutex_unlock(&fs->lock);
+    return NULL;
+}
+
+// Open an input and its decoder, and start decoding it on its own thread
+int open_frame_source(ProcessingContext *ctx, FrameSource *fs, const char *path) {
+    fs->path = path;
+    fs->start = AV_NOPTS_VALUE;
+    
+    AVDictionary *opts = NULL;
+    av_dict_set_int(&opts, "probesize", PROBE_SIZE, 0);
+    av_dict_set_int(&opts, "analyzeduration", PROBE_ANALYZE_US, 0);
+    int ret = avformat_open_input(&fs->fmt_ctx, path, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret < 0 || avformat_find_stream_info(fs->fmt_ctx, NULL) < 0 ||
+        (fs->stream_idx = find_video_stream(fs->fmt_ctx)) < 0) {
+        fprintf(stderr, "Could not open input '%s'\n", path);
+        return -1;
+    }
+    
+    AVCodecParameters *par = fs->fmt_ctx->streams[fs->stream_idx]->codecpar;
+    const AVCodec *codec = avcodec_find_decoder(par->codec_id);
+    fs->decoder = codec ? avcodec_alloc_context3(codec) : NULL;
+    if (!fs->decoder || avcodec_parameters_to_context(fs->decoder, par) < 0) {
+        fprintf(stderr, "Failed to set up the decoder for %s\n", path);
+        return -1;
+    }
+    fs->decoder->thread_count = ctx->threads.decoder_threads;
+    if (ctx->threads.decoder_threads != 1) {
+        fs->decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
+    if (avcodec_open2(fs->decoder, codec, NULL) < 0) {
+        fprintf(stderr, "Failed to open the decoder for %s\n", path);
+        return -1;
+    }
+    
+    fs->pkt = av_packet_alloc();
+    fs->current = av_frame_alloc();
+    if (!fs->pkt || !fs->current) {
+        return -1;
+    }
+    for (int i = 0; i < SOURCE_QUEUE; i++) {
+        if (!(fs->queue[i] = av_frame_alloc())) {
+            return -1;
+        }
+    }
+    
+    pthread_mutex_init(&fs->lock, NULL);
+    pthread_cond_init(&fs->cond, NULL);
+    if (pthread_create(&fs->thread, NULL, frame_source_thread, fs) != 0) {
+        pthread_mutex_destroy(&fs->lock);
+        pthread_cond_destroy(&fs->cond);
+        fprintf(stderr, "Failed to start the decoder thread for %s\n", path);
+        return -1;
+    }
+    fs->running = 1;
+    return 0;
+}
+
+// Make fs->current the picture at time t of the main input. Frames that fall between two main
+// input frames are dropped, and a main input frame with no frame within half a frame period
+// keeps the previous picture, so a gap on either side never shifts the inputs apart
+static int match_frame_source(FrameSource *fs, int64_t t) {
+    int64_t tolerance = AV_TIME_BASE / FRAME_RATE / 2;
+    int matched = 0;
+    
+    pthread_mutex_lock(&fs->lock);
+    while (1) {
+        while (fs->queue_count == 0 && !fs->eof) {
+            pthread_cond_wait(&fs->cond, &fs->lock);
+        }
+        if (fs->queue_count == 0) {
+            break;
+        }
+        int64_t time = fs->queue_time[fs->queue_head];
+        if (time > t + tolerance && fs->have_current) {
+            break;
+        }
+        av_frame_unref(fs->current);
+        av_frame_move_ref(fs->current, fs->queue[fs->queue_head]);
+        fs->have_current = 1;
+        fs->queue_head = (fs->queue_head + 1) % SOURCE_QUEUE;
+        fs->queue_count--;
+        pthread_cond_broadcast(&fs->cond);
+        if (time >= t - tolerance) {
+            matched = time <= t + tolerance;
+            break;
+        }
+        fs->dropped++;
+    }
+    // Past a read error the last picture would stand in for the rest of the input
+    int failed = fs->error && fs->queue_count == 0 && !matched;
+    pthread_mutex_unlock(&fs->lock);
+    
+    if (failed) {
+        fprintf(stderr, "Input %s failed before the main input ended\n", fs->path);
+        return -1;
+    }
+    if (!fs->have_current) {
+        fprintf(stderr, "Input %s has no frames\n", fs->path);
+        return -1;
+    }
+    if (matched) {
+        fs->paired++;
+    } else {
+        fs->repeated++;
+    }
+    return 0;
+}
+
+// Pack x265 NAL units into one packet for the right eye's sink
+static int queue_right_eye_nals(StereoInput *si, x265_nal *nals, uint32_t nal_count) {
+    EncodedPacket pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    for (uint32_t i = 0; i < nal_count; i++) {
+        pkt.size += nals[i].sizeBytes;
+    }
+    if (pkt.size > si->nal_buf_size) {
+        av_freep(&si->nal_buf);
+        si->nal_buf = av_malloc(pkt.size);
+        if (!si->nal_buf) {
+            si->nal_buf_size = 0;
+            return -1;
+        }
+        si->nal_buf_size = pkt.size;
+    }
+    
+    int offset = 0;
+    for (uint32_t i = 0; i < nal_count; i++) {
+        memcpy(si->nal_buf + offset, nals[i].payload, nals[i].sizeBytes);
+        offset += nals[i].sizeBytes;
+        pkt.keyframe |= nals[i].type >= 16 && nals[i].type <= 23;
+        pkt.recovery |= x265_nal_is_recovery_point(&nals[i]);
+    }
+    pkt.recovery &= !pkt.keyframe;
+    pkt.data = si->nal_buf;
+    pkt.pts = si->pic_out->pts;
+    pkt.dts = si->pic_out->dts;
+    return queue_sink_packet(si->sink, &pkt);
+}
+
+// Open the right eye's second x265 session and its output, which gets the same containers
+// as --also
+static int open_right_eye_encoder(ProcessingContext *ctx, const char *output) {
+    StereoInput *si = &ctx->stereo;
+    x265_nal *nals = NULL;
+    uint32_t nal_count = 0;
+    
+    si->params = x265_param_alloc();
+    if (!si->params) {
+        return -1;
+    }
+    if (set_x265_output_params(ctx, si->params) < 0 || apply_cpu_level_to_x265(si->params) < 0) {
+        return -1;
+    }
+    si->encoder = x265_encoder_open(si->params);
+    if (!si->encoder) {
+        fprintf(stderr, "Failed to open the right-eye encoder\n");
+        return -1;
+    }
+    si->pic = x265_picture_alloc();
+    si->pic_out = x265_picture_alloc();
+    si->buffer = malloc(OUTPUT_WIDTH * OUTPUT_HEIGHT * 3 / 2);
+    if (!si->pic || !si->pic_out || !si->buffer) {
+        return -1;
+    }
+    x265_picture_init(si->params, si->pic);
+    x265_picture_init(si->params, si->pic_out);
+    
+    if (x265_encoder_headers(si->encoder, &nals, &nal_count) < 0) {
+        fprintf(stderr, "Error getting right-eye encoder headers\n");
+        return -1;
+    }
+    uint8_t *headers = NULL;
+    int headers_size = 0;
+    for (uint32_t i = 0; i < nal_count; i++) {
+        headers_size += nals[i].sizeBytes;
+    }
+    headers = malloc(headers_size + 1);
+    if (!headers) {
+        return -1;
+    }
+    for (uint32_t i = 0, offset = 0; i < nal_count; offset += nals[i].sizeBytes, i++) {
+        memcpy(headers + offset, nals[i].payload, nals[i].sizeBytes);
+    }
+    si->sink = open_sink(ctx, output, SINK_POLICY_BLOCK, headers, headers_size);
+    free(headers);
+    return si->sink ? 0 : -1;
+}
+
+// Open the right eye's input and decoder and start decoding it. Side by side, both eyes are
+// scaled into halves of the output picture; per eye, the right eye is encoded to 'output'
+int open_stereo_input(ProcessingContext *ctx, const char *path, const char *output) {
+    StereoInput *si = &ctx->stereo;
+    si->layout = output ? STEREO_PER_EYE : STEREO_SIDE_BY_SIDE;
+    si->left_start = AV_NOPTS_VALUE;
+    
+    if (si->layout == STEREO_SIDE_BY_SIDE) {
+        si->half_sws = sws_getContext(INPUT_WIDTH/2, INPUT_HEIGHT, AV_PIX_FMT_YUV420P,
+                                      OUTPUT_WIDTH/2, OUTPUT_HEIGHT, AV_PIX_FMT_YUV420P,
+                                      SWS_BICUBIC, NULL, NULL, NULL);
+        if (!si->half_sws) {
+            fprintf(stderr, "Failed to initialize the side-by-side scaler\n");
+            return -1;
+        }
+    } else if (open_right_eye_encoder(ctx, output) < 0) {
+        return -1;
+    }
+    if (open_frame_source(ctx, &si->right, path) < 0) {
+        return -1;
+    }
+    
+    if (si->layout == STEREO_SIDE_BY_SIDE) {
+        printf("Right eye from %s, packed side by side with the left eye\n", path);
+    } else {
+        printf("Right eye from %s, encoded to %s\n", path, output);
+    }
+    return 0;
+}
+
+// Timebase of the main input's frames; the raw stream reader has none
+static AVRational main_input_time_base(ProcessingContext *ctx) {
+    return ctx->fmt_ctx ? ctx->fmt_ctx->streams[ctx->video_stream_idx]->time_base : (AVRational){1, FRAME_RATE};
+}
+
+// Pair a left-eye frame with the right-eye picture at the same time
+static int match_right_frame(ProcessingContext *ctx, const AVFrame *left) {
+    StereoInput *si = &ctx->stereo;
+    int64_t t = frame_time_us(left, main_input_time_base(ctx), &si->left_start, ctx->input_frame_count);
+    if (match_frame_source(&si->right, t) < 0) {
+        return -1;
+    }
+    const AVFrame *right = si->right.current;
+    if (right->width != left->width || right->height != left->height) {
+        fprintf(stderr, "The eyes differ in size: %dx%d left, %dx%d right\n",
+                left->width, left->height, right->width, right->height);
+        return -1;
+    }
+    return 0;
+}
+
+// Lay out count inputs, paths[0] being the main input, in a near-square grid of tiles and start
+// decoding all but the main one
+int open_mosaic(ProcessingContext *ctx, const char *const *paths, int count) {
+    Mosaic *m = &ctx->mosaic;
+    m->sources = calloc(count - 1, sizeof(*m->sources));
+    if (!m->sources) {
+        return -1;
+    }
+    m->count = count;
+    m->main_start = AV_NOPTS_VALUE;
+    m->columns = (int)ceil(sqrt(count));
+    int rows = (count + m->columns - 1) / m->columns;
+    m->tile_width = OUTPUT_WIDTH / m->columns & ~1;
+    m->tile_height = OUTPUT_HEIGHT / rows & ~1;
+    for (int i = 1; i < count; i++) {
+        if (open_frame_source(ctx, &m->sources[i - 1], paths[i]) < 0) {
+            return -1;
+        }
+    }
+    
+    // Tiles are scaled in place every frame; the margins and empty tiles stay black
+    memset(ctx->scaled_buffer, 16, OUTPUT_WIDTH * OUTPUT_HEIGHT);
+    memset(ctx->scaled_buffer + OUTPUT_WIDTH * OUTPUT_HEIGHT, 128, OUTPUT_WIDTH * OUTPUT_HEIGHT / 2);
+    printf("Mosaic of %d inputs in a %dx%d grid of %dx%d tiles\n", count, m->columns, rows,
+           m->tile_width, m->tile_height);
+    return 0;
+}
+
+// Bring every other input of the mosaic to the time of the main input's frame
+static int match_mosaic(ProcessingContext *ctx, const AVFrame *frame) {
+    Mosaic *m = &ctx->mosaic;
+    int64_t t = frame_time_us(frame, main_input_time_base(ctx), &m->main_start, ctx->input_frame_count);
+    for (int i = 0; i < m->count - 1; i++) {
+        if (match_frame_source(&m->sources[i], t) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Scale each input's current picture straight into its tile. Inputs contribute their left eye:
+// the left half of side-by-side frames, or the whole frame of single-eye inputs
+static int compose_mosaic(ProcessingContext *ctx, const AVFrame *main_frame) {
+    Mosaic *m = &ctx->mosaic;
+    int dst_linesize[4] = { OUTPUT_WIDTH, OUTPUT_WIDTH / 2, OUTPUT_WIDTH / 2, 0 };
+    
+    for (int i = 0; i < m->count; i++) {
+        const AVFrame *frame = i == 0 ? main_frame : m->sources[i - 1].current;
+        int eye_width = frame->width >= INPUT_WIDTH ? frame->width / 2 : frame->width;
+        m->sws[i] = sws_getCachedContext(m->sws[i], eye_width, frame->height, (enum AVPixelFormat)frame->format,
+                                         m->tile_width, m->tile_height, AV_PIX_FMT_YUV420P,
+                                         SWS_BICUBIC, NULL, NULL, NULL);
+        if (!m->sws[i]) {
+            fprintf(stderr, "Failed to initialize the scaler for mosaic tile %d\n", i);
+            return -1;
+        }
+        
+        int x = i % m->columns * m->tile_width;
+        int y = i / m->columns * m->tile_height;
+        uint8_t *dst_data[4] = {
+            ctx->scaled_buffer + y * OUTPUT_WIDTH + x,
+            ctx->scaled_buffer + OUTPUT_WIDTH * OUTPUT_HEIGHT + y / 2 * (OUTPUT_WIDTH / 2) + x / 2,
+            ctx->scaled_buffer + OUTPUT_WIDTH * OUTPUT_HEIGHT * 5 / 4 + y / 2 * (OUTPUT_WIDTH / 2) + x / 2,
+            NULL
+        };
+        sws_scale(m->sws[i], (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height,
+                  dst_data, dst_linesize);
+    }
+    return 0;
+}
+
+// Scale both eyes into the halves of the output picture
+static void compose_side_by_side(ProcessingContext *ctx, const AVFrame *left) {
+    const AVFrame *eyes[2] = { left, ctx->stereo.right.current };
+    int dst_linesize[4] = { OUTPUT_WIDTH, OUTPUT_WIDTH / 2, OUTPUT_WIDTH / 2, 0 };
+    
+    for (int e = 0; e < 2; e++) {
+        uint8_t *dst_data[4] = {
+            ctx->scaled_buffer + e * OUTPUT_WIDTH / 2,
+            ctx->scaled_buffer + OUTPUT_WIDTH * OUTPUT_HEIGHT + e * OUTPUT_WIDTH / 4,
+            ctx->scaled_buffer + OUTPUT_WIDTH * OUTPUT_HEIGHT * 5 / 4 + e * OUTPUT_WIDTH / 4,
+            NULL
+        };
+        sws_scale(ctx->stereo.half_sws, (const uint8_t * const *)eyes[e]->data, eyes[e]->linesize,
+                  0, INPUT_HEIGHT, dst_data, dst_linesize);
+    }
+}
+
+// Scale and encode the current right-eye picture at the output time of the left eye's frame
+static int encode_right_eye(ProcessingContext *ctx, int64_t pts, int force_idr) {
+    StereoInput *si = &ctx->stereo;
+    x265_nal *nals = NULL;
+    uint32_t nal_count = 0;
+    
+    // Same geometry as the left eye, so the main scaler applies
+    uint8_t *dst_data[4] = {
+        si->buffer,
+        si->buffer + OUTPUT_WIDTH * OUTPUT_HEIGHT,
+        si->buffer + OUTPUT_WIDTH * OUTPUT_HEIGHT * 5 / 4,
+        NULL
+    };
+    int dst_linesize[4] = { OUTPUT_WIDTH, OUTPUT_WIDTH / 2, OUTPUT_WIDTH / 2, 0 };
+    sws_scale(ctx->sws_ctx, (const uint8_t * const *)si->right.current->data, si->right.current->linesize, 0, INPUT_HEIGHT,
+              dst_data, dst_linesize);
+    
+    for (int i = 0; i < 3; i++) {
+        si->pic->planes[i] = dst_data[i];
+        si->pic->stride[i] = dst_linesize[i];
+    }
+    si->pic->pts = pts;
+    si->pic->bitDepth = 8;
+    si->pic->colorSpace = X265_CSP_I420;
+    si->pic->sliceType = force_idr ? X265_TYPE_IDR : X265_TYPE_AUTO;
+    
+    int ret = x265_encoder_encode(si->encoder, &nals, &nal_count, si->pic, si->pic_out);
+    if (ret < 0) {
+        fprintf(stderr, "Error encoding right-eye frame: %d\n", ret);
+        return -1;
+    }
+    return ret > 0 ? queue_right_eye_nals(si, nals, nal_count) : 0;
+}
+
+// Drain the right-eye encoder into its output
+int finish_right_eye(ProcessingContext *ctx) {
+    StereoInput *si = &ctx->stereo;
+    x265_nal *nals = NULL;
+    uint32_t nal_count = 0;
+    int ret;
+    
+    while ((ret = x265_encoder_encode(si->encoder, &nals, &nal_count, NULL, si->pic_out)) > 0) {
+        if (queue_right_eye_nals(si, nals, nal_count) < 0) {
+            return -1;
+        }
+    }
+    return ret;
+}
+
+// CPU model string of this host, with tabs and commas replaced so it fits the cache files
+void read_cpu_model(char *model, size_t model_size) {
+    char line[256];
+    snprintf(model, model_size, "unknown");
+    
+    // x86 exposes "model name", ARM only exposes "CPU part"
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "model name", 10) == 0 || strncmp(line, "CPU part", 8) == 0) {
+                char *value = strchr(line, ':');
+                if (value) {
+                    value += strspn(value, ": \t");
+                    value[strcspn(value, "\r\n")] = '\0';
+                    snprintf(model, model_size, "%s", value);
+                }
+                break;
+            }
+        }
+        fclose(f);
+    }
+    
+    for (char *c = model; *c; c++) {
+        if (*c == '\t' || *c == ',') {
+            *c = ' ';
+        }
+    }
+}
+
+// Build the cache key for this host, geometry, kernel level and frame skipping; the last two
+// shift the balance between decoder and encoder threads
+void build_tune_key(char *key, size_t key_size, int skip_frames) {
+    char model[128];
+    read_cpu_model(model, sizeof(model));
+    snprintf(key, key_size, "%s|%ld cores|%dx%d>%dx%d|%s|%s", model, sysconf(_SC_NPROCESSORS_ONLN),
+             INPUT_WIDTH, INPUT_HEIGHT, OUTPUT_WIDTH, OUTPUT_HEIGHT, cpu_level_name(cpu_dispatch.active),
+             skip_frames ? "skip" : "all");
+}
+
+// Path of a per-host cache file, creating its directory when asked; env_override replaces the whole path
+int cache_file_path(char *path, size_t path_size, const char *env_override, const char *file_name, int create_dir) {
+    const char *override = getenv(env_override);
+    if (override) {
+        snprintf(path, path_size, "%s", override);
+        return 0;
+    }
+    
+    char dir[PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg) {
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    } else if (home && *home) {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return -1;
+    }
+    
+    if (create_dir) {
+        mkdir(dir, 0755);
+    }
+    snprintf(path, path_size, "%s/%s", dir, file_name);
+    return 0;
+}
+
+// Identity of a source for the proxy cache: FNV-1a over the proxy geometry, the file size and its
+// first and last PROXY_HASH_BYTES, cheap on multi-gigabyte files yet changed by any re-encode or edit
+static int source_hash(const char *path, uint64_t *hash) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    uint8_t *buf = malloc(PROXY_HASH_BYTES);
+    if (!buf) {
+        close(fd);
+        return -1;
+    }
+    int64_t header[4] = { PROXY_WIDTH, PROXY_HEIGHT, INPUT_WIDTH, (int64_t)st.st_size };
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < sizeof(header); i++) {
+        h = (h ^ ((const uint8_t *)header)[i]) * 0x100000001b3ULL;
+    }
+    off_t offsets[2] = { 0, st.st_size > PROXY_HASH_BYTES ? st.st_size - PROXY_HASH_BYTES : 0 };
+    for (int part = 0; part < 2; part++) {
+        ssize_t n = pread(fd, buf, PROXY_HASH_BYTES, offsets[part]);
+        for (ssize_t i = 0; i < n; i++) {
+            h = (h ^ buf[i]) * 0x100000001b3ULL;
+        }
+    }
+    free(buf);
+    close(fd);
+    *hash = h;
+    return 0;
+}
+
+// Cache path of the proxy for a source: proxy_<hash>.hevc in the cache directory
+// (or in HEVC_PROCESSOR_PROXY_DIR when set)
+int proxy_cache_path(const char *input_file, char *path, size_t path_size, int create_dir) {
+    uint64_t hash;
+    char name[64];
+    
+    if (source_hash(input_file, &hash) < 0) {
+        return -1;
+    }
+    snprintf(name, sizeof(name), "proxy_%016llx.hevc", (unsigned long long)hash);
+    const char *dir = getenv("HEVC_PROCESSOR_PROXY_DIR");
+    if (dir) {
+        snprintf(path, path_size, "%s/%s", dir, name);
+        return 0;
+    }
+    return cache_file_path(path, path_size, "HEVC_PROCESSOR_PROXY_DIR", name, create_dir);
+}
+
+// Load the cached thread profile for this host, returns 0 if one was found
+int load_thread_profile(ThreadProfile *profile, int skip_frames) {
+    char path[PATH_MAX];
+    char key[256];
+    char line[512];
+    
+    if (cache_file_path(path, sizeof(path), "HEVC_PROCESSOR_TUNE_CACHE", AUTOTUNE_CACHE_FILE, 0) < 0) {
+        return -1;
+    }
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    
+    build_tune_key(key, sizeof(key), skip_frames);
+    size_t key_len = strlen(key);
+    int found = -1;
+    
+    // Each line: key <tab> decoder threads <tab> frame threads <tab> pool threads <tab> fps
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == '\t') {
+            ThreadProfile p;
+            if (sscanf(line + key_len + 1, "%d\t%d\t%d", &p.decoder_threads,
+                       &p.frame_threads, &p.pool_threads) == 3 &&
+                p.decoder_threads >= 0 && p.frame_threads > 0 && p.pool_threads >= 0) {
+                *profile = p;
+                found = 0;
+            }
+        }
+    }
+    
+    fclose(f);
+    return found;
+}
+
+// Store the winning profile, replacing any earlier entry for this host
+int save_thread_profile(const ThreadProfile *profile, double fps, int skip_frames) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 8];
+    char key[256];
+    char line[512];
+    
+    if (cache_file_path(path, sizeof(path), "HEVC_PROCESSOR_TUNE_CACHE", AUTOTUNE_CACHE_FILE, 1) < 0) {
+        fprintf(stderr, "No cache directory for the autotune profile\n");
+        return -1;
+    }
+    build_tune_key(key, sizeof(key), skip_frames);
+    size_t key_len = strlen(key);
+    
+    // Rewrite through a temporary file so concurrent runs never see a partial cache
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        fprintf(stderr, "Could not write autotune cache '%s'\n", tmp_path);
+        return -1;
+    }
+    
+    FILE *in = fopen(path, "r");
+    if (in) {
+        while (fgets(line, sizeof(line), in)) {
+            if (!(strncmp(line, key, key_len) == 0 && line[key_len] == '\t')) {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+    
+    fprintf(out, "%s\t%d\t%d\t%d\t%.2f\n", key, profile->decoder_threads,
+            profile->frame_threads, profile->pool_threads, fps);
+    fclose(out);
+    
+    if (rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Could not replace autotune cache '%s'\n", path);
+        remove(tmp_path);
+        return -1;
+    }
+    
+    printf("Saved tuned profile to %s\n", path);
+    return 0;
+}
+
+// Scale and encode the frames the decoder has ready, skipping every other one in skip mode
+static void calibrate_decoded_frames(ProcessingContext *ctx, int max_frames, int *frames, int64_t *start) {
+    x265_nal *nals = NULL;
+    uint32_t nal_count = 0;
+    
+    while (*frames < max_frames && avcodec_receive_frame(ctx->decoder_ctx, ctx->frame) >= 0) {
+        if (!is_selected_view(ctx, ctx->frame) || (ctx->skip_frames && ctx->input_frame_count++ % 2 == 1)) {
+            av_frame_unref(ctx->frame);
+            continue;
+        }
+        process_frame_with_swscale(ctx, ctx->frame);
+        prepare_for_encoding(ctx, *frames);
+        x265_encoder_encode(ctx->encoder, &nals, &nal_count, ctx->enc_pic, NULL);
+        av_frame_unref(ctx->frame);
+        
+        // Start the clock once thread pools and lookahead have ramped up
+        if (++*frames == AUTOTUNE_WARMUP_FRAMES) {
+            *start = av_gettime_relative();
+        }
+    }
+}
+
+// Decode, scale and encode up to max_frames without writing output, returns measured fps
+double run_calibration(ProcessingContext *ctx, int max_frames) {
+    x265_nal *nals = NULL;
+    uint32_t nal_count = 0;
+    int frames = 0;
+    int64_t start = 0;
+    
+    while (frames < max_frames && read_input_packet(ctx) >= 0) {
+        if (ctx->pkt->stream_index == ctx->video_stream_idx &&
+            avcodec_send_packet(ctx->decoder_ctx, ctx->pkt) >= 0) {
+            calibrate_decoded_frames(ctx, max_frames, &frames, &start);
+        }
+        av_packet_unref(ctx->pkt);
+    }
+    
+    // Short inputs: the decoder still holds its delayed frames
+    if (frames < max_frames && avcodec_send_packet(ctx->decoder_ctx, NULL) >= 0) {
+        calibrate_decoded_frames(ctx, max_frames, &frames, &start);
+    }
+    
+    // Drain the encoder so queued frames are part of the measurement
+    while (x265_encoder_encode(ctx->encoder, &nals, &nal_count, NULL, NULL) > 0) {
+    }
+    
+    if (frames <= AUTOTUNE_WARMUP_FRAMES) {
+        return 0.0;
+    }
+    double elapsed = (av_gettime_relative() - start) / 1000000.0;
+    return elapsed > 0 ? (frames - AUTOTUNE_WARMUP_FRAMES) / elapsed : 0.0;
+}
+
+// Benchmark a handful of thread splits on the sample input and cache the fastest
+int run_autotune(const char *input_file, int skip_frames, int no_es_fastpath) {
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+        cores = 1;
+    }
+    int half = cores / 2 > 0 ? cores / 2 : 1;
+    int quarter = cores / 4 > 0 ? cores / 4 : 1;
+    
+    // Candidates trade decoder threads against x265 frame parallelism and pool size
+    ThreadProfile candidates[] = {
+        default_thread_profile,
+        { quarter, 4, cores },
+        { half, 2, cores },
+        { half, 4, cores },
+        { half, 4, half },
+        { cores, 3, cores },
+        { 0, 4, 0 },
+    };
+    int num_candidates = sizeof(candidates) / sizeof(candidates[0]);
+    
+    ThreadProfile best = default_thread_profile;
+    double best_fps = 0.0;
+    
+    printf("Autotune: %d cores, %d configurations, %d frames each\n",
+           cores, num_candidates, AUTOTUNE_FRAMES);
+    
+    // An untimed pass with the default profile first, so the first candidate does not pay for a
+    // cold page cache
+    for (int i = -1; i < num_candidates; i++) {
+        ProcessingContext ctx = {0};
+        ctx.threads = i < 0 ? default_thread_profile : candidates[i];
+        ctx.skip_frames = skip_frames;
+        ctx.no_es_fastpath = no_es_fastpath;
+        
+        if (init_decoder(&ctx, input_file) < 0 || init_scaler(&ctx) < 0 || init_encoder(&ctx) < 0) {
+            if (i >= 0) {
+                fprintf(stderr, "Autotune: configuration %d failed to initialize\n", i);
+            }
+            cleanup(&ctx);
+            continue;
+        }
+        
+        double fps = run_calibration(&ctx, AUTOTUNE_FRAMES);
+        cleanup(&ctx);
+        if (i < 0) {
+            continue;
+        }
+        
+        printf("Autotune: decoder threads %d, frame threads %d, pool %d -> %.2f fps\n",
+               candidates[i].decoder_threads, candidates[i].frame_threads,
+               candidates[i].pool_threads, fps);
+        
+        if (fps > best_fps) {
+            best_fps = fps;
+            best = candidates[i];
+        }
+    }
+    
+    if (best_fps <= 0.0) {
+        fprintf(stderr, "Autotune: input too short, need more than %d frames\n", AUTOTUNE_WARMUP_FRAMES);
+        return -1;
+    }
+    
+    printf("Autotune: best is decoder threads %d, frame threads %d, pool %d (%.2f fps)\n",
+           best.decoder_threads, best.frame_threads, best.pool_threads, best_fps);
+    return save_thread_profile(&best, best_fps, skip_frames);
+}
+
+// Bit reader over an unescaped RBSP prefix
+typedef struct {
+    uint8_t buf[SCAN_RBSP_SIZE];
+    int size;
+    int bit;
+} RbspReader;
+
+// Copy the start of a NAL payload with emulation prevention bytes removed
+static void rbsp_init(RbspReader *br, const uint8_t *nal, const uint8_t *end) {
+    int zeros = 0;
+    br->size = 0;
+    br->bit = 0;
+    for (const uint8_t *p = nal; p < end && br->size < SCAN_RBSP_SIZE; p++) {
+        if (zeros >= 2 && *p == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = *p ? 0 : zeros + 1;
+        br->buf[br->size++] = *p;
+    }
+}
+
+static uint32_t rbsp_bits(RbspReader *br, int n) {
+    uint32_t v = 0;
+    while (n-- > 0) {
+        int byte = br->bit >> 3;
+        int b = byte < br->size ? (br->buf[byte] >> (7 - (br->bit & 7))) & 1 : 0;
+        v = (v << 1) | b;
+        br->bit++;
+    }
+    return v;
+}
+
+static uint32_t rbsp_ue(RbspReader *br) {
+    int leading = 0;
+    while (leading < 32 && br->bit < br->size * 8 && !rbsp_bits(br, 1)) {
+        leading++;
+    }
+    return ((1u << leading) - 1) + rbsp_bits(br, leading);
+}
+
+// Pull the coded picture size out of an SPS
+static void scan_parse_sps(ScanState *st, RbspReader *br) {
+    rbsp_bits(br, 16);                         // NAL header
+    rbsp_bits(br, 4);                          // sps_video_parameter_set_id
+    int max_sub_layers_minus1 = rbsp_bits(br, 3);
+    rbsp_bits(br, 1);                          // sps_temporal_id_nesting_flag
+    
+    // profile_tier_level: 88 bits of general profile, 8 bits of level, then optional sub-layers
+    rbsp_bits(br, 32);
+    rbsp_bits(br, 32);
+    rbsp_bits(br, 24);
+    rbsp_bits(br, 8);
+    int sub_profile[8] = {0}, sub_level[8] = {0};
+    for (int i = 0; i < max_sub_layers_minus1; i++) {
+        sub_profile[i] = rbsp_bits(br, 1);
+        sub_level[i] = rbsp_bits(br, 1);
+    }
+    if (max_sub_layers_minus1 > 0) {
+        rbsp_bits(br, 2 * (8 - max_sub_layers_minus1));
+    }
+    for (int i = 0; i < max_sub_layers_minus1; i++) {
+        if (sub_profile[i]) {
+            rbsp_bits(br, 32);
+            rbsp_bits(br, 32);
+            rbsp_bits(br, 24);
+        }
+        if (sub_level[i]) {
+            rbsp_bits(br, 8);
+        }
+    }
+    
+    rbsp_ue(br);                               // sps_seq_parameter_set_id
+    if (rbsp_ue(br) == 3) {                    // chroma_format_idc
+        rbsp_bits(br, 1);                      // separate_colour_plane_flag
+    }
+    st->width = rbsp_ue(br);
+    st->height = rbsp_ue(br);
+}
+
+// Remember how many extra slice header bits each PPS declares
+static void scan_parse_pps(ScanState *st, RbspReader *br) {
+    rbsp_bits(br, 16);
+    uint32_t pps_id = rbsp_ue(br);
+    rbsp_ue(br);                               // pps_seq_parameter_set_id
+    rbsp_bits(br, 2);                          // dependent_slice_segments_enabled, output_flag_present
+    if (pps_id < SCAN_MAX_PPS) {
+        st->pps_extra_bits[pps_id] = rbsp_bits(br, 3);
+    }
+}
+
+// Read slice_type (0 = B, 1 = P, 2 = I) from the first slice segment of a picture
+static int scan_parse_slice_type(ScanState *st, RbspReader *br, int nal_type) {
+    rbsp_bits(br, 16);
+    rbsp_bits(br, 1);                          // first_slice_segment_in_pic_flag, already checked
+    if (nal_type >= 16 && nal_type <= 23) {
+        rbsp_bits(br, 1);                      // no_output_of_prior_pics_flag
+    }
+    uint32_t pps_id = rbsp_ue(br);
+    if (pps_id < SCAN_MAX_PPS) {
+        rbsp_bits(br, st->pps_extra_bits[pps_id]);
+    }
+    uint32_t slice_type = rbsp_ue(br);
+    return slice_type <= 2 ? (int)slice_type : 2;
+}
+
+// Parse one NAL unit; returns the slice type if it starts a picture, -1 otherwise
+static int scan_nal(ScanState *st, const uint8_t *nal, const uint8_t *end) {
+    if (end - nal < 3) {
+        return -1;
+    }
+    int type = (nal[0] >> 1) & 0x3f;
+    RbspReader br;
+    
+    // The second MV-HEVC view belongs to the base picture's access unit and has its own SPS
+    if ((nal[0] & 1) || (nal[1] >> 3)) {
+        return -1;
+    }
+    if (type == 33) {
+        rbsp_init(&br, nal, end);
+        scan_parse_sps(st, &br);
+    } else if (type == 34) {
+        rbsp_init(&br, nal, end);
+        scan_parse_pps(st, &br);
+    } else if (type < 32 && (nal[2] & 0x80)) {
+        rbsp_init(&br, nal, end);
+        return scan_parse_slice_type(st, &br, type);
+    }
+    return -1;
+}
+
+// Walk the NAL units of one access unit, Annex-B when nal_length_size is 0, length-prefixed otherwise
+static void scan_access_unit(ScanState *st, const uint8_t *data, int size, int nal_length_size, int64_t offset) {
+    const uint8_t *end = data + size;
+    int slice_type = -1;
+    int irap_type = -1;
+    const uint8_t *p = data;
+    
+    while (p < end) {
+        const uint8_t *nal, *nal_end;
+        if (nal_length_size) {
+            if (end - p < nal_length_size) {
+                break;
+            }
+            uint32_t len = 0;
+            for (int i = 0; i < nal_length_size; i++) {
+                len = (len << 8) | p[i];
+            }
+            nal = p + nal_length_size;
+            if (len > (uint32_t)(end - nal)) {
+                break;
+            }
+            nal_end = nal + len;
+            p = nal_end;
+        } else {
+            const uint8_t *sc = kernels.find_start_code(p, end);
+            if (sc == end) {
+                break;
+            }
+            nal = sc + 3;
+            nal_end = kernels.find_start_code(nal, end);
+            p = nal_end;
+        }
+        
+        int t = scan_nal(st, nal, nal_end);
+        if (t >= 0 && slice_type < 0) {
+            slice_type = t;
+            int nal_type = (nal[0] >> 1) & 0x3f;
+            if (nal_type >= 16 && nal_type <= 23) {
+                irap_type = nal_type;
+            }
+        }
+    }
+    
+    // A new GOP opens at every IRAP picture, and at the first picture whatever it is
+    if (slice_type >= 0 && (irap_type >= 0 || st->gop_count == 0)) {
+        if (st->gop_count == st->gop_capacity) {
+            int capacity = st->gop_capacity ? st->gop_capacity * 2 : 64;
+            ScanGop *gops = realloc(st->gops, capacity * sizeof(ScanGop));
+            if (!gops) {
+                return;
+            }
+            st->gops = gops;
+            st->gop_capacity = capacity;
+        }
+        ScanGop *gop = &st->gops[st->gop_count++];
+        memset(gop, 0, sizeof(*gop));
+        gop->start_frame = st->frames;
+        gop->offset = offset;
+        gop->irap_type = irap_type;
+    }
+    
+    st->bytes += size;
+    if (st->gop_count > 0) {
+        st->gops[st->gop_count - 1].bytes += size;
+    }
+    if (slice_type >= 0) {
+        st->frames++;
+        st->type_frames[slice_type]++;
+        st->type_bytes[slice_type] += size;
+        st->gops[st->gop_count - 1].frames++;
+    }
+}
+
+// Fixed-constant CPU cost of a job: decode scales with coded pixels and entropy-coded bits,
+// scaling with the cropped eye, encode with output pixels
+static double fixed_cost_estimate(int64_t in_frames, int width, int height, int64_t in_bytes, int64_t out_frames) {
+    return ((double)in_frames * width * height * SCAN_COST_DECODE_NS_PER_PIXEL +
+            in_bytes * 8.0 * SCAN_COST_DECODE_NS_PER_BIT +
+            out_frames * (double)INPUT_HEIGHT * INPUT_HEIGHT * SCAN_COST_SCALE_NS_PER_PIXEL +
+            out_frames * (double)OUTPUT_WIDTH * OUTPUT_HEIGHT * SCAN_COST_ENCODE_NS_PER_PIXEL) / 1e9;
+}
+
+// Write a quoted JSON string, escaping quotes, backslashes and control characters
+static void write_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Write the scan result and the cost estimate for the current output settings
+static void write_scan_json(FILE *out, const char *input_file, const char *format, const ScanState *st,
+                            double frame_rate, int skip_frames, const char *encoder_name) {
+    static const char *const slice_type_letters[3] = { "B", "P", "I" };
+    double duration = frame_rate > 0 ? st->frames / frame_rate : 0.0;
+    int64_t output_frames = skip_frames ? (st->frames + 1) / 2 : st->frames;
+    int64_t max_gop = 0;
+    for (int i = 0; i < st->gop_count; i++) {
+        max_gop = st->gops[i].frames > max_gop ? st->gops[i].frames : max_gop;
+    }
+    
+    double decode_pixels = (double)st->frames * st->width * st->height;
+    double encode_pixels = (double)output_frames * OUTPUT_WIDTH * OUTPUT_HEIGHT;
+    double cpu_seconds = fixed_cost_estimate(st->frames, st->width, st->height, st->bytes, output_frames);
+    
+    fprintf(out, "{\n");
+    fprintf(out, "  \"input\": ");
+    write_json_string(out, input_file);
+    fprintf(out, ",\n");
+    fprintf(out, "  \"format\": \"%s\",\n", format);
+    fprintf(out, "  \"width\": %d,\n  \"height\": %d,\n", st->width, st->height);
+    fprintf(out, "  \"frame_rate\": %.3f,\n", frame_rate);
+    fprintf(out, "  \"frames\": %lld,\n", (long long)st->frames);
+    fprintf(out, "  \"duration\": %.3f,\n", duration);
+    fprintf(out, "  \"bytes\": %lld,\n", (long long)st->bytes);
+    fprintf(out, "  \"bitrate_kbps\": %.1f,\n", duration > 0 ? st->bytes * 8 / duration / 1000 : 0.0);
+    
+    fprintf(out, "  \"frame_types\": {");
+    for (int t = 2; t >= 0; t--) {
+        fprintf(out, "%s\n    \"%s\": {\"frames\": %lld, \"bytes\": %lld, \"avg_bits\": %.0f}", t == 2 ? "" : ",",
+                slice_type_letters[t], (long long)st->type_frames[t], (long long)st->type_bytes[t],
+                st->type_frames[t] ? st->type_bytes[t] * 8.0 / st->type_frames[t] : 0.0);
+    }
+    fprintf(out, "\n  },\n");
+    
+    fprintf(out, "  \"max_gop_frames\": %lld,\n", (long long)max_gop);
+    fprintf(out, "  \"gops\": [");
+    for (int i = 0; i < st->gop_count; i++) {
+        const ScanGop *gop = &st->gops[i];
+        fprintf(out, "%s\n    {\"start_frame\": %lld, \"offset\": %lld, \"irap\": ", i ? "," : "",
+                (long long)gop->start_frame, (long long)gop->offset);
+        if (gop->irap_type >= 0) {
+            fprintf(out, "\"%s\"", hevc_nal_type_names[gop->irap_type] ? hevc_nal_type_names[gop->irap_type] : "IRAP");
+        } else {
+            fprintf(out, "null");
+        }
+        fprintf(out, ", \"frames\": %lld, \"bytes\": %lld}", (long long)gop->frames, (long long)gop->bytes);
+    }
+    fprintf(out, "\n  ],\n");
+    
+    fprintf(out, "  \"output\": {\"encoder\": ");
+    write_json_string(out, encoder_name);
+    fprintf(out, ", \"width\": %d, \"height\": %d, \"frame_rate\": %d, \"frames\": %lld},\n",
+            OUTPUT_WIDTH, OUTPUT_HEIGHT, skip_frames ? FRAME_RATE / 2 : FRAME_RATE, (long long)output_frames);
+    fprintf(out, "  \"cost\": {\"decode_megapixels\": %.1f, \"encode_megapixels\": %.1f, "
+            "\"estimated_cpu_seconds\": %.1f}\n", decode_pixels / 1e6, encode_pixels / 1e6, cpu_seconds);
+    fprintf(out, "}\n");
+}
+
+// Walk the input parsing only NAL and slice headers; the caller frees st->gops
+int scan_input(const char *input_file, int no_es_fastpath, ScanState *st, const char **format, double *frame_rate) {
+    *format = "hevc";
+    *frame_rate = FRAME_RATE;
+    
+    if (!no_es_fastpath && is_hevc_es_file(input_file)) {
+        // Raw streams are walked straight off the mapping, one access unit at a time
+        EsReader *r = es_reader_open(input_file);
+        AVPacket *pkt = av_packet_alloc();
+        if (!r || !pkt) {
+            es_reader_close(r);
+            av_packet_free(&pkt);
+            return -1;
+        }
+        while (es_reader_read(r, pkt) >= 0) {
+            scan_access_unit(st, pkt->data, pkt->size, 0, pkt->data - r->data);
+            av_packet_unref(pkt);
+        }
+        av_packet_free(&pkt);
+        es_reader_close(r);
+    } else {
+        // Containers are demuxed without avformat_find_stream_info, which would decode
+        AVFormatContext *fmt_ctx = NULL;
+        if (avformat_open_input(&fmt_ctx, input_file, NULL, NULL) < 0) {
+            fprintf(stderr, "Could not open input file '%s'\n", input_file);
+            return -1;
+        }
+        *format = fmt_ctx->iformat->name;
+        
+        int stream_idx = -1;
+        for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+            if (fmt_ctx->streams[i]->codecpar->codec_id == AV_CODEC_ID_HEVC) {
+                stream_idx = i;
+                break;
+            }
+        }
+        if (stream_idx < 0) {
+            fprintf(stderr, "Scan supports HEVC inputs only\n");
+            avformat_close_input(&fmt_ctx);
+            return -1;
+        }
+        
+        AVStream *stream = fmt_ctx->streams[stream_idx];
+        st->width = stream->codecpar->width;
+        st->height = stream->codecpar->height;
+        if (stream->avg_frame_rate.num > 0 && stream->avg_frame_rate.den > 0) {
+            *frame_rate = av_q2d(stream->avg_frame_rate);
+        } else if (stream->r_frame_rate.num > 0 && stream->r_frame_rate.den > 0) {
+            *frame_rate = av_q2d(stream->r_frame_rate);
+        }
+        
+        // hvcC extradata means length-prefixed samples; its parameter set arrays start at byte 22
+        const uint8_t *extra = stream->codecpar->extradata;
+        int extra_size = stream->codecpar->extradata_size;
+        int nal_length_size = 0;
+        if (extra_size >= 23 && extra[0] == 1) {
+            nal_length_size = (extra[21] & 3) + 1;
+            const uint8_t *p = extra + 23, *end = extra + extra_size;
+            for (int a = 0; a < extra[22] && end - p >= 3; a++) {
+                int count = (p[1] << 8) | p[2];
+                p += 3;
+                for (int n = 0; n < count && end - p >= 2; n++) {
+                    int len = (p[0] << 8) | p[1];
+                    if (len > end - p - 2) {
+                        break;
+                    }
+                    scan_nal(st, p + 2, p + 2 + len);
+                    p += 2 + len;
+                }
+            }
+        } else if (extra_size > 0) {
+            scan_access_unit(st, extra, extra_size, 0, 0);
+            st->bytes = 0;
+        }
+        
+        AVPacket *pkt = av_packet_alloc();
+        while (pkt && av_read_frame(fmt_ctx, pkt) >= 0) {
+            if (pkt->stream_index == stream_idx) {
+                scan_access_unit(st, pkt->data, pkt->size, nal_length_size, pkt->pos);
+            }
+            av_packet_unref(pkt);
+        }
+        av_packet_free(&pkt);
+        avformat_close_input(&fmt_ctx);
+    }
+    return 0;
+}
+
+// Scan the input and emit a JSON job description
+int run_scan(const char *input_file, const char *output_file, int skip_frames, const char *encoder_name,
+             int no_es_fastpath) {
+    ScanState st = {0};
+    const char *format;
+    double frame_rate;
+    int ret = 0;
+    
+    if (scan_input(input_file, no_es_fastpath, &st, &format, &frame_rate) < 0) {
+        free(st.gops);
+        return -1;
+    }
+    
+    FILE *out = output_file ? fopen(output_file, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Could not open scan output '%s'\n", output_file);
+        ret = -1;
+    } else {
+        write_scan_json(out, input_file, format, &st, frame_rate, skip_frames, encoder_name);
+        if (out != stdout) {
+            fclose(out);
+        }
+    }
+    free(st.gops);
+    return ret;
+}
+
+// Column names of the run statistics database, one row per completed run
+static const char *const run_stats_columns[RUN_STATS_FIELDS] = {
+    "time", "host", "cores", "cpu_level", "encoder", "container", "skip",
+    "in_width", "in_height", "in_frames", "in_bytes", "out_frames",
+    "decoder_threads", "frame_threads", "pool_threads",
+    "demux_s", "decode_s", "scale_s", "encode_s", "mux_s", "wall_s", "cpu_s",
+};
+
+// Size of a file in bytes, 0 if it cannot be read
+static int64_t file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (int64_t)st.st_size : 0;
+}
+
+// Append this run's features and measured stage times to the run statistics database
+int append_run_stats(ProcessingContext *ctx, int input_frames, int output_frames, int64_t wall_us) {
+    char path[PATH_MAX];
+    char model[128];
+    struct rusage usage;
+    
+    if (cache_file_path(path, sizeof(path), "HEVC_PROCESSOR_RUN_STATS", RUN_STATS_FILE, 1) < 0) {
+        return -1;
+    }
+    int is_new = access(path, F_OK) != 0;
+    FILE *f = fopen(path, "a");
+    if (!f) {
+        fprintf(stderr, "Could not open run statistics database %s\n", path);
+        return -1;
+    }
+    if (is_new) {
+        for (int i = 0; i < RUN_STATS_FIELDS; i++) {
+            fprintf(f, "%s%s", run_stats_columns[i], i + 1 < RUN_STATS_FIELDS ? "," : "\n");
+        }
+    }
+    
+    read_cpu_model(model, sizeof(model));
+    getrusage(RUSAGE_SELF, &usage);
+    int64_t in_bytes = 0;
+    for (int i = 0; i < ctx->input_count; i++) {
+        in_bytes += file_size(ctx->inputs[i]);
+    }
+    double cpu_s = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                   usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    
+    fprintf(f, "%lld,%s,%ld,%s,%s,%s,%d,%d,%d,%d,%lld,%d,%d,%d,%d",
+            (long long)time(NULL), model, sysconf(_SC_NPROCESSORS_ONLN), cpu_level_name(cpu_dispatch.active),
+            ctx->encoder_name, ctx->mp4_output ? "mp4" : "raw", ctx->skip_frames,
+            ctx->decoder_ctx->width, ctx->decoder_ctx->height, input_frames, (long long)in_bytes,
+            output_frames, ctx->threads.decoder_threads, ctx->threads.frame_threads, ctx->threads.pool_threads);
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        fprintf(f, ",%.3f", metrics_get(&pipeline_metrics.stage_busy_us[s]) / 1e6);
+    }
+    fprintf(f, ",%.3f,%.3f\n", wall_us / 1e6, cpu_s);
+    fclose(f);
+    return 0;
+}
+
+// Model inputs for one job: intercept, decoded megapixels, input megabits, encoded megapixels
+static void predict_features(double x[PREDICT_FEATURES], int64_t in_frames, int width, int height,
+                             int64_t in_bytes, int64_t out_frames) {
+    x[0] = 1.0;
+    x[1] = (double)in_frames * width * height / 1e6;
+    x[2] = in_bytes * 8.0 / 1e6;
+    x[3] = (double)out_frames * OUTPUT_WIDTH * OUTPUT_HEIGHT / 1e6;
+}
+
+// Solve the normal equations a * coef = b by Gaussian elimination, returns -1 if singular
+static int solve_normal_equations(double a[PREDICT_FEATURES][PREDICT_FEATURES], double b[PREDICT_FEATURES],
+                                  double coef[PREDICT_FEATURES]) {
+    for (int col = 0; col < PREDICT_FEATURES; col++) {
+        int pivot = col;
+        for (int r = col + 1; r < PREDICT_FEATURES; r++) {
+            if (fabs(a[r][col]) > fabs(a[pivot][col])) {
+                pivot = r;
+            }
+        }
+        if (fabs(a[pivot][col]) < 1e-12) {
+            return -1;
+        }
+        for (int k = 0; k < PREDICT_FEATURES; k++) {
+            double t = a[col][k];
+            a[col][k] = a[pivot][k];
+            a[pivot][k] = t;
+        }
+        double t = b[col];
+        b[col] = b[pivot];
+        b[pivot] = t;
+        
+        for (int r = col + 1; r < PREDICT_FEATURES; r++) {
+            double factor = a[r][col] / a[col][col];
+            for (int k = col; k < PREDICT_FEATURES; k++) {
+                a[r][k] -= factor * a[col][k];
+            }
+            b[r] -= factor * b[col];
+        }
+    }
+    for (int r = PREDICT_FEATURES - 1; r >= 0; r--) {
+        double sum = b[r];
+        for (int k = r + 1; k < PREDICT_FEATURES; k++) {
+            sum -= a[r][k] * coef[k];
+        }
+        coef[r] = sum / a[r][r];
+    }
+    return 0;
+}
+
+// Accumulated least-squares and ratio statistics for one target (wall or CPU seconds)
+typedef struct {
+    double xtx[PREDICT_FEATURES][PREDICT_FEATURES];
+    double xty[PREDICT_FEATURES];
+    double measured_sum;
+    double fixed_sum;
+} PredictFit;
+
+static void predict_fit_add(PredictFit *fit, const double x[PREDICT_FEATURES], double fixed, double y) {
+    for (int i = 0; i < PREDICT_FEATURES; i++) {
+        for (int j = 0; j < PREDICT_FEATURES; j++) {
+            fit->xtx[i][j] += x[i] * x[j];
+        }
+        fit->xty[i] += x[i] * y;
+    }
+    fit->measured_sum += y;
+    fit->fixed_sum += fixed;
+}
+
+// Linear model when there are enough samples and it is physically sensible, else the
+// fixed-constant model rescaled by how far past runs on this host deviated from it
+static double predict_fit_eval(PredictFit *fit, int samples, const double x[PREDICT_FEATURES], double fixed,
+                               const char **model) {
+    if (samples >= PREDICT_MIN_SAMPLES) {
+        double coef[PREDICT_FEATURES];
+        
+        // Decoded and encoded pixels are proportional whenever the geometry and skip mode do not
+        // vary, so the plain normal equations are singular. A ridge term lambda * I on the
+        // non-intercept features, scaled to their mean energy, splits the weight between them
+        double energy = 0.0;
+        for (int i = 1; i < PREDICT_FEATURES; i++) {
+            energy += fit->xtx[i][i] / (PREDICT_FEATURES - 1);
+        }
+        for (int i = 1; i < PREDICT_FEATURES; i++) {
+            fit->xtx[i][i] += PREDICT_RIDGE * energy;
+        }
+        if (solve_normal_equations(fit->xtx, fit->xty, coef) == 0 &&
+            coef[1] >= 0 && coef[2] >= 0 && coef[3] >= 0) {
+            double y = 0.0;
+            for (int i = 0; i < PREDICT_FEATURES; i++) {
+                y += coef[i] * x[i];
+            }
+            if (y > 0) {
+                *model = "linear";
+                return y;
+            }
+        }
+    }
+    if (samples > 0 && fit->fixed_sum > 0) {
+        *model = "scaled";
+        return fixed * fit->measured_sum / fit->fixed_sum;
+    }
+    *model = "fixed";
+    return fixed;
+}
+
+// Predict wall time and CPU seconds for a job from past runs on this host with the same encoder
+int run_predict(const char *input_file, int skip_frames, const char *encoder_name, int no_es_fastpath) {
+    ScanState st = {0};
+    const char *format;
+    double frame_rate;
+    char path[PATH_MAX];
+    char host[128];
+    char line[1024];
+    
+    if (scan_input(input_file, no_es_fastpath, &st, &format, &frame_rate) < 0) {
+        free(st.gops);
+        return -1;
+    }
+    free(st.gops);
+    
+    int64_t in_bytes = file_size(input_file);
+    int64_t out_frames = skip_frames ? (st.frames + 1) / 2 : st.frames;
+    double x[PREDICT_FEATURES];
+    predict_features(x, st.frames, st.width, st.height, in_bytes, out_frames);
+    double fixed = fixed_cost_estimate(st.frames, st.width, st.height, in_bytes, out_frames);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    // Only runs on the same CPU model, core count and encoder are comparable
+    PredictFit wall_fit = {0}, cpu_fit = {0};
+    int samples = 0;
+    read_cpu_model(host, sizeof(host));
+    FILE *f = NULL;
+    if (cache_file_path(path, sizeof(path), "HEVC_PROCESSOR_RUN_STATS", RUN_STATS_FILE, 0) == 0) {
+        f = fopen(path, "r");
+    }
+    while (f && fgets(line, sizeof(line), f)) {
+        char *fields[RUN_STATS_FIELDS];
+        int n = 0;
+        line[strcspn(line, "\r\n")] = '\0';
+        for (char *tok = line, *next; tok && n < RUN_STATS_FIELDS; tok = next) {
+            next = strchr(tok, ',');
+            if (next) {
+                *next++ = '\0';
+            }
+            fields[n++] = tok;
+        }
+        if (n < RUN_STATS_FIELDS || strcmp(fields[0], "time") == 0 || strcmp(fields[1], host) != 0 ||
+            atol(fields[2]) != cores || strcmp(fields[4], encoder_name) != 0) {
+            continue;
+        }
+        
+        int64_t row_frames = atoll(fields[9]), row_bytes = atoll(fields[10]), row_out = atoll(fields[11]);
+        int row_width = atoi(fields[7]), row_height = atoi(fields[8]);
+        double row_x[PREDICT_FEATURES];
+        predict_features(row_x, row_frames, row_width, row_height, row_bytes, row_out);
+        double row_fixed = fixed_cost_estimate(row_frames, row_width, row_height, row_bytes, row_out);
+        predict_fit_add(&wall_fit, row_x, row_fixed / cores, atof(fields[20]));
+        predict_fit_add(&cpu_fit, row_x, row_fixed, atof(fields[21]));
+        samples++;
+    }
+    if (f) {
+        fclose(f);
+    }
+    
+    // Without history the wall time assumes the fixed CPU cost spreads over every core
+    const char *wall_model, *cpu_model;
+    double wall = predict_fit_eval(&wall_fit, samples, x, fixed / cores, &wall_model);
+    double cpu = predict_fit_eval(&cpu_fit, samples, x, fixed, &cpu_model);
+    
+    printf("{\n");
+    printf("  \"input\": ");
+    write_json_string(stdout, input_file);
+    printf(",\n");
+    printf("  \"frames\": %lld,\n  \"output_frames\": %lld,\n", (long long)st.frames, (long long)out_frames);
+    printf("  \"encoder\": ");
+    write_json_string(stdout, encoder_name);
+    printf(",\n");
+    printf("  \"samples\": %d,\n", samples);
+    printf("  \"wall_seconds\": %.1f,\n  \"wall_model\": \"%s\",\n", wall, wall_model);
+    printf("  \"cpu_seconds\": %.1f,\n  \"cpu_model\": \"%s\"\n", cpu, cpu_model);
+    printf("}\n");
+    return 0;
+}
+
+// Requests are served in stream order; equal targets keep their list order
+static int compare_extract_requests(const void *a, const void *b) {
+    const ExtractRequest *x = a, *y = b;
+    if (x->target != y->target) {
+        return x->target < y->target ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+// Read the request list: a frame number or a time in seconds ("12.5s") per line
+static int load_extract_requests(const char *list_file, AVStream *st, ExtractRequest **requests, int *count) {
+    FILE *f = fopen(list_file, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open extract list %s\n", list_file);
+        return -1;
+    }
+    
+    AVRational rate = st->avg_frame_rate.num > 0 ? st->avg_frame_rate : st->r_frame_rate;
+    if (rate.num <= 0 || rate.den <= 0) {
+        rate = (AVRational){FRAME_RATE, 1};
+    }
+    int64_t start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    char line[256];
+    int capacity = 0;
+    *requests = NULL;
+    *count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char *end;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        double value = strtod(line, &end);
+        if (end == line || value < 0 || (*end != '\0' && strcmp(end, "s") != 0)) {
+            fprintf(stderr, "Bad extract request '%s', expected a frame number or seconds such as 12.5s\n", line);
+            fclose(f);
+            return -1;
+        }
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            ExtractRequest *grown = realloc(*requests, capacity * sizeof(*grown));
+            if (!grown) {
+                fclose(f);
+                return -1;
+            }
+            *requests = grown;
+        }
+        ExtractRequest *req = &(*requests)[*count];
+        req->target = start + (*end == 's' ? llrint(value / av_q2d(st->time_base))
+                                           : av_rescale_q((int64_t)value, av_inv_q(rate), st->time_base));
+        req->index = (*count)++;
+    }
+    fclose(f);
+    
+    if (*count == 0) {
+        fprintf(stderr, "Extract list %s has no requests\n", list_file);
+        return -1;
+    }
+    return 0;
+}
+
+// Next decoded frame of the demuxed input in ctx->frame, AVERROR_EOF once the decoder is drained,
+// or the read error if the input fails before its end
+static int decode_next_frame(ProcessingContext *ctx) {
+    while (1) {
+        int ret = avcodec_receive_frame(ctx->decoder_ctx, ctx->frame);
+        if (ret >= 0 && !is_selected_view(ctx, ctx->frame)) {
+            av_frame_unref(ctx->frame);
+            continue;
+        }
+        if (ret != AVERROR(EAGAIN)) {
+            return ret;
+        }
+        ret = av_read_frame(ctx->fmt_ctx, ctx->pkt);
+        if (ret < 0 && ret != AVERROR_EOF) {
+            fprintf(stderr, "Error reading input: %d\n", ret);
+            return ret;
+        }
+        if (ret < 0) {
+            // End of input: drain the frames still held for reordering
+            avcodec_send_packet(ctx->decoder_ctx, NULL);
+            continue;
+        }
+        if (ctx->pkt->stream_index == ctx->video_stream_idx &&
+            avcodec_send_packet(ctx->decoder_ctx, ctx->pkt) < 0) {
+            fprintf(stderr, "Error sending packet for decoding\n");
+        }
+        av_packet_unref(ctx->pkt);
+    }
+}
+
+// Frame server: decode only what the requested frames need and write them, cropped and scaled,
+// as one tensor of fixed-size frames in request order. Requests are sorted and served in one
+// forward pass; the decoder seeks to the keyframe before a request only when that keyframe lies
+// beyond the last decoded frame, so nearby requests share the decode.
+int run_extract(ProcessingContext *ctx, const char *list_file, const char *output_file, int rgb) {
+    ExtractRequest *requests = NULL;
+    int count = 0;
+    struct SwsContext *rgb_ctx = NULL;
+    uint8_t *rgb_buffer = NULL;
+    FILE *out = NULL;
+    int result = -1;
+    int64_t start_time = av_gettime_relative();
+    
+    if (init_decoder(ctx, ctx->inputs[0]) < 0 || init_scaler(ctx) < 0) {
+        return -1;
+    }
+    AVStream *st = ctx->fmt_ctx->streams[ctx->video_stream_idx];
+    if (load_extract_requests(list_file, st, &requests, &count) < 0) {
+        free(requests);
+        return -1;
+    }
+    qsort(requests, count, sizeof(*requests), compare_extract_requests);
+    
+    // RGB output converts the scaled picture, so the crop and scale path stays the same
+    int frame_size = OUTPUT_WIDTH * OUTPUT_HEIGHT * 3 / 2;
+    if (rgb) {
+        rgb_ctx = sws_getContext(OUTPUT_WIDTH, OUTPUT_HEIGHT, AV_PIX_FMT_YUV420P,
+                                 OUTPUT_WIDTH, OUTPUT_HEIGHT, AV_PIX_FMT_RGB24,
+                                 SWS_BICUBIC, NULL, NULL, NULL);
+        frame_size = OUTPUT_WIDTH * OUTPUT_HEIGHT * 3;
+        rgb_buffer = malloc(frame_size);
+        if (!rgb_ctx || !rgb_buffer) {
+            fprintf(stderr, "Failed to initialize RGB conversion\n");
+            goto done;
+        }
+    }
+    
+    out = fopen(output_file, "wb");
+    if (!out) {
+        fprintf(stderr, "Could not open output file %s\n", output_file);
+        goto done;
+    }
+    
+    // A frame answers a request when it is the first one at or after the target, within half a frame
+    AVRational rate = st->avg_frame_rate.num > 0 ? st->avg_frame_rate : (AVRational){FRAME_RATE, 1};
+    int64_t half_frame = av_rescale_q(1, av_inv_q(rate), st->time_base) / 2;
+    int64_t seek_gap = llrint(EXTRACT_SEEK_GAP / av_q2d(st->time_base));
+    int64_t start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    int64_t last_pts = AV_NOPTS_VALUE;
+    int seeks = 0, decoded = 0, extracted = 0, missing = 0;
+    const uint8_t *frame_data = rgb ? rgb_buffer : ctx->scaled_buffer;
+    
+    for (int r = 0; r < count; r++) {
+        const ExtractRequest *req = &requests[r];
+        int64_t wanted = req->target - half_frame;
+        
+        // Requests at or before the current frame reuse its scaled picture
+        if (last_pts == AV_NOPTS_VALUE || last_pts < wanted) {
+            // Seek when the closest preceding keyframe is ahead of the decoder; without an index
+            // only when the gap is large, since decoding through a short gap is cheaper
+            int64_t pos = last_pts != AV_NOPTS_VALUE ? last_pts : start;
+            const AVIndexEntry *key = avformat_index_get_entry_from_timestamp(st, req->target, AVSEEK_FLAG_BACKWARD);
+            if (key ? key->timestamp > pos : req->target - pos > seek_gap) {
+                if (av_seek_frame(ctx->fmt_ctx, ctx->video_stream_idx, req->target, AVSEEK_FLAG_BACKWARD) >= 0) {
+                    avcodec_flush_buffers(ctx->decoder_ctx);
+                    seeks++;
+                }
+            }
+            
+            int ret;
+            while ((ret = decode_next_frame(ctx)) == 0) {
+                decoded++;
+                last_pts = ctx->frame->best_effort_timestamp != AV_NOPTS_VALUE ?
+                           ctx->frame->best_effort_timestamp : ctx->frame->pts;
+                if (last_pts >= wanted) {
+                    break;
+                }
+                av_frame_unref(ctx->frame);
+            }
+            if (ret == AVERROR_EOF) {
+                // Every later request is past the end as well; their slots stay zero
+                missing = count - r;
+                break;
+            }
+            if (ret < 0) {
+                fprintf(stderr, "Error decoding frame for request %d\n", req->index);
+                goto done;
+            }
+            
+            process_frame_with_swscale(ctx, ctx->frame);
+            av_frame_unref(ctx->frame);
+            if (rgb) {
+                const uint8_t *src_data[4] = {
+                    ctx->scaled_buffer,
+                    ctx->scaled_buffer + OUTPUT_WIDTH * OUTPUT_HEIGHT,
+                    ctx->scaled_buffer + OUTPUT_WIDTH * OUTPUT_HEIGHT * 5 / 4,
+                    NULL
+                };
+                int src_linesize[4] = { OUTPUT_WIDTH, OUTPUT_WIDTH / 2, OUTPUT_WIDTH / 2, 0 };
+                uint8_t *dst_data[4] = { rgb_buffer, NULL, NULL, NULL };
+                int dst_linesize[4] = { OUTPUT_WIDTH * 3, 0, 0, 0 };
+                sws_scale(rgb_ctx, src_data, src_linesize, 0, OUTPUT_HEIGHT, dst_data, dst_linesize);
+            }
+        }
+        
+        if (fseeko(out, (off_t)req->index * frame_size, SEEK_SET) != 0 ||
+            fwrite(frame_data, 1, frame_size, out) != (size_t)frame_size) {
+            fprintf(stderr, "Error writing frame for request %d\n", req->index);
+            goto done;
+        }
+        extracted++;
+    }
+    
+    // Size the tensor for every request, including any past the end of the input
+    if (fflush(out) != 0 || ftruncate(fileno(out), (off_t)count * frame_size) != 0) {
+        fprintf(stderr, "Error writing %s\n", output_file);
+        goto done;
+    }
+    if (missing > 0) {
+        fprintf(stderr, "Warning: %d requests are past the end of the input and were left black\n", missing);
+    }
+    printf("Extracted %d frames of %dx%d %s (%d bytes each) to %s\n", extracted, OUTPUT_WIDTH, OUTPUT_HEIGHT,
+           rgb ? "rgb24" : "yuv420p", frame_size, output_file);
+    printf("Decoded %d frames with %d seeks in %.2f s\n", decoded, seeks,
+           (av_gettime_relative() - start_time) / 1000000.0);
+    result = 0;
+    
+done:
+    if (out && fclose(out) != 0) {
+        result = -1;
+    }
+    free(requests);
+    free(rgb_buffer);
+    sws_freeContext(rgb_ctx);
+    return result;
+}
+
+// Print command line usage
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <input_hevc> <output_file> [skip]\n", prog);
+    fprintf(stderr, "       <output_file> can be .hevc for raw HEVC or .mp4 for MP4 container\n");
+    fprintf(stderr, "       Add 'skip' to skip every other input frame\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "       --cpu <level>   Force SIMD level: auto, c, sse4.1, avx2, avx512, neon\n");
+    fprintf(stderr, "       --encoder <name>  x265 (default) or a libavcodec encoder, e.g. libx264, libsvtav1\n");
+    fprintf(stderr, "       --concat        <input_hevc> is a list of inputs, one per line, encoded as one stream\n");
+    fprintf(stderr, "       --clips         <input_hevc> is a list of clips encoded by one warm encoder session,\n");
+    fprintf(stderr, "                       each to its own file named by <output_file>, e.g. clip_%%03d.mp4\n");
+    fprintf(stderr, "       --split-duration <sec>  Start a new output file at the first IDR after <sec> seconds\n");
+    fprintf(stderr, "       --split-size <MB>  Start a new output file at the first IDR after <MB> megabytes\n");
+    fprintf(stderr, "       --eye <e>       Eye to encode: left (default) or right; a half of side-by-side\n");
+    fprintf(stderr, "                       input or a view of MV-HEVC input\n");
+    fprintf(stderr, "       --right-input <file>  Per-eye recording: <input_hevc> is the left eye, <file> the\n");
+    fprintf(stderr, "                       right eye, decoded in step; both are packed side by side\n");
+    fprintf(stderr, "       --right-output <file>  With --right-input, encode the right eye to <file> instead\n");
+    fprintf(stderr, "                       (.hevc, .mp4, .ts, ...) and only the left eye to <output_file>\n");
+    fprintf(stderr, "       --mosaic        <input_hevc> is a list of 2 to %d inputs decoded in parallel and tiled\n", MOSAIC_MAX);
+    fprintf(stderr, "                       into one output picture; the first input sets the timeline\n");
+    fprintf(stderr, "       --also <file>   Also write the encoded stream to <file> (.hevc, .mp4, .ts, .m3u8, ...)\n");
+    fprintf(stderr, "                       from its own writer thread; repeat for up to %d extra outputs\n", SINK_MAX);
+    fprintf(stderr, "       --sink-policy <p>  When the extra outputs given after it fall behind: block\n");
+    fprintf(stderr, "                       (default) or drop up to the next keyframe\n");
+    fprintf(stderr, "       --thumbnails <sec>  Tile a thumbnail every <sec> seconds into JPEG sprite sheets\n");
+    fprintf(stderr, "                       with a WebVTT map, next to the output\n");
+    fprintf(stderr, "       --phash <n>     Write a 64-bit perceptual hash of every <n>th output frame to\n");
+    fprintf(stderr, "                       <output_file>.phash\n");
+    fprintf(stderr, "       --intra-refresh  Refresh the picture with a rolling intra column instead of IDRs after\n");
+    fprintf(stderr, "                       the first, under a half-second VBV, for live outputs (x265 only)\n");
+    fprintf(stderr, "       --iframe-playlist  Write an HLS I-frame-only playlist for each MP4 output\n");
+    fprintf(stderr, "       --data-streams  Copy telemetry/data streams into the MP4, or to <output_file>.data\n");
+    fprintf(stderr, "       --projection <p>  Spherical metadata: auto (copy from input, default), none,\n");
+    fprintf(stderr, "                       equirect or vr180; st3d/sv3d boxes in MP4, an SEI in raw HEVC\n");
+    fprintf(stderr, "       --write-proxy   Also write a %dx%d intra-only proxy of the cropped eye to the cache\n",
+            PROXY_WIDTH, PROXY_HEIGHT);
+    fprintf(stderr, "       --no-proxy      Decode the source even when a proxy of it is cached\n");
+    fprintf(stderr, "       --no-es-fastpath  Demux raw .hevc inputs through libavformat instead of mmap\n");
+    fprintf(stderr, "       --es-index      Write a frame offset index <output_file>.idx next to raw HEVC output\n");
+    fprintf(stderr, "       --autotune      Benchmark thread configurations on <input_hevc> and cache the best\n");
+    fprintf(stderr, "       --scan          Parse NAL and slice headers only and print a JSON job estimate\n");
+    fprintf(stderr, "                       (to <output_file> if given), without decoding\n");
+    fprintf(stderr, "       --predict       Predict wall time and CPU seconds from the run statistics database\n");
+    fprintf(stderr, "       --extract <list>  Write only the frames listed (frame numbers, or seconds as 12.5s),\n");
+    fprintf(stderr, "                       cropped and scaled, to <output_file> as raw frames in list order\n");
+    fprintf(stderr, "       --extract-format <fmt>  yuv (yuv420p, default) or rgb (rgb24) for --extract\n");
+    fprintf(stderr, "       --no-run-stats  Do not append this run to the run statistics database\n");
+    fprintf(stderr, "       --no-tune-cache Ignore the cached thread profile for this host\n");
+    fprintf(stderr, "       --frame-stats <file>  Write per-frame encoder stats (.json for JSON, CSV otherwise)\n");
+    fprintf(stderr, "       --psnr          Have x265 compute per-frame PSNR for the stats\n");
+    fprintf(stderr, "       --metrics <addr>  Serve Prometheus metrics on [host:]port or unix:/path\n");
+    fprintf(stderr, "       --watchdog <sec>  Dump diagnostics when nothing progresses for <sec> seconds\n");
+    fprintf(stderr, "       --frame-budget <ms>  Dump diagnostics when one stage call exceeds <ms>\n");
+    fprintf(stderr, "       --watchdog-dump <file>  Append watchdog dumps to <file> instead of stderr\n");
+    fprintf(stderr, "       --watchdog-abort  Exit with code %d after a watchdog dump\n", WATCHDOG_EXIT_CODE);
+}
+
+// Print the end-of-run statistics report
+void print_stats_report(ProcessingContext *ctx, int frame_count, int input_frame_count) {
+    printf("=== Statistics ===\n");
+    printf("Frames:       %d encoded / %d decoded\n", frame_count, input_frame_count);
+    printf("CPU dispatch: %s (%s, host supports %s)\n",
+           cpu_level_name(cpu_dispatch.active),
+           cpu_dispatch.forced ? "forced" : "auto-detected",
+           cpu_level_name(cpu_dispatch.detected));
+    printf("Kernels:      find_start_code %s, dct_project %s\n", cpu_level_name(kernels.find_start_code_level),
+           cpu_level_name(kernels.dct_project_level));
+    printf("Threads:      decoder %d, x265 frame threads %d, pool %d\n",
+           ctx->threads.decoder_threads, ctx->threads.frame_threads, ctx->threads.pool_threads);
+    
+    // Per-stage throughput from the time spent inside each stage
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        long long busy = metrics_get(&pipeline_metrics.stage_busy_us[s]);
+        printf("Stage %-7s %8.2f s busy, %8.2f fps\n", stage_names[s], busy / 1000000.0,
+               busy > 0 ? metrics_get(&pipeline_metrics.stage_frames[s]) * 1000000.0 / busy : 0.0);
+    }
+    
+    // Per-backend encoder statistics
+    if (ctx->backend) {
+        double seconds = ctx->timestamp_increment > 0 ?
+            (double)ctx->enc_stats.packets * ctx->timestamp_increment / OUTPUT_TIMEBASE : 0.0;
+        printf("Encoder:      %s (%s), opened in %.1f ms\n", ctx->encoder_name,
+               avcodec_get_name(ctx->out_codec_id), ctx->enc_stats.open_us / 1000.0);
+        printf("              %lld packets, %lld keyframes, %lld bytes, %.0f kbps\n",
+               (long long)ctx->enc_stats.packets, (long long)ctx->enc_stats.keyframes,
+               (long long)ctx->enc_stats.bytes,
+               seconds > 0 ? ctx->enc_stats.bytes * 8 / seconds / 1000 : 0.0);
+        if (ctx->intra_refresh) {
+            printf("              %lld intra refresh recovery points\n", (long long)ctx->enc_stats.recovery_points);
+        }
+    }
+    print_frame_stats_summary(&ctx->frame_stats);
+    
+    // Encoder open overlaps input probing, so startup is bounded by the slower of the two
+    long long first_packet = metrics_get(&pipeline_metrics.first_packet_us);
+    printf("Startup:      input open+probe %.1f ms, encoder open %.1f ms (overlapped), first packet at %.1f ms\n",
+           ctx->probe_us / 1000.0, ctx->enc_stats.open_us / 1000.0, first_packet / 1000.0);
+    
+    // NAL unit breakdown of an elementary stream input
+    if (ctx->es_reader) {
+        printf("Input NALs:   %lld access units\n", (long long)ctx->es_reader->au_count);
+        for (int t = 0; t < HEVC_NAL_TYPES; t++) {
+            if (ctx->es_reader->nal_count[t]) {
+                char name[16];
+                if (hevc_nal_type_names[t]) {
+                    snprintf(name, sizeof(name), "%s", hevc_nal_type_names[t]);
+                } else {
+                    snprintf(name, sizeof(name), "type %d", t);
+                }
+                printf("  %-11s %8lld NALs, %12lld bytes\n", name,
+                       (long long)ctx->es_reader->nal_count[t], (long long)ctx->es_reader->nal_bytes[t]);
+            }
+        }
+    }
+}
+// Receive every frame the decoder has ready, then scale, encode and write it
+// Returns -1 if the encoder or output failed, 0 otherwise
+int receive_and_encode_frames(ProcessingContext *ctx, int64_t pkt_pts, int64_t pkt_dts) {
+    int ret = 0;
+    
+    while (1) {
+        int64_t stage_start = stage_begin(STAGE_DECODE);
+        ret = avcodec_receive_frame(ctx->decoder_ctx, ctx->frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            stage_done(STAGE_DECODE, stage_start, 0);
+            break;
+        } else if (ret < 0) {
+            fprintf(stderr, "Error during decoding\n");
+            stage_done(STAGE_DECODE, stage_start, 0);
+            metrics_add(&pipeline_metrics.frames_dropped, 1);
+            break;
+        }
+        stage_done(STAGE_DECODE, stage_start, 1);
+        if (!is_selected_view(ctx, ctx->frame)) {
+            av_frame_unref(ctx->frame);
+            continue;
+        }
+        
+        // Every left-eye frame takes its right-eye partner, skipped or not, so the eyes stay in step
+        if ((ctx->stereo.right.running && match_right_frame(ctx, ctx->frame) < 0) ||
+            (ctx->mosaic.count > 0 && match_mosaic(ctx, ctx->frame) < 0)) {
+            av_frame_unref(ctx->frame);
+            return -1;
+        }
+        metrics_add(&pipeline_metrics.frames_in, 1);
+        atomic_store_explicit(&pipeline_metrics.last_input_pts,
+                              ctx->frame->pts != AV_NOPTS_VALUE ? ctx->frame->pts : pkt_pts,
+                              memory_order_relaxed);
+        
+        // The proxy keeps every source frame, so later runs can still choose whether to skip
+        if (ctx->proxy.file && write_proxy_frame(ctx, ctx->frame) < 0) {
+            av_frame_unref(ctx->frame);
+            return -1;
+        }
+        
+        // Decide whether to process this frame or skip it
+        int should_process = 1;
+        if (ctx->skip_frames && (ctx->input_frame_count % 2 == 1)) {
+            should_process = 0;  // Skip this frame
+        }
+        
+        if (should_process) {
+            // Process frame: crop and scale using SwScale
+            stage_start = stage_begin(STAGE_SCALE);
+            if (ctx->mosaic.count > 0) {
+                if (compose_mosaic(ctx, ctx->frame) < 0) {
+                    stage_done(STAGE_SCALE, stage_start, 0);
+                    av_frame_unref(ctx->frame);
+                    return -1;
+                }
+            } else if (ctx->stereo.half_sws) {
+                compose_side_by_side(ctx, ctx->frame);
+            } else {
+                process_frame_with_swscale(ctx, ctx->frame);
+            }
+            stage_done(STAGE_SCALE, stage_start, 1);
+            
+            // Get timestamp from input frame for informational purposes
+            int64_t input_pts = ctx->frame->pts;
+            if (input_pts == AV_NOPTS_VALUE) {
+                // If no valid PTS in the frame, try packet PTS or DTS
+                if (pkt_pts != AV_NOPTS_VALUE) {
+                    input_pts = pkt_pts;
+                } else if (pkt_dts != AV_NOPTS_VALUE) {
+                    input_pts = pkt_dts;
+                } else {
+                    // Last resort: use frame count
+                    input_pts = ctx->input_frame_count;
+                }
+            }
+            
+            // Calculate timestamp for output frame based on frame count and timebase
+            int64_t output_pts = ctx->frame_count * ctx->timestamp_increment;
+            
+            printf("Frame %d: Input PTS = %lld, Output PTS = %lld\n", 
+                  ctx->input_frame_count, (long long)input_pts, (long long)output_pts);
+            
+            // Scrub thumbnails come from the picture just scaled for the encoder
+            if (ctx->thumbs.running) {
+                submit_thumbnail(ctx, output_pts);
+            }
+            if (ctx->phash.file && write_phash(ctx, output_pts) < 0) {
+                av_frame_unref(ctx->frame);
+                return -1;
+            }
+            
+            // The first frame of each clip opens its output; earlier empty clips share the boundary
+            if (ctx->clip_mode && ctx->clip_start_pts[ctx->input_index] < 0) {
+                for (int c = ctx->input_index; c >= 0 && ctx->clip_start_pts[c] < 0; c--) {
+                    ctx->clip_start_pts[c] = output_pts;
+                }
+            }
+            
+            // Encode the frame, forcing a keyframe at the start and at clip boundaries
+            mark_frame_submitted(ctx, ctx->frame_count);
+            stage_start = stage_begin(STAGE_ENCODE);
+            int force_idr = ctx->frame_count == 0 || ctx->force_idr;
+            ret = ctx->backend->send_frame(ctx, output_pts, force_idr);
+            ctx->force_idr = 0;
+            if (ret >= 0 && ctx->stereo.encoder) {
+                ret = encode_right_eye(ctx, output_pts, force_idr);
+            }
+            stage_done(STAGE_ENCODE, stage_start, 1);
+            metrics_add(&pipeline_metrics.frames_submitted, 1);
+            if (ret < 0) {
+                av_frame_unref(ctx->frame);
+                return -1;
+            }
+            
+            // Write whatever the encoder has ready
+            if (drain_encoder(ctx) < 0) {
+                av_frame_unref(ctx->frame);
+                return -1;
+            }
+            
+            ctx->frame_count++;
+            
+            // Print progress
+            if (ctx->frame_count % 10 == 0) {
+                printf("Processed %d frames\n", ctx->frame_count);
+            }
+        } else {
+            printf("Skipping input frame %d\n", ctx->input_frame_count);
+            metrics_add(&pipeline_metrics.frames_skipped, 1);
+        }
+        
+        ctx->input_frame_count++;
+        
+        // Unref the frame
+        av_frame_unref(ctx->frame);
+    }
+    return 0;
+}
+
+
+// Drain the frames still buffered in the decoder through the encoder, leaving it reusable
+int flush_decoder(ProcessingContext *ctx) {
+    if (avcodec_send_packet(ctx->decoder_ctx, NULL) < 0) {
+        fprintf(stderr, "Error flushing the decoder\n");
+        return -1;
+    }
+    int ret = receive_and_encode_frames(ctx, AV_NOPTS_VALUE, AV_NOPTS_VALUE);
+    avcodec_flush_buffers(ctx->decoder_ctx);
+    return ret;
+}
+
+// Move on to the next concatenated input, returns AVERROR_EOF after the last one
+// The decoder keeps running across inputs unless the stream parameters change
+int advance_input(ProcessingContext *ctx) {
+    AVCodecParameters *par = NULL;
+    
+    if (ctx->input_index + 1 >= ctx->input_count) {
+        return AVERROR_EOF;
     }
     
-    // Find video stream
-    ctx->video_stream_idx = -1;
-    for (int i = 0; i < ctx->fmt_ctx->nb_streams; i++) {
-        if (ctx->fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-            ctx->video_stream_idx = i;
-            break;
+    // A clip's pictures are all encoded before the next clip starts with an IDR
+    if (ctx->clip_mode) {
+        if (flush_decoder(ctx) < 0) {
+            return -1;
         }
+        ctx->force_idr = 1;
     }
     
-    if (ctx->video_stream_idx == -1) {
-        fprintf(stderr, "Could not find video stream\n");
-        return -1;
+    // Carry the NAL statistics over so the report covers the whole session
+    EsReader *prev_es = ctx->es_reader;
+    int64_t au_count = 0, nal_count[HEVC_NAL_TYPES] = {0}, nal_bytes[HEVC_NAL_TYPES] = {0};
+    if (prev_es) {
+        au_count = prev_es->au_count;
+        memcpy(nal_count, prev_es->nal_count, sizeof(nal_count));
+        memcpy(nal_bytes, prev_es->nal_bytes, sizeof(nal_bytes));
     }
     
-    // Find decoder - using const AVCodec* as required by newer FFmpeg
-    const AVCodec *decoder_codec = avcodec_find_decoder(ctx->fmt_ctx->streams[ctx->video_stream_idx]->codecpar->codec_id);
-    if (!decoder_codec) {
-        fprintf(stderr, "Failed to find decoder\n");
-        return -1;
+    // Data packets of the next input continue the output timeline where this input ends
+    if (ctx->data_passthrough && ctx->fmt_ctx) {
+        AVStream *video = ctx->fmt_ctx->streams[ctx->video_stream_idx];
+        if (video->duration != AV_NOPTS_VALUE && video->duration > 0) {
+            ctx->data_offset += av_rescale_q(video->duration, video->time_base, (AVRational){1, OUTPUT_TIMEBASE});
+        } else if (ctx->fmt_ctx->duration > 0) {
+            ctx->data_offset += av_rescale_q(ctx->fmt_ctx->duration, AV_TIME_BASE_Q, (AVRational){1, OUTPUT_TIMEBASE});
+        }
     }
     
-    // Store in context - need to cast away const for compatibility with older FFmpeg
-    ctx->decoder_codec = (AVCodec *)decoder_codec;
-    
-    // Create decoder context
-    ctx->decoder_ctx = avcodec_alloc_context3(ctx->decoder_codec);
-    if (!ctx->decoder_ctx) {
-        fprintf(stderr, "Failed to allocate decoder context\n");
+    close_input(ctx);
+    const char *path = ctx->inputs[++ctx->input_index];
+    printf("Continuing with input %d/%d: %s\n", ctx->input_index + 1, ctx->input_count, path);
+    if (open_input(ctx, path, &par) < 0 || (ctx->data_passthrough && check_data_layout(ctx, path) < 0)) {
+        avcodec_parameters_free(&par);
         return -1;
     }
-    
-    // Copy codec parameters to decoder context
-    ret = avcodec_parameters_to_context(ctx->decoder_ctx, ctx->fmt_ctx->streams[ctx->video_stream_idx]->codecpar);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to copy codec parameters to decoder context\n");
-        return -1;
+    if (ctx->es_reader) {
+        ctx->es_reader->au_count += au_count;
+        for (int t = 0; t < HEVC_NAL_TYPES; t++) {
+            ctx->es_reader->nal_count[t] += nal_count[t];
+            ctx->es_reader->nal_bytes[t] += nal_bytes[t];
+        }
     }
     
-    // Open codec
-    ret = avcodec_open2(ctx->decoder_ctx, ctx->decoder_codec, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to open codec\n");
-        return -1;
+    if (!input_params_changed(ctx->input_par, par)) {
+        avcodec_parameters_free(&par);
+        return 0;
     }
     
-    // Allocate frame and packet
-    ctx->frame = av_frame_alloc();
-    if (!ctx->frame) {
-        fprintf(stderr, "Failed to allocate frame\n");
+    // Finish the pictures of the previous input before swapping decoders
+    printf("Stream parameters changed, reopening decoder\n");
+    if (!ctx->clip_mode && flush_decoder(ctx) < 0) {
+        avcodec_parameters_free(&par);
         return -1;
     }
-    
-    ctx->pkt = av_packet_alloc();
-    if (!ctx->pkt) {
-        fprintf(stderr, "Failed to allocate packet\n");
+    avcodec_free_context(&ctx->decoder_ctx);
+    return open_decoder(ctx, par);
+}
+
+// Read the ordered input list for --concat: one path per line, blank lines and # comments ignored
+int load_input_list(ProcessingContext *ctx, const char *list_file) {
+    FILE *f = fopen(list_file, "rb");
+    if (!f) {
+        fprintf(stderr, "Could not open input list '%s'\n", list_file);
         return -1;
     }
-    
-    // Initialize SwScale context for cropping and scaling
-    // Using left eye only (INPUT_WIDTH/2) as source width
-    ctx->sws_ctx = sws_getContext(
-        INPUT_WIDTH/2, INPUT_HEIGHT,  // Source width/height - use half width for left eye
-        AV_PIX_FMT_YUV420P,           // Source format
-        OUTPUT_WIDTH, OUTPUT_HEIGHT,  // Destination width/height
-        AV_PIX_FMT_YUV420P,           // Destination format
-        SWS_BICUBIC,                  // High quality algorithm
-        NULL, NULL, NULL              // Default parameters
-    );
-    
-    if (!ctx->sws_ctx) {
-        fprintf(stderr, "Failed to initialize SwScale context\n");
-        return -1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    ctx->input_list = size >= 0 ? malloc(size + 1) : NULL;
+    if (!ctx->input_list || fread(ctx->input_list, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "Could not read input list '%s'\n", list_file);
+        fclose(f);
+        goto fail;
     }
+    fclose(f);
+    ctx->input_list[size] = '\0';
     
-    // Allocate scaled buffer (output size)
-    int scaled_y_size = OUTPUT_WIDTH * OUTPUT_HEIGHT;
-    int scaled_uv_size = scaled_y_size / 4;
-    ctx->scaled_buffer = (uint8_t*)malloc(scaled_y_size + 2 * scaled_uv_size);
-    if (!ctx->scaled_buffer) {
-        fprintf(stderr, "Failed to allocate scaled buffer\n");
-        return -1;
+    int capacity = 0;
+    for (char *line = strtok(ctx->input_list, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+        line += strspn(line, " \t");
+        if (!*line || *line == '#') {
+            continue;
+        }
+        if (ctx->input_count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            const char **inputs = realloc(ctx->inputs, capacity * sizeof(*inputs));
+            if (!inputs) {
+                goto fail;
+            }
+            ctx->inputs = inputs;
+        }
+        ctx->inputs[ctx->input_count++] = line;
     }
     
+    if (ctx->input_count == 0) {
+        fprintf(stderr, "Input list '%s' is empty\n", list_file);
+        goto fail;
+    }
     return 0;
+    
+fail:
+    free(ctx->inputs);
+    free(ctx->input_list);
+    ctx->inputs = NULL;
+    ctx->input_list = NULL;
+    ctx->input_count = 0;
+    return -1;
 }
 
 int main(int argc, char *argv[]) {
     int skip_frames = 0;  // Default: process all frames
     const char *input_file = NULL;
     const char *output_file = NULL;
+    CpuLevel cpu_level = CPU_LEVEL_AUTO;
+    int autotune = 0;
+    int use_tune_cache = 1;
+    const char *frame_stats_file = NULL;
+    const char *metrics_address = NULL;
+    const char *encoder_name = "x265";
+    int watchdog_enabled = 0;
+    int enable_psnr = 0;
+    int no_es_fastpath = 0;
+    int scan = 0;
+    int predict = 0;
+    int concat = 0;
+    int clips = 0;
+    double split_seconds = 0;
+    double split_mb = 0;
+    int record_run_stats = 1;
+    const char *extract_list = NULL;
+    int extract_rgb = 0;
+    int es_index = 0;
+    int write_proxy = 0;
+    Projection projection = PROJECTION_AUTO;
+    int data_streams = 0;
+    double thumbnail_seconds = 0;
+    int iframe_playlist = 0;
+    int intra_refresh = 0;
+    int phash_interval = 0;
+    int use_proxy = 1;
+    Eye eye = EYE_LEFT;
+    const char *right_input = NULL;
+    int mosaic = 0;
+    const char *right_output = NULL;
+    const char *sink_paths[SINK_MAX];
+    SinkPolicy sink_policies[SINK_MAX];
+    int sink_count = 0;
+    SinkPolicy sink_policy = SINK_POLICY_BLOCK;
     
-    // Parse command line arguments
-    if (argc < 3 || argc > 4) {
-        fprintf(stderr, "Usage: %s <input_hevc> <output_file> [skip]\n", argv[0]);
-        fprintf(stderr, "       <output_file> can be .hevc for raw HEVC or .mp4 for MP4 container\n");
-        fprintf(stderr, "       Add 'skip' to skip every other input frame\n");
-        return 1;
+    // Parse command line arguments: options first, then positional arguments
+    int positional = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            if (parse_cpu_level(argv[++i], &cpu_level) < 0) {
+                fprintf(stderr, "Unknown CPU level '%s'\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--encoder") == 0 && i + 1 < argc) {
+            encoder_name = argv[++i];
+        } else if (strcmp(argv[i], "--no-es-fastpath") == 0) {
+            no_es_fastpath = 1;
+        } else if (strcmp(argv[i], "--eye") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "right") == 0) {
+                eye = EYE_RIGHT;
+            } else if (strcmp(argv[i], "left") == 0) {
+                eye = EYE_LEFT;
+            } else {
+                fprintf(stderr, "Unknown eye '%s'\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--mosaic") == 0) {
+            mosaic = 1;
+        } else if (strcmp(argv[i], "--right-input") == 0 && i + 1 < argc) {
+            right_input = argv[++i];
+        } else if (strcmp(argv[i], "--right-output") == 0 && i + 1 < argc) {
+            right_output = argv[++i];
+        } else if (strcmp(argv[i], "--also") == 0 && i + 1 < argc) {
+            if (sink_count == SINK_MAX) {
+                fprintf(stderr, "At most %d extra outputs can be given with --also\n", SINK_MAX);
+                return 1;
+            }
+            sink_policies[sink_count] = sink_policy;
+            sink_paths[sink_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--sink-policy") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "drop") == 0) {
+                sink_policy = SINK_POLICY_DROP;
+            } else if (strcmp(argv[i], "block") == 0) {
+                sink_policy = SINK_POLICY_BLOCK;
+            } else {
+                fprintf(stderr, "Unknown sink policy '%s'\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--thumbnails") == 0 && i + 1 < argc) {
+            if (parse_positive(argv[++i], &thumbnail_seconds) < 0) {
+                fprintf(stderr, "--thumbnails needs a positive number of seconds, got '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--phash") == 0 && i + 1 < argc) {
+            phash_interval = atoi(argv[++i]);
+            if (phash_interval < 1) {
+                fprintf(stderr, "--phash needs a frame interval of at least 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--iframe-playlist") == 0) {
+            iframe_playlist = 1;
+        } else if (strcmp(argv[i], "--intra-refresh") == 0) {
+            intra_refresh = 1;
+        } else if (strcmp(argv[i], "--data-streams") == 0) {
+            data_streams = 1;
+        } else if (strcmp(argv[i], "--projection") == 0 && i + 1 < argc) {
+            i++;
+            for (projection = PROJECTION_AUTO; projection <= PROJECTION_VR180; projection++) {
+                if (strcmp(argv[i], projection_name(projection)) == 0) {
+                    break;
+                }
+            }
+            if (projection > PROJECTION_VR180) {
+                fprintf(stderr, "Unknown projection '%s'\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--write-proxy") == 0) {
+            write_proxy = 1;
+        } else if (strcmp(argv[i], "--no-proxy") == 0) {
+            use_proxy = 0;
+        } else if (strcmp(argv[i], "--es-index") == 0) {
+            es_index = 1;
+        } else if (strcmp(argv[i], "--autotune") == 0) {
+            autotune = 1;
+        } else if (strcmp(argv[i], "--concat") == 0) {
+            concat = 1;
+        } else if (strcmp(argv[i], "--clips") == 0) {
+            clips = 1;
+        } else if (strcmp(argv[i], "--split-duration") == 0 && i + 1 < argc) {
+            if (parse_positive(argv[++i], &split_seconds) < 0) {
+                fprintf(stderr, "--split-duration needs a positive number of seconds, got '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--split-size") == 0 && i + 1 < argc) {
+            if (parse_positive(argv[++i], &split_mb) < 0) {
+                fprintf(stderr, "--split-size needs a positive number of megabytes, got '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--scan") == 0) {
+            scan = 1;
+        } else if (strcmp(argv[i], "--predict") == 0) {
+            predict = 1;
+        } else if (strcmp(argv[i], "--extract") == 0 && i + 1 < argc) {
+            extract_list = argv[++i];
+        } else if (strcmp(argv[i], "--extract-format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "rgb") == 0) {
+                extract_rgb = 1;
+            } else if (strcmp(argv[i], "yuv") != 0) {
+                fprintf(stderr, "Unknown extract format '%s'\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--no-run-stats") == 0) {
+            record_run_stats = 0;
+        } else if (strcmp(argv[i], "--no-tune-cache") == 0) {
+            use_tune_cache = 0;
+        } else if (strcmp(argv[i], "--frame-stats") == 0 && i + 1 < argc) {
+            frame_stats_file = argv[++i];
+        } else if (strcmp(argv[i], "--psnr") == 0) {
+            enable_psnr = 1;
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_address = argv[++i];
+        } else if (strcmp(argv[i], "--watchdog") == 0 && i + 1 < argc) {
+            double stall_seconds;
+            if (parse_positive(argv[++i], &stall_seconds) < 0) {
+                fprintf(stderr, "--watchdog needs a positive number of seconds, got '%s'\n", argv[i]);
+                return 1;
+            }
+            watchdog.stall_us = (int64_t)(stall_seconds * 1000000);
+            watchdog_enabled = 1;
+        } else if (strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc) {
+            double budget_ms;
+            if (parse_positive(argv[++i], &budget_ms) < 0) {
+                fprintf(stderr, "--frame-budget needs a positive number of milliseconds, got '%s'\n", argv[i]);
+                return 1;
+            }
+            pipeline_metrics.frame_budget_us = (int64_t)(budget_ms * 1000);
+            watchdog_enabled = 1;
+        } else if (strcmp(argv[i], "--watchdog-dump") == 0 && i + 1 < argc) {
+            watchdog.dump_path = argv[++i];
+        } else if (strcmp(argv[i], "--watchdog-abort") == 0) {
+            watchdog.abort_on_trigger = 1;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Unknown or incomplete option '%s'\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        } else if (positional == 0) {
+            input_file = argv[i];
+            positional++;
+        } else if (positional == 1) {
+            output_file = argv[i];
+            positional++;
+        } else if ((positional == 2 || (positional == 1 && autotune)) && strcmp(argv[i], "skip") == 0) {
+            // --autotune takes no output file, so skip may follow the input directly
+            skip_frames = 1;
+            positional++;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
     }
     
-    input_file = argv[1];
-    output_file = argv[2];
+    int64_t run_start = av_gettime_relative();
+    pipeline_metrics.launch_time = run_start;
+    if (!input_file || (!output_file && !autotune && !scan && !predict)) {
+        print_usage(argv[0]);
+        return 1;
+    }
     
-    if (argc == 4 && strcmp(argv[3], "skip") == 0) {
-        skip_frames = 1;
+    if (skip_frames && !scan && !predict) {
         printf("Frame skipping enabled: processing every other input frame\n");
     }
     
+    // --clips writes one file per input, named by a pattern such as clip_%03d.mp4
+    if (clips && (concat || (output_file && !strchr(output_file, '%')))) {
+        fprintf(stderr, "--clips needs an output pattern with a clip number, e.g. clip_%%03d.mp4, "
+                "and cannot be combined with --concat\n");
+        return 1;
+    }
+    if (clips && (split_seconds > 0 || split_mb > 0)) {
+        fprintf(stderr, "--split-duration and --split-size cannot be combined with --clips\n");
+        return 1;
+    }
+    if ((clips || split_seconds > 0 || split_mb > 0) && output_file && strchr(output_file, '%') &&
+        !valid_output_pattern(output_file)) {
+        fprintf(stderr, "Output pattern '%s' needs exactly one number such as %%d or %%03d; "
+                "write any other %% as %%%%\n", output_file);
+        return 1;
+    }
+    if (data_streams && clips) {
+        fprintf(stderr, "--data-streams cannot be combined with --clips\n");
+        return 1;
+    }
+    if (write_proxy && (concat || clips)) {
+        fprintf(stderr, "--write-proxy works on a single input and cannot be combined with --concat or --clips\n");
+        return 1;
+    }
+    if (right_output && !right_input) {
+        fprintf(stderr, "--right-output needs the right eye's input, given with --right-input\n");
+        return 1;
+    }
+    if (right_input && (concat || clips || extract_list || write_proxy || eye == EYE_RIGHT)) {
+        fprintf(stderr, "--right-input cannot be combined with --concat, --clips, --extract, --write-proxy "
+                "or --eye right\n");
+        return 1;
+    }
+    if (mosaic && (concat || clips || extract_list || write_proxy || right_input || eye == EYE_RIGHT)) {
+        fprintf(stderr, "--mosaic cannot be combined with --concat, --clips, --extract, --write-proxy, "
+                "--right-input or --eye right\n");
+        return 1;
+    }
+    if (intra_refresh && (strcmp(encoder_name, "x265") != 0 || split_seconds > 0 || split_mb > 0 || iframe_playlist)) {
+        fprintf(stderr, "--intra-refresh needs the x265 encoder and leaves no IDRs to start split segments or "
+                "list in an I-frame playlist\n");
+        return 1;
+    }
+    for (int i = 0; intra_refresh && i < sink_count; i++) {
+        const char *ext = strrchr(sink_paths[i], '.');
+        if (ext && !strcasecmp(ext, ".m3u8")) {
+            fprintf(stderr, "--intra-refresh leaves no IDRs to start HLS segments in %s\n", sink_paths[i]);
+            return 1;
+        }
+    }
+    if (write_proxy && eye == EYE_RIGHT) {
+        fprintf(stderr, "--write-proxy keeps the left eye and cannot be combined with --eye right\n");
+        return 1;
+    }
+    if (extract_list && (concat || clips)) {
+        fprintf(stderr, "--extract reads a single input and cannot be combined with --concat or --clips\n");
+        return 1;
+    }
+    
+    // With --concat, --clips or --mosaic the input argument is a list of files; single-input modes
+    // use its first entry
+    ProcessingContext ctx = {0};
+    const char **mosaic_inputs = NULL;
+    int mosaic_count = 0;
+    if (concat || clips || mosaic) {
+        if (load_input_list(&ctx, input_file) < 0) {
+            return 1;
+        }
+    } else {
+        ctx.inputs = malloc(sizeof(*ctx.inputs));
+        if (!ctx.inputs) {
+            return 1;
+        }
+        ctx.inputs[0] = input_file;
+        ctx.input_count = 1;
+    }
+    
+    // Mosaic tiles other than the first are decoded on their own threads, not as a sequence
+    if (mosaic) {
+        if (ctx.input_count < 2 || ctx.input_count > MOSAIC_MAX) {
+            fprintf(stderr, "--mosaic needs 2 to %d inputs, %s lists %d\n", MOSAIC_MAX, input_file, ctx.input_count);
+            cleanup(&ctx);
+            return 1;
+        }
+        mosaic_inputs = ctx.inputs;
+        mosaic_count = ctx.input_count;
+        ctx.input_count = 1;
+    }
+    input_file = ctx.inputs[0];
+    ctx.eye = eye;
+    ctx.base_view_id = -1;
+    
+    // Detect CPU features before any codec is opened
+    if (init_cpu_dispatch(cpu_level) < 0) {
+        return 1;
+    }
+    
+    // Scan and predict only parse headers; they run before anything else is printed so stdout stays JSON
+    if (scan) {
+        return run_scan(input_file, output_file, skip_frames, encoder_name, no_es_fastpath) < 0 ? 1 : 0;
+    }
+    if (predict) {
+        return run_predict(input_file, skip_frames, encoder_name, no_es_fastpath) < 0 ? 1 : 0;
+    }
+    printf("CPU dispatch: using %s kernels\n", cpu_level_name(cpu_dispatch.active));
+    
+    // Calibration mode replaces the normal run
+    if (autotune) {
+        return run_autotune(input_file, skip_frames, no_es_fastpath) < 0 ? 1 : 0;
+    }
+    
+    // Frame extraction decodes without an encoder; seeking needs the demuxer, not the mapped reader
+    if (extract_list) {
+        ctx.threads = default_thread_profile;
+        if (use_tune_cache) {
+            load_thread_profile(&ctx.threads, skip_frames);
+        }
+        ctx.no_es_fastpath = 1;
+        int extract_ret = run_extract(&ctx, extract_list, output_file, extract_rgb);
+        cleanup(&ctx);
+        return extract_ret < 0 ? 1 : 0;
+    }
+    
     // Detect output format based on file extension
     int mp4_output = 0;
     const char *ext = strrchr(output_file, '.');
@@ -552,41 +6923,89 @@ int main(int argc, char *argv[]) {
     } else {
         printf("Using raw HEVC for output\n");
     }
+    if (iframe_playlist && !mp4_output) {
+        fprintf(stderr, "--iframe-playlist needs MP4 output\n");
+        cleanup(&ctx);
+        return 1;
+    }
+    if (es_index && mp4_output) {
+        fprintf(stderr, "--es-index is for raw HEVC output; MP4 output is already indexed\n");
+        cleanup(&ctx);
+        return 1;
+    }
     
-    ProcessingContext ctx = {0};
     ctx.skip_frames = skip_frames;
     ctx.mp4_output = mp4_output;
+    ctx.threads = default_thread_profile;
+    ctx.enable_psnr = enable_psnr;
+    ctx.encoder_name = encoder_name;
+    ctx.no_es_fastpath = no_es_fastpath;
+    ctx.es_index_enabled = es_index;
+    ctx.projection = projection;
+    ctx.data_passthrough = data_streams;
+    ctx.iframe_playlist = iframe_playlist;
+    ctx.intra_refresh = intra_refresh;
     int ret;
     
+    // Use the profile found by an earlier --autotune on this host
+    if (use_tune_cache && load_thread_profile(&ctx.threads, skip_frames) == 0) {
+        printf("Using tuned thread profile: decoder %d, frame threads %d, pool %d\n",
+               ctx.threads.decoder_threads, ctx.threads.frame_threads, ctx.threads.pool_threads);
+    }
+    
+    // Re-encodes of a source decode its proxy from an earlier --write-proxy run instead, when cached;
+    // proxies hold the left eye, no data streams and no projection for --projection auto to copy
+    if (use_proxy && !write_proxy && !data_streams && projection != PROJECTION_AUTO && eye == EYE_LEFT &&
+        !right_input && !mosaic &&
+        ctx.input_count == 1 &&
+        proxy_cache_path(input_file, ctx.proxy_input, sizeof(ctx.proxy_input), 0) == 0 &&
+        access(ctx.proxy_input, R_OK) == 0) {
+        printf("Using proxy %s for %s\n", ctx.proxy_input, input_file);
+        ctx.inputs[0] = input_file = ctx.proxy_input;
+        ctx.from_proxy = 1;
+    }
+    
     // Initialize components
-    if (init_decoder(&ctx, input_file) < 0 || init_encoder(&ctx) < 0) {
+    if (init_pipeline(&ctx, input_file) < 0) {
         fprintf(stderr, "Error: Initialization failed\n");
         cleanup(&ctx);
         return 1;
     }
     
-    // Initialize output based on format
-    if (mp4_output) {
-        if (init_mp4_muxer(&ctx, output_file) < 0) {
-            fprintf(stderr, "Error: MP4 muxer initialization failed\n");
-            cleanup(&ctx);
-            return 1;
-        }
-    } else {
-        // Open raw HEVC output file
-        ctx.output_file = fopen(output_file, "wb");
-        if (!ctx.output_file) {
-            fprintf(stderr, "Error: Could not open output file: %s\n", output_file);
+    // MP4 outputs carry the projection as stream side data, raw outputs as an SEI
+    if (!ctx.mp4_output && set_projection_sei(&ctx) < 0) {
+        cleanup(&ctx);
+        return 1;
+    }
+    
+    // Sprite sheets are built on their own thread from copies of the scaled pictures
+    if (thumbnail_seconds > 0 && start_thumbnail_writer(&ctx, output_file, thumbnail_seconds) < 0) {
+        cleanup(&ctx);
+        return 1;
+    }
+    
+    if (phash_interval > 0 && open_phash_writer(&ctx, strchr(output_file, '%') ? input_file : output_file,
+                                                phash_interval) < 0) {
+        cleanup(&ctx);
+        return 1;
+    }
+    
+    // The proxy is encoded from the same decoded frames as the output
+    if (write_proxy) {
+        char proxy_path[PATH_MAX];
+        if (proxy_cache_path(input_file, proxy_path, sizeof(proxy_path), 1) < 0 ||
+            open_proxy_writer(&ctx, proxy_path) < 0) {
+            fprintf(stderr, "Error: Could not set up the proxy for %s\n", input_file);
             cleanup(&ctx);
             return 1;
         }
     }
     
-    // Process frames
-    int frame_count = 0;      // Count of processed frames
-    int input_frame_count = 0; // Count of input frames seen
-    x265_nal *nals = NULL;
-    uint32_t nal_count = 0;
+    // Per-frame statistics are optional
+    if (frame_stats_file && open_frame_stats(&ctx, frame_stats_file) < 0) {
+        cleanup(&ctx);
+        return 1;
+    }
     
     // For timestamp conversion
     AVRational input_time_base;
@@ -610,39 +7029,139 @@ int main(int argc, char *argv[]) {
                              (OUTPUT_TIMEBASE / FRAME_RATE);
                              
     printf("Using timestamp increment of %d units per frame\n", timestamp_increment);
+    ctx.timestamp_increment = timestamp_increment;
     
     printf("Starting to process frames...\n");
     
-    // Get the headers from the encoder first (VPS, SPS, PPS)
-    ret = x265_encoder_headers(ctx.encoder, &nals, &nal_count);
-    if (ret < 0) {
-        fprintf(stderr, "Error getting encoder headers\n");
+    // Live metrics: ETA needs the input length when the container declares it
+    pipeline_metrics.start_time = av_gettime_relative();
+    pipeline_metrics.output_fps = ctx.skip_frames ? FRAME_RATE / 2 : FRAME_RATE;
+    AVStream *in_stream = ctx.fmt_ctx && ctx.input_count == 1 ? ctx.fmt_ctx->streams[ctx.video_stream_idx] : NULL;
+    if (in_stream && in_stream->nb_frames > 0) {
+        atomic_store(&pipeline_metrics.expected_frames, in_stream->nb_frames);
+    } else if (in_stream && ctx.fmt_ctx->duration > 0 && in_stream->avg_frame_rate.den > 0) {
+        atomic_store(&pipeline_metrics.expected_frames,
+                     (long long)(ctx.fmt_ctx->duration * av_q2d(in_stream->avg_frame_rate) / AV_TIME_BASE));
+    }
+    if (metrics_address && start_metrics_server(metrics_address) < 0) {
+        cleanup(&ctx);
+        return 1;
+    }
+    if (watchdog_enabled && start_watchdog() < 0) {
+        cleanup(&ctx);
+        return 1;
+    }
+    
+    // Split outputs are numbered: out.mp4 becomes out_000.mp4, out_001.mp4, ... unless a pattern is given
+    if (split_seconds > 0 || split_mb > 0) {
+        ctx.split_duration = (int64_t)(split_seconds * OUTPUT_TIMEBASE);
+        ctx.split_bytes = (int64_t)(split_mb * 1024 * 1024);
+        ctx.segment_start_pts = -1;
+        if (strchr(output_file, '%')) {
+            ctx.output_pattern = output_file;
+        } else {
+            const char *dot = strrchr(output_file, '.');
+            int stem = dot && !strchr(dot, '/') ? (int)(dot - output_file) : (int)strlen(output_file);
+            snprintf(ctx.output_pattern_buf, sizeof(ctx.output_pattern_buf), "%.*s_%%03d%s",
+                     stem, output_file, output_file + stem);
+            ctx.output_pattern = ctx.output_pattern_buf;
+        }
+    }
+    
+    // The right eye is decoded on its own thread from here on; side by side, the MP4 muxer
+    // describes the packed layout
+    if (right_input) {
+        if (right_output && !ctx.encoder) {
+            fprintf(stderr, "--right-output needs the x265 encoder\n");
+            cleanup(&ctx);
+            return 1;
+        }
+        if (open_stereo_input(&ctx, right_input, right_output) < 0) {
+            cleanup(&ctx);
+            return 1;
+        }
+    }
+    
+    if (mosaic && open_mosaic(&ctx, mosaic_inputs, mosaic_count) < 0) {
         cleanup(&ctx);
         return 1;
     }
     
-    // Write headers based on output format
-    if (mp4_output) {
-        // Store HEVC headers as extradata for MP4
-        if (write_hevc_headers_to_mp4(&ctx, nals, nal_count) < 0) {
-            fprintf(stderr, "Failed to write HEVC headers to MP4\n");
+    // Open the output (the first clip's or segment's); the encoder's parameter sets go first
+    char first_output[PATH_MAX];
+    if (ctx.output_pattern && !clips) {
+        clip_output_path(&ctx, 0, first_output, sizeof(first_output));
+    } else if (clips) {
+        ctx.clip_mode = 1;
+        ctx.output_pattern = output_file;
+        ctx.clip_start_pts = malloc(ctx.input_count * sizeof(*ctx.clip_start_pts));
+        if (!ctx.clip_start_pts) {
             cleanup(&ctx);
             return 1;
         }
+        for (int c = 0; c < ctx.input_count; c++) {
+            ctx.clip_start_pts[c] = -1;
+        }
+        clip_output_path(&ctx, 0, first_output, sizeof(first_output));
     } else {
-        // Write headers to raw HEVC output file
-        for (uint32_t i = 0; i < nal_count; i++) {
-            // Add HEVC start code (0x00 0x00 0x01)
-            uint8_t start_code[4] = {0, 0, 0, 1};
-            fwrite(start_code, 1, 4, ctx.output_file);
-            
-            // Write NAL unit
-            fwrite(nals[i].payload, 1, nals[i].sizeBytes, ctx.output_file);
+        snprintf(first_output, sizeof(first_output), "%s", output_file);
+    }
+    if (open_output(&ctx, first_output) < 0) {
+        cleanup(&ctx);
+        return 1;
+    }
+    if (ctx.data_passthrough && record_data_layout(&ctx) < 0) {
+        cleanup(&ctx);
+        return 1;
+    }
+    if (ctx.data_passthrough && !ctx.data_stream_map) {
+        if (count_data_streams(&ctx) == 0) {
+            printf("No data streams to copy in %s\n", input_file);
+        } else if (open_data_sidecar(&ctx, strchr(output_file, '%') ? first_output : output_file) < 0) {
+            cleanup(&ctx);
+            return 1;
+        }
+    }
+    for (int s = 0; s < sink_count; s++) {
+        if (add_sink(&ctx, sink_paths[s], sink_policies[s]) < 0) {
+            cleanup(&ctx);
+            return 1;
         }
     }
+    if (ctx.output_pattern && (!clips || ctx.input_count > 1)) {
+        char next_output[PATH_MAX];
+        clip_output_path(&ctx, 1, next_output, sizeof(next_output));
+        start_output_opener(&ctx, next_output);
+    }
     
-    // Main processing loop using FFmpeg's demuxing API
-    while (av_read_frame(ctx.fmt_ctx, ctx.pkt) >= 0) {
+    // Main processing loop using FFmpeg's demuxing API; an error still flushes what was encoded,
+    // but fails the run
+    int run_failed = 0;
+    while (1) {
+        int64_t read_start = stage_begin(STAGE_DEMUX);
+        ret = read_input_packet(&ctx);
+        stage_done(STAGE_DEMUX, read_start, ret >= 0);
+        if (ret < 0) {
+            // A read error is not the end of the input: the output, and a proxy in particular,
+            // would be published as complete
+            if (ret != AVERROR_EOF) {
+                fprintf(stderr, "Error reading input %s: %d\n", ctx.inputs[ctx.input_index], ret);
+                run_failed = 1;
+                break;
+            }
+            
+            // Concatenated inputs continue in the same decoder and encoder session
+            ret = advance_input(&ctx);
+            if (ret == 0) {
+                continue;
+            }
+            if (ret != AVERROR_EOF) {
+                fprintf(stderr, "Error: Could not continue with the next input\n");
+                run_failed = 1;
+            }
+            break;
+        }
+        
         // Check if this packet belongs to the video stream
         if (ctx.pkt->stream_index == ctx.video_stream_idx) {
             // Save packet timestamp for later use if frame PTS is invalid
@@ -650,7 +7169,9 @@ int main(int argc, char *argv[]) {
             int64_t pkt_dts = ctx.pkt->dts;
             
             // Send packet to decoder
+            int64_t stage_start = stage_begin(STAGE_DECODE);
             ret = avcodec_send_packet(ctx.decoder_ctx, ctx.pkt);
+            stage_done(STAGE_DECODE, stage_start, 0);
             if (ret < 0) {
                 fprintf(stderr, "Error sending packet for decoding\n");
                 av_packet_unref(ctx.pkt);
@@ -658,136 +7179,69 @@ int main(int argc, char *argv[]) {
             }
             
             // Receive decoded frames
-            while (ret >= 0) {
-                ret = avcodec_receive_frame(ctx.decoder_ctx, ctx.frame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    break;
-                } else if (ret < 0) {
-                    fprintf(stderr, "Error during decoding\n");
-                    break;
-                }
-                
-                // Decide whether to process this frame or skip it
-                int should_process = 1;
-                if (ctx.skip_frames && (input_frame_count % 2 == 1)) {
-                    should_process = 0;  // Skip this frame
-                }
-                
-                if (should_process) {
-                    // Process frame: crop and scale using SwScale
-                    process_frame_with_swscale(&ctx, ctx.frame);
-                    
-                    // Get timestamp from input frame for informational purposes
-                    int64_t input_pts = ctx.frame->pts;
-                    if (input_pts == AV_NOPTS_VALUE) {
-                        // If no valid PTS in the frame, try packet PTS or DTS
-                        if (pkt_pts != AV_NOPTS_VALUE) {
-                            input_pts = pkt_pts;
-                        } else if (pkt_dts != AV_NOPTS_VALUE) {
-                            input_pts = pkt_dts;
-                        } else {
-                            // Last resort: use frame count
-                            input_pts = input_frame_count;
-                        }
-                    }
-                    
-                    // Calculate timestamp for output frame based on frame count and timebase
-                    int64_t output_pts = frame_count * timestamp_increment;
-                    
-                    printf("Frame %d: Input PTS = %lld, Output PTS = %lld\n", 
-                          input_frame_count, (long long)input_pts, (long long)output_pts);
-                    
-                    // Prepare for encoding with correct timestamps for timebase 1/48000
-                    prepare_for_encoding(&ctx, output_pts);
-                    
-                    // Force keyframe at the start
-                    if (frame_count == 0) {
-                        ctx.enc_pic->sliceType = X265_TYPE_IDR;
-                    }
-                    
-                    // Encode the frame
-                    ret = x265_encoder_encode(ctx.encoder, &nals, &nal_count, ctx.enc_pic, NULL);
-                    if (ret < 0) {
-                        fprintf(stderr, "Error encoding frame: %d\n", ret);
-                        break;
-                    }
-                    
-                    // Process encoded NALs based on output format
-                    if (nal_count > 0) {
-                        if (mp4_output) {
-                            // Write to MP4 container
-                            int is_keyframe = 0;
-                            // Check if this is a keyframe by looking for IDR NAL type
-                            for (uint32_t i = 0; i < nal_count; i++) {
-                                // HEVC NAL unit type is in the first byte, bits 1-6 (7 bits total)
-                                uint8_t nal_type = (nals[i].payload[0] >> 1) & 0x3F;
-                                // Types 16-21 are IRAP (keyframe) types
-                                if (nal_type >= 16 && nal_type <= 21) {
-                                    is_keyframe = 1;
-                                    break;
-                                }
-                            }
-                            
-                            write_nals_to_mp4(&ctx, nals, nal_count, output_pts, is_keyframe);
-                        } else {
-                            // Write to raw HEVC file
-                            for (uint32_t i = 0; i < nal_count; i++) {
-                                // Add HEVC start code (0x00 0x00 0x01)
-                                uint8_t start_code[4] = {0, 0, 0, 1};
-                                fwrite(start_code, 1, 4, ctx.output_file);
-                                
-                                // Write NAL unit
-                                fwrite(nals[i].payload, 1, nals[i].sizeBytes, ctx.output_file);
-                            }
-                        }
-                    }
-                    
-                    frame_count++;
-                    
-                    // Print progress
-                    if (frame_count % 10 == 0) {
-                        printf("Processed %d frames\n", frame_count);
-                    }
-                } else {
-                    printf("Skipping input frame %d\n", input_frame_count);
-                }
-                
-                input_frame_count++;
-                
-                // Unref the frame
-                av_frame_unref(ctx.frame);
+            if (receive_and_encode_frames(&ctx, pkt_pts, pkt_dts) < 0) {
+                av_packet_unref(ctx.pkt);
+                run_failed = 1;
+                break;
             }
+        } else if (ctx.data_passthrough && write_data_packet(&ctx, ctx.pkt) < 0) {
+            // Telemetry and other data streams are copied without decoding
+            av_packet_unref(ctx.pkt);
+            run_failed = 1;
+            break;
         }
         
         // Unref the packet
         av_packet_unref(ctx.pkt);
     }
     
-    // Flush encoder
-    while (1) {
-        ret = x265_encoder_encode(ctx.encoder, &nals, &nal_count, NULL, NULL);
-        if (ret <= 0) break;
-        
-        // Process remaining NALs
-        if (mp4_output) {
-            // Write to MP4 container - we assume flush packets are not keyframes
-            write_nals_to_mp4(&ctx, nals, nal_count, ctx.next_pts + timestamp_increment, 0);
-            ctx.next_pts += timestamp_increment;
-        } else {
-            // Write to raw HEVC file
-            for (uint32_t i = 0; i < nal_count; i++) {
-                // Add HEVC start code (0x00 0x00 0x01)
-                uint8_t start_code[4] = {0, 0, 0, 1};
-                fwrite(start_code, 1, 4, ctx.output_file);
-                
-                // Write NAL unit
-                fwrite(nals[i].payload, 1, nals[i].sizeBytes, ctx.output_file);
-            }
-        }
+    // Frames still inside the decoder, then the encoder
+    if (flush_decoder(&ctx) < 0) {
+        run_failed = 1;
+    }
+    if (ctx.backend->flush(&ctx) < 0 || drain_encoder(&ctx) != AVERROR_EOF) {
+        fprintf(stderr, "Error flushing encoder\n");
+        run_failed = 1;
+    }
+    
+    // Only a proxy of the whole source is kept; cleanup drops a partial one
+    if (ctx.proxy.file && ret == AVERROR_EOF && !run_failed) {
+        finish_proxy_writer(&ctx);
+    }
+    
+    if (ctx.stereo.encoder && finish_right_eye(&ctx) < 0) {
+        fprintf(stderr, "Error flushing the right-eye encoder\n");
+        run_failed = 1;
     }
     
-    printf("Done! Processed %d frames out of %d input frames\n", frame_count, input_frame_count);
+    close_thumbnail_writer(&ctx);
+    int sinks_failed = close_sinks(&ctx) < 0;
+    if (ctx.stereo.right.path) {
+        printf("Right eye: %lld frames paired with the left eye, %lld dropped, %lld repeated\n",
+               (long long)ctx.stereo.right.paired, (long long)ctx.stereo.right.dropped,
+               (long long)ctx.stereo.right.repeated);
+        sinks_failed |= close_stereo_input(&ctx) < 0;
+    }
+    for (int m = 0; m < ctx.mosaic.count - 1; m++) {
+        FrameSource *fs = &ctx.mosaic.sources[m];
+        printf("Mosaic tile %d (%s): %lld frames paired, %lld dropped, %lld repeated\n", m + 1, fs->path,
+               (long long)fs->paired, (long long)fs->dropped, (long long)fs->repeated);
+    }
+    if (ctx.phash.file) {
+        printf("Wrote %lld perceptual hashes\n", (long long)ctx.phash.count);
+    }
+    
+    printf("Done! Processed %d frames out of %d input frames\n", ctx.frame_count, ctx.input_frame_count);
+    if (ctx.data_passthrough) {
+        printf("Copied %lld data packets\n", (long long)ctx.data_packets);
+    }
+    print_stats_report(&ctx, ctx.frame_count, ctx.input_frame_count);
+    
+    // Feed the cost model behind --predict; failed runs stopped early and would skew it
+    if (record_run_stats && !run_failed && !sinks_failed) {
+        append_run_stats(&ctx, ctx.input_frame_count, ctx.frame_count, av_gettime_relative() - run_start);
+    }
     
     cleanup(&ctx);
-    return 0;
+    return run_failed || sinks_failed ? 1 : 0;
 }